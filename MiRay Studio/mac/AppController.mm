@@ -269,6 +269,21 @@
 	self.pSceneView->SetRenderMode(mr::SceneView::RM_OPENCL);
 }
 
+- (IBAction)onContinuousSampling:(id)sender
+{
+	self.pSceneView->SetContinuousSampling(!self.pSceneView->ContinuousSampling());
+}
+
+- (IBAction)onSortAmbientOcclusionRays:(id)sender
+{
+	self.pSceneView->SetAmbientOcclusionRaysSorting(!self.pSceneView->AmbientOcclusionRaysSorting());
+}
+
+- (IBAction)onStacklessTraversal:(id)sender
+{
+	self.pSceneView->SetStacklessTraversal(!self.pSceneView->StacklessTraversal());
+}
+
 - (BOOL)validateUserInterfaceItem:(id <NSValidatedUserInterfaceItem>)item
 {
 	NSMenuItem *it = (id)item;
@@ -290,6 +305,12 @@
 		it.state = self.pSceneView->RenderMode() == mr::SceneView::RM_SOFTWARE ? NSOnState : NSOffState;
 	else if (s == @selector(onOpenCLMode:))
 		it.state = self.pSceneView->RenderMode() == mr::SceneView::RM_OPENCL ? NSOnState : NSOffState;
+	else if (s == @selector(onContinuousSampling:))
+		it.state = self.pSceneView->ContinuousSampling() ? NSOnState : NSOffState;
+	else if (s == @selector(onSortAmbientOcclusionRays:))
+		it.state = self.pSceneView->AmbientOcclusionRaysSorting() ? NSOnState : NSOffState;
+	else if (s == @selector(onStacklessTraversal:))
+		it.state = self.pSceneView->StacklessTraversal() ? NSOnState : NSOffState;
 	
 	return YES;
 }
@@ -416,6 +416,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		case ID_MODE_OPENGL:				g_pSceneView->SetRenderMode(mr::SceneView::RM_OPENGL); break;
 		case ID_MODE_SOFTWARE:				g_pSceneView->SetRenderMode(mr::SceneView::RM_SOFTWARE); break;
 		case ID_MODE_OPENCL:				g_pSceneView->SetRenderMode(mr::SceneView::RM_OPENCL); break;
+		case ID_MODE_CONTINUOUS_SAMPLING:	g_pSceneView->SetContinuousSampling(!g_pSceneView->ContinuousSampling()); break;
+		case ID_MODE_SORT_AO_RAYS:			g_pSceneView->SetAmbientOcclusionRaysSorting(!g_pSceneView->AmbientOcclusionRaysSorting()); break;
+		case ID_MODE_STACKLESS_TRAVERSAL:	g_pSceneView->SetStacklessTraversal(!g_pSceneView->StacklessTraversal()); break;
 		default:	
 			return DefWindowProc(hWnd, message, wParam, lParam);
 		}
@@ -472,6 +475,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 			case '1': g_pSceneView->SetRenderMode(mr::SceneView::RM_OPENGL); break;
 			case '2': g_pSceneView->SetRenderMode(mr::SceneView::RM_SOFTWARE); break;
 			case '3': g_pSceneView->SetRenderMode(mr::SceneView::RM_OPENCL); break;
+			case '4': g_pSceneView->SetContinuousSampling(!g_pSceneView->ContinuousSampling()); break;
+			case '5': g_pSceneView->SetAmbientOcclusionRaysSorting(!g_pSceneView->AmbientOcclusionRaysSorting()); break;
+			case '6': g_pSceneView->SetStacklessTraversal(!g_pSceneView->StacklessTraversal()); break;
 			}
 		}
 		else
@@ -0,0 +1,480 @@
+//
+//  rtbench.cpp
+//  MiRay/bench
+//
+//  Ray tracing core benchmark and regression check on a generated scene, no models or UI needed:
+//  - collision tree build time of both presets for 1..NumCPU threads,
+//  - closest hit rays traced one by one and in 4x4 packets: pinhole and depth of field camera, bounces from the hits,
+//  - any hit shadow rays one by one and in packets,
+//  for every tree layout. Packet and any hit results are compared to the single closest hit rays,
+//  the exit code is 1 if any of them differs. The last part renders frames by the software renderer.
+//
+//  Build from the repository root, e.g.
+//    g++ -O2 -std=c++11 -msse4.1 -pthread -include cstring -include cstdint -include memory -include rt/precompiled.h
+//        bench/rtbench.cpp rt/BVH.cpp rt/Collision*.cpp rt/Sampler.cpp rt/SoftwareRenderer.cpp common/*.cpp -o rtbench
+//  (GCC needs -fpermissive for the member functions named after their types in CollisionRay.h and CollisionTriangle.h)
+//
+
+#include "../rt/SoftwareRenderer.h"
+#include "../rt/CollisionPacket.h"
+#include "../rt/Material.h"
+#include "../rt/Light.h"
+#include "../rt/Image.h"
+#include "../common/threadpool.h"
+#include "../common/timer.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace mr;
+
+enum
+{
+	IMAGE_SIZE = 256,
+	NUM_RAY_PASSES = 2, // every camera ray of the image is traced this many times for the timings
+	NUM_RENDER_FRAMES = 4,
+};
+
+// ------------------------------------------------------------------------ //
+
+class BenchMaterial : public IMaterial, public IMaterialLayer
+{
+public:
+	Vec3 Ambient(const MaterialContext &) const { return Vec3::Null; }
+	Vec3 Emissive(const MaterialContext &) const { return Vec3::Null; }
+	Vec3 Diffuse(const MaterialContext &) const { return Vec3(0.8f); }
+	Vec3 Opacity(const MaterialContext &) const { return Vec3(1.f); }
+	Vec3 IndexOfRefraction() const { return Vec3(1.f); }
+
+	bool FresnelReflection() const { return false; }
+	bool RaytracedReflection() const { return false; }
+
+	Vec3 Reflection(const MaterialContext &) const { return Vec3::Null; }
+	Vec3 ReflectionTint(const MaterialContext &) const { return Vec3(1.f); }
+	float ReflectionRoughness(const MaterialContext &) const { return 0.f; }
+	bool HasReflectionExitColor() const { return false; }
+	Vec3 ReflectionExitColor(const MaterialContext &) const { return Vec3::Null; }
+	bool HasReflectionMap() const { return false; }
+	Vec3 ReflectionMap(const MaterialContext &) const { return Vec3::Null; }
+
+	Vec3 RefractionTint(const MaterialContext &) const { return Vec3(1.f); }
+	float RefractionRoughness(const MaterialContext &) const { return 0.f; }
+	bool HasRefractionExitColor() const { return false; }
+	Vec3 RefractionExitColor(const MaterialContext &) const { return Vec3::Null; }
+
+	Vec3 AbsorbtionCoefficient() const { return Vec3::Null; }
+
+	bool HasBumpMap() const { return false; }
+	float BumpDepth() const { return 0.f; }
+	float BumpMapDepth(const Vec2 &) const { return 0.f; }
+	Vec3 BumpMapNormal(const MaterialContext & mc) const { return mc.normal; }
+
+	size_t NumLayers() const { return 1; }
+	const IMaterialLayer * Layer(size_t) const { return this; }
+};
+
+class BenchImage : public IImage
+{
+	int		m_width, m_height;
+	std::vector<ColorF>	m_pixels;
+
+public:
+	BenchImage(int width, int height) : m_width(width), m_height(height), m_pixels(width * height, ColorF::Null) {}
+
+	int Width() const { return m_width; }
+	int Height() const { return m_height; }
+	const void * Data() const { return m_pixels.data(); }
+	void * Data() { return m_pixels.data(); }
+
+	void SetPixel(int x, int y, const ColorF & c) { m_pixels[y * m_width + x] = c; }
+	ColorF GetPixel(int x, int y) const { return m_pixels[y * m_width + x]; }
+	ColorF GetPixelUV(float u, float v) const { return GetPixel(int(u * (m_width - 1)), int(v * (m_height - 1))); }
+
+	Vec3 GetPixelColor(int x, int y) const { const ColorF & c = GetPixel(x, y); return Vec3(c.r, c.g, c.b); }
+	Vec3 GetPixelColorUV(float u, float v) const { const ColorF c = GetPixelUV(u, v); return Vec3(c.r, c.g, c.b); }
+
+	float GetPixelOpacity(int x, int y) const { return GetPixel(x, y).a; }
+	float GetPixelOpacityUV(float u, float v) const { return GetPixelUV(u, v).a; }
+};
+
+class BenchLight : public ILight
+{
+	Vec3	m_origin;
+	float	m_radius;
+
+public:
+	BenchLight(const Vec3 & origin, float radius) : m_origin(origin), m_radius(radius) {}
+
+	Vec3 Position(const Vec3 & p, const Vec3 & sample) const
+	{
+		Vec3 delta = sample * m_radius;
+		return Vec3::Dot(delta, p - m_origin) > 0.f ? m_origin + delta : m_origin - delta;
+	}
+	Vec3 Intensity(float squared_distance) const { return Vec3(400.f) / squared_distance; }
+	Vec3 Intensity(const Vec3 &, const Vec3 &) const { return Vec3::Null; }
+};
+
+// ------------------------------------------------------------------------ //
+
+static Vec3 Rand3(Random & rnd)
+{
+	return UniformSphere(Vec2(rnd.Float(), rnd.Float()));
+}
+
+// ground, a grid of spheres on it and a cloud of small random triangles between them
+static void CreateScene(CollisionTriangleArray & triangles, const IMaterial * pMaterial)
+{
+	const int GROUND = 64, SPHERES = 6, SEGMENTS = 32, CLOUD = 20000;
+
+	for (int y = 0; y < GROUND; y++)
+	{
+		for (int x = 0; x < GROUND; x++)
+		{
+			const Vec3 p(x - GROUND * 0.5f, y - GROUND * 0.5f, 0.f);
+			const Vertex v0(p), v1(p + Vec3(1.f, 0.f, 0.f)), v2(p + Vec3(1.f, 1.f, 0.f)), v3(p + Vec3(0.f, 1.f, 0.f));
+			triangles.push_back(CollisionTriangle(v0, v1, v2, pMaterial));
+			triangles.push_back(CollisionTriangle(v0, v2, v3, pMaterial));
+		}
+	}
+
+	for (int j = 0; j < SPHERES; j++)
+	{
+		for (int i = 0; i < SPHERES; i++)
+		{
+			const Vec3 center((i - SPHERES * 0.5f + 0.5f) * 8.f, (j - SPHERES * 0.5f + 0.5f) * 8.f, 3.f);
+			for (int b = 0; b < SEGMENTS / 2; b++)
+			{
+				for (int a = 0; a < SEGMENTS; a++)
+				{
+					Vertex v[4];
+					for (int k = 0; k < 4; k++)
+					{
+						const float yaw = (a + (k == 1 || k == 2)) * (M_2PIf / SEGMENTS);
+						const float pitch = (b + (k >= 2)) * (M_PIf / (SEGMENTS / 2)) - M_PI_2f;
+						v[k] = Vertex(center + Vec3(cosf(pitch) * cosf(yaw), cosf(pitch) * sinf(yaw), sinf(pitch)) * 3.f);
+					}
+					triangles.push_back(CollisionTriangle(v[0], v[1], v[2], pMaterial));
+					triangles.push_back(CollisionTriangle(v[0], v[2], v[3], pMaterial));
+				}
+			}
+		}
+	}
+
+	Random rnd(1, 0);
+	for (int i = 0; i < CLOUD; i++)
+	{
+		const Vec3 p((rnd.Float() - 0.5f) * 48.f, (rnd.Float() - 0.5f) * 48.f, rnd.Float() * 10.f + 0.5f);
+		const Vertex v0(p), v1(p + Rand3(rnd) * 0.4f), v2(p + Rand3(rnd) * 0.4f);
+		triangles.push_back(CollisionTriangle(v0, v1, v2, pMaterial));
+	}
+}
+
+struct Camera
+{
+	Matrix	matCamera;
+	Matrix	matViewProj;
+	Vec3	vEye;
+	Vec3	vDelta[3]; // like SoftwareRenderer::m_vCamDelta
+
+	Camera(const BBox & bbox)
+	{
+		const float l = bbox.Size().Length();
+		Matrix matProj, matView;
+		CalculateProjectionMatrix(matProj, 60.f, 1.f, l * 0.001f, l * 10.f);
+		CalculateCameraMatrix(matCamera, bbox.Center(), l * 0.6f, -60.f, 25.f);
+		matView.Inverse(matCamera);
+		matViewProj = matView * matProj;
+
+		Matrix matViewProjInv;
+		matViewProjInv.Inverse(matViewProj);
+		const Vec4 corners[3] = { Vec4(0.f, 0.f, 1.f, 1.f), Vec4(1.f, 0.f, 1.f, 1.f), Vec4(0.f, 1.f, 1.f, 1.f) };
+		for (int i = 0; i < 3; i++)
+		{
+			Vec4 p = corners[i];
+			p.Transform(matViewProjInv);
+			vDelta[i] = Vec3(p.x, p.y, p.z) / p.w;
+		}
+		vDelta[0] -= vDelta[2];
+		vDelta[1] -= vDelta[2];
+		vEye = matCamera.Pos();
+	}
+
+	// the lens offset moves the origin, the point at half of the ray stays in focus
+	void Ray(int x, int y, const Vec2 & lens, Vec3 & vFrom, Vec3 & vTo) const
+	{
+		const float px = (x + 0.5f) * (2.f / IMAGE_SIZE) - 1.f, py = (y + 0.5f) * (2.f / IMAGE_SIZE) - 1.f;
+		vTo = vDelta[2] + vDelta[0] * px - vDelta[1] * py;
+		vFrom = vEye + (vDelta[0] * lens.x + vDelta[1] * lens.y) * 0.05f;
+		vTo = vFrom + (Vec3::Lerp(vEye, vTo, 0.5f) - vFrom) * 2.f;
+	}
+};
+
+// ------------------------------------------------------------------------ //
+
+struct RayStats
+{
+	double	singleTime;
+	double	packetTime;
+	int		packetMismatches;
+	double	occludedTime;
+	double	occludedPacketTime;
+	int		occludedMismatches;
+};
+
+static bool SameHit(const TraceResult & a, const TraceResult & b)
+{
+	return a.pTriangle == b.pTriangle && fabsf(a.fraction - b.fraction) <= 1e-5f;
+}
+
+enum eRays
+{
+	RAYS_PINHOLE,
+	RAYS_DEPTH_OF_FIELD,
+	RAYS_BOUNCE, // from the pinhole hits to random directions, the origins of a packet are inside the tree
+
+	NUM_RAY_KINDS
+};
+
+static const char * const RAY_KIND_NAMES[NUM_RAY_KINDS] = { "pin", "dof", "bounce" };
+
+static RayStats TraceRays(BVH & bvh, const Camera & camera, eRays rays)
+{
+	RayStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	const int numRays = IMAGE_SIZE * IMAGE_SIZE;
+	std::vector<Vec3> from(numRays), to(numRays);
+	std::vector<TraceResult> single(numRays), packet(numRays);
+	Random rnd(2, rays);
+	for (int by = 0, i = 0; by < IMAGE_SIZE; by += 4)
+	{// packet order: 4x4 pixels one after another
+		for (int bx = 0; bx < IMAGE_SIZE; bx += 4)
+		{
+			for (int y = by; y < by + 4; y++)
+			{
+				for (int x = bx; x < bx + 4; x++, i++)
+					camera.Ray(x, y, rays == RAYS_DEPTH_OF_FIELD ? UniformDisk(Vec2(rnd.Float(), rnd.Float())) : Vec2::Null, from[i], to[i]);
+			}
+		}
+	}
+
+	if (rays == RAYS_BOUNCE)
+	{
+		for (int i = 0; i < numRays; i++)
+		{
+			TraceResult tr;
+			if (bvh.TraceRay(from[i], to[i], tr))
+			{
+				from[i] = tr.pos - Vec3::Normalize(to[i] - from[i]) * 0.01f;
+				to[i] = from[i] + Rand3(rnd) * 30.f;
+			}
+		}
+	}
+
+	double tm = Timer::GetSeconds();
+	for (int pass = 0; pass < NUM_RAY_PASSES; pass++)
+	{
+		for (int i = 0; i < numRays; i++)
+		{
+			single[i] = TraceResult();
+			bvh.TraceRay(from[i], to[i], single[i]);
+		}
+	}
+	stats.singleTime = Timer::GetSeconds() - tm;
+
+	tm = Timer::GetSeconds();
+	for (int pass = 0; pass < NUM_RAY_PASSES; pass++)
+	{
+		for (int i = 0; i < numRays; i += CollisionPacket::MAX_RAYS)
+		{
+			for (int j = 0; j < CollisionPacket::MAX_RAYS; j++)
+				packet[i + j] = TraceResult();
+			bvh.TracePacket(&from[i], &to[i], &packet[i], CollisionPacket::MAX_RAYS);
+		}
+	}
+	stats.packetTime = Timer::GetSeconds() - tm;
+
+	for (int i = 0; i < numRays; i++)
+		stats.packetMismatches += SameHit(single[i], packet[i]) ? 0 : 1;
+
+	// shadow rays from the hits to random points around the light, occluded if the closest hit ray finds anything
+	std::vector<Vec3> shadowFrom, shadowTo;
+	std::vector<bool> occluded;
+	for (int i = 0; i < numRays; i++)
+	{
+		if (!single[i].pTriangle)
+			continue;
+		const Vec3 dir = Vec3::Normalize(to[i] - from[i]);
+		shadowFrom.push_back(single[i].pos - dir * 0.01f);
+		shadowTo.push_back(Vec3(10.f, -15.f, 30.f) + Rand3(rnd) * 2.f);
+		TraceResult tr;
+		occluded.push_back(bvh.TraceRay(shadowFrom.back(), shadowTo.back(), tr));
+	}
+	while (shadowFrom.size() % CollisionPacket::MAX_RAYS)
+	{
+		shadowFrom.push_back(shadowFrom.back());
+		shadowTo.push_back(shadowTo.back());
+		occluded.push_back(occluded.back());
+	}
+
+	const int numShadowRays = static_cast<int>(shadowFrom.size());
+	std::vector<bool> any(numShadowRays), anyPacket(numShadowRays);
+	tm = Timer::GetSeconds();
+	for (int pass = 0; pass < NUM_RAY_PASSES; pass++)
+	{
+		for (int i = 0; i < numShadowRays; i++)
+			any[i] = bvh.Occluded(shadowFrom[i], shadowTo[i]);
+	}
+	stats.occludedTime = Timer::GetSeconds() - tm;
+
+	tm = Timer::GetSeconds();
+	for (int pass = 0; pass < NUM_RAY_PASSES; pass++)
+	{
+		for (int i = 0; i < numShadowRays; i += CollisionPacket::MAX_RAYS)
+		{
+			const uint32 mask = bvh.OccludedPacket(&shadowFrom[i], &shadowTo[i], CollisionPacket::MAX_RAYS);
+			for (int j = 0; j < CollisionPacket::MAX_RAYS; j++)
+				anyPacket[i + j] = (mask & (1 << j)) != 0;
+		}
+	}
+	stats.occludedPacketTime = Timer::GetSeconds() - tm;
+
+	for (int i = 0; i < numShadowRays; i++)
+		stats.occludedMismatches += (any[i] != occluded[i] ? 1 : 0) + (anyPacket[i] != occluded[i] ? 1 : 0);
+
+	// the times are for the shadow rays count, scale them to the camera rays count for the table
+	if (numShadowRays > 0)
+	{
+		stats.occludedTime *= double(numRays) / numShadowRays;
+		stats.occludedPacketTime *= double(numRays) / numShadowRays;
+	}
+	return stats;
+}
+
+static double Mrps(double seconds)
+{
+	return seconds > 0.0 ? IMAGE_SIZE * IMAGE_SIZE * NUM_RAY_PASSES * 1e-6 / seconds : 0.0;
+}
+
+// ------------------------------------------------------------------------ //
+
+int main(int argc, char * argv[])
+{
+	BenchMaterial material;
+	CollisionTriangleArray triangles;
+	CreateScene(triangles, &material);
+	printf("scene: %d triangles, %d CPUs\n\n", static_cast<int>(triangles.size()), ThreadPool::NumCPU());
+
+	printf("build, binary nodes, ms\n");
+	printf("  %-10s %10s %10s\n", "threads", "SAH", "fast");
+	for (int numThreads = 1; ; numThreads = std::min(numThreads * 2, ThreadPool::NumCPU()))
+	{
+		double times[2];
+		for (int preset = 0; preset < 2; preset++)
+		{
+			CollisionMesh mesh(triangles.size());
+			for (size_t i = 0; i < triangles.size(); i++)
+				mesh.AddTriangle(triangles[i]);
+			const double tm = Timer::GetSeconds();
+			mesh.Build(0, numThreads, 2, false, preset ? CollisionMesh::BUILD_FAST : CollisionMesh::BUILD_HIGH_QUALITY);
+			times[preset] = (Timer::GetSeconds() - tm) * 1000.0;
+		}
+		printf("  %-10d %10.1f %10.1f\n", numThreads, times[0], times[1]);
+		if (numThreads >= ThreadPool::NumCPU())
+			break;
+	}
+
+	struct Layout
+	{
+		const char * pName;
+		int		nodeWidth;
+		bool	bQuantized;
+		bool	bStackless;
+	};
+	const Layout layouts[] =
+	{
+		{ "binary", 2, false, false },
+		{ "binary stackless", 2, false, true },
+#ifdef USE_SSE
+		{ "4 wide", 4, false, false },
+		{ "4 wide quantized", 4, true, false },
+#endif
+#ifdef USE_AVX
+		{ "8 wide", 8, false, false },
+#endif
+	};
+
+	int numFailures = 0;
+	printf("\nrays, Mrays/s (mismatches against single closest hit rays)\n");
+	printf("  %-18s %-6s %8s %16s %16s %16s\n", "layout", "rays", "single", "packet", "occluded", "occluded packet");
+	for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+	{
+		BVH bvh;
+		bvh.SetStacklessTraversal(layouts[l].bStackless);
+		CollisionVolume * pVolume = bvh.CreateVolume(triangles.size());
+		pVolume->SetTransformation(Matrix::Identity);
+		for (size_t i = 0; i < triangles.size(); i++)
+			pVolume->AddTriangle(triangles[i]);
+		pVolume->Build(0, 0, layouts[l].nodeWidth, layouts[l].bQuantized);
+		if (pVolume->Tree().NodeWidth() != layouts[l].nodeWidth)
+			continue; // not supported by this CPU
+
+		const Camera camera(bvh.BoundingBox());
+		for (int rays = 0; rays < NUM_RAY_KINDS; rays++)
+		{
+			const RayStats stats = TraceRays(bvh, camera, static_cast<eRays>(rays));
+			printf("  %-18s %-6s %8.2f %10.2f (%3d) %10.2f (%3d) %10.2f\n", layouts[l].pName, RAY_KIND_NAMES[rays],
+				   Mrps(stats.singleTime), Mrps(stats.packetTime), stats.packetMismatches,
+				   Mrps(stats.occludedTime), stats.occludedMismatches, Mrps(stats.occludedPacketTime));
+			numFailures += stats.packetMismatches + stats.occludedMismatches;
+		}
+	}
+
+	printf("\nsoftware renderer, %dx%d, 4 AO samples, 1 light\n", IMAGE_SIZE, IMAGE_SIZE);
+	struct RenderSettings
+	{
+		const char * pName;
+		bool	bSortAmbientRays;
+		float	fDepthOfField;
+	};
+	const RenderSettings renderSettings[] =
+	{
+		{ "AO rays unsorted", false, 0.f },
+		{ "AO rays sorted", true, 0.f },
+		{ "depth of field", false, 4.f }, // the camera packets have different origins
+	};
+	for (size_t r = 0; r < sizeof(renderSettings) / sizeof(renderSettings[0]); r++)
+	{
+		BVH bvh;
+		CollisionVolume * pVolume = bvh.CreateVolume(triangles.size());
+		pVolume->SetTransformation(Matrix::Identity);
+		for (size_t i = 0; i < triangles.size(); i++)
+			pVolume->AddTriangle(triangles[i]);
+		pVolume->Build();
+
+		BenchLight light(Vec3(10.f, -15.f, 30.f), 2.f);
+		ILight * pLight = &light;
+		BenchImage image(IMAGE_SIZE, IMAGE_SIZE);
+		const Camera camera(bvh.BoundingBox());
+		SoftwareRenderer renderer(bvh);
+		renderer.SetShowFloor(false);
+		renderer.SetAmbientOcclusion(1.f, 4);
+		renderer.SetAmbientOcclusionRaysSorting(renderSettings[r].bSortAmbientRays);
+		renderer.SetDepthOfField(renderSettings[r].fDepthOfField);
+		renderer.SetFocalDistance(bvh.BoundingBox().Size().Length() * 0.6f);
+		renderer.SetLights(1, &pLight);
+
+		const double tm = Timer::GetSeconds();
+		for (int frame = 0; frame < NUM_RENDER_FRAMES; frame++)
+		{
+			renderer.Render(image, NULL, camera.matCamera, camera.matViewProj, 0, frame);
+			renderer.Join();
+		}
+		const double seconds = Timer::GetSeconds() - tm;
+		printf("  %-18s %8.1f ms/frame %8.2f Mrays/s\n", renderSettings[r].pName,
+			   seconds * 1000.0 / NUM_RENDER_FRAMES, renderer.RaysCounter() * 1e-6 / seconds);
+	}
+
+	if (numFailures)
+		printf("\nFAILED: %d rays differ\n", numFailures);
+	return numFailures ? 1 : 0;
+}
@@ -45,6 +45,17 @@ typedef uint64_t			uint64;
 
 #define USE_SSE
 
+// AVX code paths are compiled for specific functions only and chosen at runtime
+#if defined(_MSC_VER) && _MSC_VER >= 1600
+#include <immintrin.h>
+#define USE_AVX
+#define TARGET_AVX
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define USE_AVX
+#define TARGET_AVX		__attribute__((target("avx")))
+#endif
+
 inline __m128 _mm_abs_ps(const __m128 & val)
 {
 	static const __m128 SIGN_MASK = _mm_set1_ps(-0.f);
@@ -57,13 +68,6 @@ inline __m128 _mm_abs_ps(const __m128 & val)
 namespace mr
 {
 
-#ifdef _WIN32
-inline float frand() { return rand() * (1.f / RAND_MAX); }
-#else
-#define ARC4RANDOM_MAX	0x100000000
-inline float frand() { return arc4random() * (1.f / ARC4RANDOM_MAX); }
-#endif
-
 template<class Type>
 inline const Type& clamp(const Type& value, const Type& min, const Type& max)
 {
@@ -108,4 +112,5 @@ inline T sqr(T value)
 #include "matrix.h"
 #include "bbox.h"
 #include "frustum.h"
+#include "random.h"
 #include "math3d.h"
@@ -0,0 +1,165 @@
+//
+//  mappedfile.cpp
+//  MiRay/common
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mappedfile.h"
+#include <cstring>
+
+using namespace mr;
+
+// ------------------------------------------------------------------------ //
+
+MappedFile::MappedFile()
+#ifdef _WIN32
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_hMapping(NULL)
+#else
+	: m_fd(-1)
+#endif
+	, m_pData(NULL)
+	, m_size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char * pFilename)
+{
+	Close();
+
+	m_hFile = CreateFileA(pFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (m_hMapping)
+		m_pData = reinterpret_cast<byte *>(MapViewOfFile(m_hMapping, FILE_MAP_COPY, 0, 0, 0));
+
+	if (!m_pData)
+	{
+		Close();
+		return false;
+	}
+
+	m_size = static_cast<size_t>(size.QuadPart);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_pData)
+		UnmapViewOfFile(m_pData);
+
+	if (m_hMapping)
+		CloseHandle(m_hMapping);
+
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+	m_pData = NULL;
+	m_size = 0;
+}
+
+#else
+
+bool MappedFile::Open(const char * pFilename)
+{
+	Close();
+
+	m_fd = open(pFilename, O_RDONLY);
+	if (m_fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0 || st.st_size == 0)
+	{
+		Close();
+		return false;
+	}
+
+	void * p = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+	if (p == MAP_FAILED)
+	{
+		Close();
+		return false;
+	}
+
+	m_pData = reinterpret_cast<byte *>(p);
+	m_size = static_cast<size_t>(st.st_size);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_pData)
+		munmap(m_pData, m_size);
+
+	if (m_fd >= 0)
+		close(m_fd);
+
+	m_fd = -1;
+	m_pData = NULL;
+	m_size = 0;
+}
+
+#endif
+
+bool MappedFile::WriteArray(FILE * f, const void * pData, size_t size)
+{
+	static const byte zeros[ARRAY_ALIGNMENT] = {};
+	if (size && fwrite(pData, 1, size, f) != size)
+		return false;
+
+	const long pos = ftell(f);
+	if (pos < 0)
+		return false;
+
+	const size_t padding = AlignedSize(pos) - pos;
+	return padding == 0 || fwrite(zeros, 1, padding, f) == padding;
+}
+
+// ------------------------------------------------------------------------ //
+
+uint64 mr::HashBytes(const void * pData, size_t size, uint64 hash)
+{
+	// FNV-1a over 8 byte words, a byte at a time is too slow for big model files
+	const uint64 PRIME = 0x100000001b3ULL;
+	const byte * p = reinterpret_cast<const byte *>(pData);
+	for (const byte * pEnd = p + (size & ~static_cast<size_t>(7)); p < pEnd; p += 8)
+	{
+		uint64 word;
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * PRIME;
+		hash ^= hash >> 29;
+	}
+
+	for (const byte * pEnd = reinterpret_cast<const byte *>(pData) + size; p < pEnd; p++)
+		hash = (hash ^ *p) * PRIME;
+
+	return hash ^ size;
+}
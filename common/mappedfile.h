@@ -0,0 +1,63 @@
+//
+//  mappedfile.h
+//  MiRay/common
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+namespace mr
+{
+
+// File mapped into memory as a private copy: pages are shared with the disk cache until they are written to,
+// written pages are never saved back.
+class MappedFile
+{
+#ifdef _WIN32
+	HANDLE	m_hFile;
+	HANDLE	m_hMapping;
+#else
+	int		m_fd;
+#endif
+	byte *	m_pData;
+	size_t	m_size;
+
+	MappedFile(const MappedFile &);
+	MappedFile & operator = (const MappedFile &);
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char * pFilename);
+	void Close();
+
+	bool IsOpen() const { return m_pData != NULL; }
+	byte * Data() const { return m_pData; }
+	size_t Size() const { return m_size; }
+
+	// binary files written for mapping keep every array at a cache line boundary
+	enum { ARRAY_ALIGNMENT = 64 };
+
+	// returns count items at the offset and moves the offset past them, NULL if the file is too short
+	template<class T> T * Array(size_t & offset, size_t count) const
+	{
+		if (offset > m_size || count > (m_size - offset) / sizeof(T))
+			return NULL;
+
+		T * p = reinterpret_cast<T *>(m_pData + offset);
+		offset = AlignedSize(offset + count * sizeof(T));
+		return p;
+	}
+
+	static size_t AlignedSize(size_t size) { return (size + ARRAY_ALIGNMENT - 1) & ~static_cast<size_t>(ARRAY_ALIGNMENT - 1); }
+	static bool WriteArray(FILE * f, const void * pData, size_t size); // pads the file to ARRAY_ALIGNMENT after the data
+};
+
+const uint64 HASH_SEED = 0xcbf29ce484222325ULL;
+
+// fast 64 bit hash of data, not cryptographic; pass the previous result as the seed to hash several blocks
+uint64 HashBytes(const void * pData, size_t size, uint64 hash = HASH_SEED);
+
+}
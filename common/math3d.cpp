@@ -62,27 +62,19 @@ MatrixBuilder & MatrixBuilder::AddScale(const Vec3 & scale)
 
 // ------------------------------------------------------------------------ //
 
-Vec2 mr::Vec2Rand()
+Vec2 mr::UniformDisk(const Vec2 & u)
 {
-	Vec2 out;
-	do 
-	{
-		out.x = rand() * (2.f / RAND_MAX) - 1.f;
-		out.y = rand() * (2.f / RAND_MAX) - 1.f;
-	} while (out.LengthSquared() > 1.f);
-	return out;
+	float r = sqrtf(u.x);
+	float a = u.y * M_2PIf;
+	return Vec2(r * cosf(a), r * sinf(a));
 }
 
-Vec3 mr::Vec3Rand()
+Vec3 mr::UniformSphere(const Vec2 & u)
 {
-	Vec3 out;
-	do 
-	{
-		out.x = rand() * (2.f / RAND_MAX) - 1.f;
-		out.y = rand() * (2.f / RAND_MAX) - 1.f;
-		out.z = rand() * (2.f / RAND_MAX) - 1.f;
-	} while (out.LengthSquared() > 1.f);
-	return out;
+	float z = 1.f - 2.f * u.x;
+	float r = sqrtf(fmaxf(1.f - z * z, 0.f));
+	float a = u.y * M_2PIf;
+	return Vec3(r * cosf(a), r * sinf(a), z);
 }
 
 // ------------------------------------------------------------------------ //
@@ -297,6 +289,52 @@ float mr::FresnelReflection(const Vec3 & I,const Vec3 & N, float n1, float n2)
 	return (rO * rO + rP * rP) * 0.5f;
 }
 
+// ------------------------------------------------------------------------ //
+
+static inline uint32 SpreadBits10(uint32 x) // inserts two zero bits after each of the lower 10 bits
+{
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+uint32 mr::MortonCode(const Vec3 & p, const BBox & bbox)
+{
+	const Vec3 vSize = bbox.Size();
+	uint32 code = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		const float f = vSize[i] > 0.f ? (p[i] - bbox.vMins[i]) / vSize[i] : 0.f;
+		const uint32 q = static_cast<uint32>(std::min(std::max(f * 1024.f, 0.f), 1023.f));
+		code |= SpreadBits10(q) << (2 - i);
+	}
+	return code;
+}
+
+uint32 mr::HilbertIndex(uint32 x, uint32 y, int order)
+{
+	const uint32 n = 1u << order;
+	uint32 d = 0;
+	for (uint32 s = n >> 1; s > 0; s >>= 1)
+	{
+		const uint32 rx = (x & s) ? 1 : 0;
+		const uint32 ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0)
+		{// rotate the quadrant so the sub-curve starts and ends where the curve expects it
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
 //float FresnelReflection(const Vec3 & I,const Vec3 & N, float eta)
 //{
 //	const float	e = 1.f / eta;
@@ -45,8 +45,9 @@ struct Vertex
 	Vertex(const Vec3 & p, const Vec3 & n, const Vec2 & t) : pos(p), normal(n), tc(t) {}
 };
 
-Vec2 Vec2Rand();
-Vec3 Vec3Rand();
+// the uniform values u in [0, 1) mapped to a point of the unit circle and to a unit vector
+Vec2 UniformDisk(const Vec2 & u);
+Vec3 UniformSphere(const Vec2 & u);
 
 Vec3 VectorToAngles(const Vec3 &vDir);
 Vec3 AnglesToVector(const Vec3 &vAngles);
@@ -70,4 +71,7 @@ Color VertexColor(const Color & c, const Vec3 & vNormal);
 
 float FresnelReflection(const Vec3 & I,const Vec3 & N, float n1, float n2);
 
+uint32 MortonCode(const Vec3 & p, const BBox & bbox); // 30 bits, the point is quantized to 10 bits per axis of the box
+uint32 HilbertIndex(uint32 x, uint32 y, int order); // position of the cell on the Hilbert curve filling a square of 2^order cells per side
+
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+//
+//  random.h
+//  MiRay/common
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+namespace mr
+{
+
+// PCG32 generator. Every render thread or pixel keeps its own one instead of the shared state of rand(),
+// seeded by the pixel and the sample number the same render gives the same image.
+class Random
+{
+	uint64	m_state;
+	uint64	m_inc;
+
+public:
+	Random() { Seed(0, 0); }
+	Random(uint64 seed, uint64 stream) { Seed(seed, stream); }
+
+	void Seed(uint64 seed, uint64 stream)
+	{// the seed is mixed first, close seeds of the neighbour pixels don't give close sequences
+		seed += 0x9e3779b97f4a7c15ULL;
+		seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+		seed ^= seed >> 31;
+
+		m_state = 0;
+		m_inc = (stream << 1) | 1;
+		UInt();
+		m_state += seed;
+		UInt();
+	}
+
+	uint32 UInt()
+	{
+		const uint64 old = m_state;
+		m_state = old * 6364136223846793005ULL + m_inc;
+		const uint32 xorshifted = static_cast<uint32>(((old >> 18) ^ old) >> 27);
+		const uint32 rot = static_cast<uint32>(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	float Float() { return (UInt() >> 8) * (1.f / 16777216.f); } // [0, 1)
+};
+
+}
@@ -0,0 +1,130 @@
+//
+//  threadpool.cpp
+//  MiRay/common
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "threadpool.h"
+
+using namespace mr;
+
+// ------------------------------------------------------------------------ //
+
+ThreadPool::ThreadPool(int numThreads)
+	: m_bStop(false)
+{
+	if (numThreads <= 0)
+		numThreads = NumCPU();
+
+	for (int i = 1; i < numThreads; i++)
+		m_threads.push_back(new Thread(&ThreadFunc, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_bStop = true;
+		m_condition.notify_all();
+	}
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		m_threads[i]->join();
+		delete m_threads[i];
+	}
+
+	m_threads.clear();
+}
+
+int ThreadPool::NumCPU()
+{
+#ifdef _WIN32
+	SYSTEM_INFO sysinfo;
+	::GetSystemInfo(&sysinfo);
+	return std::max(static_cast<int>(sysinfo.dwNumberOfProcessors), 1);
+#else
+	return std::max(static_cast<int>(::sysconf(_SC_NPROCESSORS_ONLN)), 1);
+#endif
+}
+
+ThreadPool & ThreadPool::Shared()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// ------------------------------------------------------------------------ //
+
+void ThreadPool::Run(TaskGroup & group, const Task & task)
+{
+	group.m_nPendingTasks++;
+
+	if (m_threads.empty())
+	{// no worker threads, run it right now
+		task();
+		group.m_nPendingTasks--;
+		return;
+	}
+
+	QueuedTask qt;
+	qt.task = task;
+	qt.pGroup = &group;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_tasks.push_back(qt);
+	m_condition.notify_one();
+}
+
+void ThreadPool::Wait(TaskGroup & group)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (group.m_nPendingTasks > 0)
+	{
+		if (m_tasks.empty())
+		{
+			m_condition.wait(lock);
+			continue;
+		}
+
+		// the latest task is the smallest one and most likely the one we are waiting for
+		QueuedTask qt = m_tasks.back();
+		m_tasks.pop_back();
+		Execute(qt, lock);
+	}
+}
+
+void ThreadPool::Execute(QueuedTask & qt, std::unique_lock<std::mutex> & lock)
+{
+	lock.unlock();
+	qt.task();
+	lock.lock();
+
+	qt.pGroup->m_nPendingTasks--;
+	m_condition.notify_all();
+}
+
+void ThreadPool::ThreadFunc(void * pThreadPool)
+{
+	ThreadPool * pThis = reinterpret_cast<ThreadPool *>(pThreadPool);
+
+	std::unique_lock<std::mutex> lock(pThis->m_mutex);
+	while (!pThis->m_bStop)
+	{
+		if (pThis->m_tasks.empty())
+		{
+			pThis->m_condition.wait(lock);
+			continue;
+		}
+
+		QueuedTask qt = pThis->m_tasks.front();
+		pThis->m_tasks.pop_front();
+		pThis->Execute(qt, lock);
+	}
+}
@@ -0,0 +1,86 @@
+//
+//  threadpool.h
+//  MiRay/common
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+#include "thread.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace mr
+{
+
+class ThreadPool
+{
+public:
+	typedef std::function<void ()>	Task;
+
+	class TaskGroup
+	{
+		friend class ThreadPool;
+		std::atomic<int>	m_nPendingTasks;
+
+	public:
+		TaskGroup() : m_nPendingTasks(0) {}
+	};
+
+private:
+	struct QueuedTask
+	{
+		Task		task;
+		TaskGroup *	pGroup;
+	};
+
+	std::deque<QueuedTask>		m_tasks;
+	std::mutex					m_mutex;
+	std::condition_variable		m_condition;
+	std::vector<Thread *>		m_threads;
+	bool						m_bStop;
+
+	void Execute(QueuedTask & qt, std::unique_lock<std::mutex> & lock);
+	static void ThreadFunc(void * pThreadPool);
+
+public:
+	ThreadPool(int numThreads = 0); // 0 - one thread per CPU core, the calling thread included
+	~ThreadPool();
+
+	int NumThreads() const { return static_cast<int>(m_threads.size()) + 1; }
+
+	void Run(TaskGroup & group, const Task & task);
+	void Wait(TaskGroup & group); // executes queued tasks until all tasks of the group are done
+
+	static int NumCPU();
+	// One thread per CPU core for the whole process, created on the first call. Groups of several callers can run on it at once,
+	// Wait of a caller may execute the tasks of another one.
+	static ThreadPool & Shared();
+};
+
+// Calls func(chunk, begin, end) for each of numChunks parts of [0, count) on the thread pool.
+// Results must be merged by the caller in chunk order to keep the build deterministic.
+template<typename Function>
+void ParallelFor(ThreadPool * pThreadPool, size_t numChunks, size_t count, Function func)
+{
+	if (numChunks <= 1)
+	{
+		func(0, 0, count);
+		return;
+	}
+
+	ThreadPool::TaskGroup group;
+	for (size_t i = 0; i < numChunks; i++)
+	{
+		size_t begin = count * i / numChunks;
+		size_t end = count * (i + 1) / numChunks;
+		pThreadPool->Run(group, [=, &func]() { func(i, begin, end); });
+	}
+	pThreadPool->Wait(group);
+}
+
+}
@@ -147,7 +147,7 @@ ModelPtr ModelManager::LoadModel(const char * strFilename, pugi::xml_node node)
 {
 	std::string strFullPath = GetFullPath(strFilename);
 
-	auto it = m_resources.find(strFilename);
+	auto it = m_resources.find(strFullPath); // models are released by their full path names
 	if (it != m_resources.end())
 	{
 		ModelPtr spModel = it->second.lock();
@@ -202,6 +202,9 @@ ModelPtr ModelManager::LoadModel(const char * strFilename, pugi::xml_node node)
 
 	m_pScene->Destroy();
 
+	if (spModel)
+		m_resources[spModel->Name()] = spModel; // the next placements of the model share it and its collision mesh
+
 	return spModel;
 }
 
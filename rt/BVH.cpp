@@ -12,7 +12,7 @@ using namespace mr;
 
 // ------------------------------------------------------------------------ //
 
-BVH::BVH() : m_nRayCounter(0)
+BVH::BVH() : m_nRayCounter(0), m_bStacklessTraversal(false)
 {
 }
 
@@ -29,7 +29,14 @@ BVH::~BVH()
 
 CollisionVolume * BVH::CreateVolume(size_t nReserveTrangles)
 {
-	m_volumes.push_back(new CollisionVolume(nReserveTrangles));
+	m_volumes.push_back(new CollisionVolume(this, std::make_shared<CollisionMesh>(nReserveTrangles)));
+	return m_volumes.back(); // the volume is empty and will be added to the top level tree when it's built
+}
+
+CollisionVolume * BVH::CreateVolume(const CollisionMeshPtr & pMesh)
+{
+	m_volumes.push_back(new CollisionVolume(this, pMesh));
+	UpdateVolumesTree();
 	return m_volumes.back();
 }
 
@@ -40,7 +47,20 @@ void BVH::DestroyVolume(CollisionVolume * pVolume)
 	{
 		delete pVolume;
 		m_volumes.erase(it);
+		UpdateVolumesTree();
+	}
+}
+
+CollisionMeshPtr BVH::SharedMesh(const std::string & name, size_t nReserveTrangles)
+{
+	CollisionMeshPtr pMesh = m_meshes[name].lock();
+	if (!pMesh)
+	{
+		pMesh = std::make_shared<CollisionMesh>(nReserveTrangles);
+		m_meshes[name] = pMesh;
 	}
+
+	return pMesh;
 }
 
 // ------------------------------------------------------------------------ //
@@ -55,6 +75,72 @@ BBox BVH::BoundingBox() const
 	return bbox;
 }
 
+void BVH::UpdateVolumesTree()
+{
+	m_nodes.clear();
+	m_nodeVolumes.clear();
+
+	for (CollisionVolumeArray::const_iterator it = m_volumes.begin(), itEnd = m_volumes.end(); it != itEnd; ++it)
+	{
+		if (!(*it)->AABB().IsNull())
+			m_nodeVolumes.push_back(*it);
+	}
+
+	if (!m_nodeVolumes.empty())
+	{
+		m_nodes.reserve(m_nodeVolumes.size() * 2 - 1);
+		AddNode(m_nodeVolumes.begin(), m_nodeVolumes.end());
+	}
+}
+
+void BVH::UpdateMeshVolumes(const CollisionMesh * pMesh)
+{
+	for (CollisionVolumeArray::const_iterator it = m_volumes.begin(), itEnd = m_volumes.end(); it != itEnd; ++it)
+	{
+		if ((*it)->Mesh().get() == pMesh)
+			(*it)->UpdateAABB();
+	}
+
+	UpdateVolumesTree();
+}
+
+void BVH::AddNode(CollisionVolumeArray::iterator itBegin, CollisionVolumeArray::iterator itEnd)
+{
+	BBox bbox, centers;
+	bbox.ClearBounds();
+	centers.ClearBounds();
+	for (CollisionVolumeArray::const_iterator it = itBegin; it != itEnd; ++it)
+	{
+		bbox.AddToBounds((*it)->AABB());
+		centers.AddToBounds((*it)->AABB().Center());
+	}
+
+	const size_t index = m_nodes.size();
+	m_nodes.push_back(Node());
+	m_nodes[index].center = bbox.Center();
+	m_nodes[index].extents = m_nodes[index].center - bbox.vMins;
+
+	if (itEnd - itBegin == 1)
+	{
+		m_nodes[index].numVolumes = 1;
+		m_nodes[index].index = static_cast<uint32>(itBegin - m_nodeVolumes.begin());
+		return;
+	}
+
+	// median split by the longest axis of the volume centers
+	const Vec3 vSize = centers.Size();
+	const int axis = (vSize.x >= vSize.y && vSize.x >= vSize.z) ? 0 : (vSize.y >= vSize.z ? 1 : 2);
+	CollisionVolumeArray::iterator itMiddle = itBegin + (itEnd - itBegin) / 2;
+	std::nth_element(itBegin, itMiddle, itEnd, [axis](const CollisionVolume * a, const CollisionVolume * b) {
+		return a->AABB().vMins[axis] + a->AABB().vMaxs[axis] < b->AABB().vMins[axis] + b->AABB().vMaxs[axis];
+	});
+
+	AddNode(itBegin, itMiddle);
+	m_nodes[index].numVolumes = 0;
+	m_nodes[index].index = static_cast<uint32>(m_nodes.size());
+	AddNode(itMiddle, itEnd);
+}
+
 // ------------------------------------------------------------------------ //
 
 bool BVH::TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr)
@@ -63,9 +149,232 @@ bool BVH::TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr)
 
 	tr.fraction = 1.f;
 	tr.pos = vTo;
+	if (m_nodes.empty())
+		return false;
+
+	const Vec3 vDir = vTo - vFrom;
+	CollisionRay ray(vFrom, vTo, tr);
+
+	uint32 stackNodes[64];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
 	bool res = false;
-	for (CollisionVolumeArray::iterator it = m_volumes.begin(), itEnd = m_volumes.end(); it != itEnd; ++it)
-		res |= (*it)->TraceRay(vFrom, tr.pos, tr);
+	while (pTopNode > stackNodes)
+	{
+		const uint32 index = *(--pTopNode);
+		const Node & node = m_nodes[index];
+#ifdef USE_SSE
+		if (!ray.TestIntersection(_mm_loadu_ps(&node.center.x), _mm_loadu_ps(&node.extents.x)))
+#else
+		if (!ray.TestIntersection(node.center, node.extents))
+#endif
+			continue;
+
+		if (node.numVolumes)
+		{
+			for (uint32 i = node.index, iEnd = node.index + node.numVolumes; i < iEnd; i++)
+			{
+				const float fraction = tr.fraction;
+				if (m_nodeVolumes[i]->TraceRay(vFrom, tr.pos, tr))
+				{
+					res = true;
+					if (fraction > 0.f)
+						ray.Clip(tr.fraction / fraction);
+				}
+			}
+			continue;
+		}
+
+		// volumes may overlap, the near child first just clips the ray sooner
+		if (Vec3::Dot(m_nodes[index + 1].center - m_nodes[node.index].center, vDir) > 0.f)
+		{
+			*pTopNode++ = index + 1;
+			*pTopNode++ = node.index;
+		}
+		else
+		{
+			*pTopNode++ = node.index;
+			*pTopNode++ = index + 1;
+		}
+	}
+
+	return res;
+}
+
+uint32 BVH::TracePacket(const Vec3 * pFrom, const Vec3 * pTo, TraceResult * pResults, int numRays)
+{
+	assert(numRays > 0 && numRays <= CollisionPacket::MAX_RAYS);
+	m_nRayCounter += numRays;
+
+	for (int i = 0; i < numRays; i++)
+	{
+		pResults[i].fraction = 1.f;
+		pResults[i].pos = pTo[i];
+	}
+
+	if (m_nodes.empty())
+		return 0;
+
+	CollisionPacket packet;
+	for (int i = 0; i < numRays; i++)
+		packet.SetRay(i, pFrom[i], pTo[i], pResults[i]);
+
+	struct StackEntry
+	{
+		uint32	index;
+		uint32	mask;
+	};
+	StackEntry stackNodes[64];
+	StackEntry * pTopNode = stackNodes;
+	pTopNode->index = 0;
+	pTopNode->mask = (1u << numRays) - 1;
+	pTopNode++;
+
+	uint32 res = 0;
+	while (pTopNode > stackNodes)
+	{
+		--pTopNode;
+		const uint32 index = pTopNode->index;
+		const Node & node = m_nodes[index];
+		const uint32 nodeMask = packet.TestIntersection(node.center, node.extents, pTopNode->mask);
+		if (!nodeMask)
+			continue;
+
+		if (node.numVolumes)
+		{
+			for (uint32 i = node.index, iEnd = node.index + node.numVolumes; i < iEnd; i++)
+			{
+				float fractions[CollisionPacket::MAX_RAYS];
+				Vec3 ends[CollisionPacket::MAX_RAYS];
+				for (int j = 0; j < numRays; j++)
+				{
+					fractions[j] = pResults[j].fraction;
+					ends[j] = pResults[j].pos;
+				}
+
+				const uint32 hitMask = m_nodeVolumes[i]->TracePacket(pFrom, ends, pResults, nodeMask);
+				res |= hitMask;
+				for (int j = 0; j < numRays; j++)
+				{
+					if ((hitMask & (1 << j)) && fractions[j] > 0.f)
+					{
+						packet.Ray(j).Clip(pResults[j].fraction / fractions[j]);
+						packet.UpdateRay(j);
+					}
+				}
+			}
+			continue;
+		}
+
+		pTopNode[0].mask = pTopNode[1].mask = nodeMask;
+		if (Vec3::Dot(m_nodes[index + 1].center - m_nodes[node.index].center, packet.Ray(CollisionPacket::FirstRay(nodeMask)).Direction()) > 0.f)
+		{
+			pTopNode[0].index = index + 1;
+			pTopNode[1].index = node.index;
+		}
+		else
+		{
+			pTopNode[0].index = node.index;
+			pTopNode[1].index = index + 1;
+		}
+		pTopNode += 2;
+	}
+
+	return res;
+}
+
+bool BVH::Occluded(const Vec3 & vFrom, const Vec3 & vTo)
+{
+	++m_nRayCounter;
+
+	if (m_nodes.empty())
+		return false;
+
+	TraceResult tr; // the ray needs one, but it's never filled
+	const CollisionRay ray(vFrom, vTo, tr);
+
+	uint32 stackNodes[64];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 index = *(--pTopNode);
+		const Node & node = m_nodes[index];
+#ifdef USE_SSE
+		if (!ray.TestIntersection(_mm_loadu_ps(&node.center.x), _mm_loadu_ps(&node.extents.x)))
+#else
+		if (!ray.TestIntersection(node.center, node.extents))
+#endif
+			continue;
+
+		if (node.numVolumes)
+		{
+			for (uint32 i = node.index, iEnd = node.index + node.numVolumes; i < iEnd; i++)
+			{
+				if (m_nodeVolumes[i]->Occluded(vFrom, vTo))
+					return true;
+			}
+			continue;
+		}
+
+		*pTopNode++ = node.index;
+		*pTopNode++ = index + 1;
+	}
+
+	return false;
+}
+
+uint32 BVH::OccludedPacket(const Vec3 * pFrom, const Vec3 * pTo, int numRays)
+{
+	assert(numRays > 0 && numRays <= CollisionPacket::MAX_RAYS);
+	m_nRayCounter += numRays;
+
+	if (m_nodes.empty())
+		return 0;
+
+	TraceResult tr; // the rays need one, but it's never filled
+	CollisionPacket packet;
+	for (int i = 0; i < numRays; i++)
+		packet.SetRay(i, pFrom[i], pTo[i], tr);
+
+	struct StackEntry
+	{
+		uint32	index;
+		uint32	mask;
+	};
+	StackEntry stackNodes[64];
+	StackEntry * pTopNode = stackNodes;
+	pTopNode->index = 0;
+	pTopNode->mask = (1u << numRays) - 1;
+	pTopNode++;
+
+	uint32 res = 0;
+	while (pTopNode > stackNodes)
+	{
+		--pTopNode;
+		const uint32 index = pTopNode->index;
+		const Node & node = m_nodes[index];
+		const uint32 nodeMask = packet.TestIntersection(node.center, node.extents, pTopNode->mask & ~res);
+		if (!nodeMask)
+			continue;
+
+		if (node.numVolumes)
+		{
+			for (uint32 i = node.index, iEnd = node.index + node.numVolumes; i < iEnd; i++)
+				res |= m_nodeVolumes[i]->OccludedPacket(pFrom, pTo, nodeMask & ~res);
+
+			if (res == (1u << numRays) - 1)
+				break;
+			continue;
+		}
+
+		pTopNode[0].index = node.index;
+		pTopNode[1].index = index + 1;
+		pTopNode[0].mask = pTopNode[1].mask = nodeMask;
+		pTopNode += 2;
+	}
 
 	return res;
 }
@@ -10,6 +10,7 @@
 #include "CollisionNode.h"
 #include "CollisionVolume.h"
 #include <atomic>
+#include <map>
 
 namespace mr
 {
@@ -19,23 +20,45 @@ class BVH // Bounding Volume Hierarchy
 //	CollisionNode m_root;
 //	CollisionTriangleArray m_triangles;
 
+	// top level tree over the world bounding boxes of the volumes, nodes are stored in depth-first order
+	struct Node
+	{
+		Vec3	center;
+		uint32	numVolumes; // 0 for inner nodes
+		Vec3	extents;
+		uint32	index; // second child of an inner node or the first volume of a leaf
+	};
+
 	typedef std::vector<CollisionVolume *>	CollisionVolumeArray;
 	CollisionVolumeArray m_volumes;
+	CollisionVolumeArray m_nodeVolumes; // volumes in the order of the top level tree leaves
+	std::vector<Node>	m_nodes;
+	std::map<std::string, std::weak_ptr<CollisionMesh>> m_meshes; // meshes shared by name
 	std::atomic<size_t>	m_nRayCounter;
+	bool	m_bStacklessTraversal;
+
+	void AddNode(CollisionVolumeArray::iterator itBegin, CollisionVolumeArray::iterator itEnd);
 
 public:
 //	BVH(size_t nReserveTrangles = 0) : m_root(NULL), m_nTraceCount(0) { m_triangles.reserve(nReserveTrangles); }
 	BVH();
 	~BVH();
 
-	CollisionVolume * CreateVolume(size_t nReserveTrangles = 0);
+	CollisionVolume * CreateVolume(size_t nReserveTrangles = 0); // volume with its own new mesh
+	CollisionVolume * CreateVolume(const CollisionMeshPtr & pMesh); // instance of the mesh
 	void DestroyVolume(CollisionVolume *);
 
+	// returns the mesh shared by the name, a new empty one is created if all volumes of the previous one were destroyed
+	CollisionMeshPtr SharedMesh(const std::string & name, size_t nReserveTrangles = 0);
+
 	size_t NumVolumes() const { return m_volumes.size(); }
 	CollisionVolume * Volume(size_t i) { return m_volumes[i]; }
 	const CollisionVolume * Volume(size_t i) const { return m_volumes[i]; }
 
 	BBox BoundingBox() const;
+
+	void UpdateVolumesTree(); // called by volumes when their world bounding boxes change
+	void UpdateMeshVolumes(const CollisionMesh * pMesh); // called when the mesh is rebuilt
 	
 //	const CollisionNode * Root() const { return &m_root; }
 //	const CollisionTriangleArray & Triangles() const { return m_triangles; }
@@ -43,10 +66,19 @@ public:
 //	void AddTriangle(const CollisionTriangle & t);
 //	void Build(byte nMaxNodesLevel = 0);
 
+	// single rays walk binary trees of the volumes (node width 2) by the parent links of their nodes instead of a stack,
+	// the OpenCL kernel is built the same way; must not be changed while rendering
+	void SetStacklessTraversal(bool b) { m_bStacklessTraversal = b; }
+	bool StacklessTraversal() const { return m_bStacklessTraversal; }
+
 	size_t RaysCounter() const { return m_nRayCounter; }
 	void ResetRayCounter() { m_nRayCounter = 0; }
 
 	bool TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr);
+	// TraceRay for up to CollisionPacket::MAX_RAYS coherent rays, like camera rays of neighbour pixels; returns the mask of hit rays
+	uint32 TracePacket(const Vec3 * pFrom, const Vec3 * pTo, TraceResult * pResults, int numRays);
+	bool Occluded(const Vec3 & vFrom, const Vec3 & vTo); // any hit query for shadow and ambient occlusion rays
+	uint32 OccludedPacket(const Vec3 * pFrom, const Vec3 * pTo, int numRays); // Occluded for a packet of rays, returns the mask of occluded ones
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,392 @@
+//
+//  CollisionMesh.cpp
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#include "CollisionMesh.h"
+#include "../common/threadpool.h"
+#include "../common/timer.h"
+#include <cstdio>
+
+using namespace mr;
+
+static_assert(sizeof(TriangleIntersection) == 44, "triangle intersection data must stay compact");
+
+const float CollisionMesh::REBUILD_SAH_RATIO = 1.3f;
+const uint32 CollisionMesh::CACHE_VERSION = 4; // increase on any change of the file layout or of the build results
+const byte CollisionMesh::COARSE_NODES_LEVEL = 16; // leaves of ~1/32768 of the triangles, built in a fraction of the full fast build
+
+// ------------------------------------------------------------------------ //
+
+CollisionMesh::CollisionMesh(size_t nReserveTrangles)
+	: m_numSourceTriangles(0)
+	, m_nMaxNodesLevel(0)
+	, m_numThreads(0)
+	, m_nodeWidth(0)
+	, m_bQuantizedNodes(false)
+	, m_buildPreset(BUILD_HIGH_QUALITY)
+	, m_fBuildSAHCost(0.f)
+	, m_bBuildFinished(false)
+{
+	m_triangles.reserve(nReserveTrangles);
+	m_sourceIndices.reserve(nReserveTrangles);
+}
+
+CollisionMesh::~CollisionMesh()
+{
+	JoinBuildThread(false);
+}
+
+// ------------------------------------------------------------------------ //
+
+void CollisionMesh::AddTriangle(const CollisionTriangle & t)
+{
+	if (!t.IsDegenerate())
+	{
+		m_triangles.push_back(t);
+		m_sourceIndices.push_back(m_numSourceTriangles);
+	}
+
+	m_numSourceTriangles++;
+}
+
+void CollisionMesh::Build(byte nMaxNodesLevel, int numThreads, int nodeWidth, bool bQuantizedNodes, eBuildPreset preset)
+{
+	JoinBuildThread(false);
+
+	m_nMaxNodesLevel = nMaxNodesLevel;
+	m_numThreads = numThreads;
+	m_nodeWidth = nodeWidth;
+	m_bQuantizedNodes = bQuantizedNodes;
+	m_buildPreset = preset;
+
+	if (nMaxNodesLevel == 0 || nMaxNodesLevel > CollisionNode::MAX_NODES_LEVEL)
+		nMaxNodesLevel = CollisionNode::MAX_NODES_LEVEL;
+
+	if (m_triangles.empty())
+	{
+		UpdateIntersections();
+		return;
+	}
+
+	CreateTree(m_tree, nMaxNodesLevel, numThreads, nodeWidth, bQuantizedNodes, preset);
+	m_fBuildSAHCost = m_tree.GetSAHCost();
+
+	UpdateIntersections(); // the blocks follow the leaves of the new tree
+}
+
+void CollisionMesh::CreateTree(CollisionTree & tree, byte nMaxNodesLevel, int numThreads, int nodeWidth, bool bQuantizedNodes, eBuildPreset preset)
+{
+	// the default thread count shares the pool of the process, other counts get their own one for the measurements
+	std::unique_ptr<ThreadPool> pOwnThreadPool;
+	ThreadPool * pThreadPool = NULL;
+	if (numThreads <= 0 || numThreads == ThreadPool::NumCPU())
+		pThreadPool = &ThreadPool::Shared();
+	else if (numThreads > 1)
+	{
+		pOwnThreadPool.reset(new ThreadPool(numThreads));
+		pThreadPool = pOwnThreadPool.get();
+	}
+
+	if (preset == BUILD_FAST)
+	{
+		tree.CreateLinear(m_triangles.data(), static_cast<uint32>(m_triangles.size()), nMaxNodesLevel, pThreadPool);
+	}
+	else
+	{
+		CollisionNode::ReferenceArray references;
+		references.reserve(m_triangles.size() * CollisionNode::REFERENCES_CAPACITY_SCALE);
+		references.resize(m_triangles.size());
+		for (size_t i = 0; i < m_triangles.size(); i++)
+		{
+			references[i].pTriangle = &m_triangles[i];
+			references[i].bbox = m_triangles[i].BoundingBox();
+		}
+
+		CollisionNode root;
+		root.Create(nMaxNodesLevel - 1, references, pThreadPool);
+		tree.Create(root, m_triangles.data());
+	}
+
+	tree.CreateWideNodes(nodeWidth, bQuantizedNodes);
+}
+
+void CollisionMesh::UpdateIntersections()
+{
+	m_intersections.resize(m_triangles.size());
+	for (size_t i = 0; i < m_triangles.size(); i++)
+		m_intersections[i] = m_triangles[i].Intersection();
+
+#ifdef USE_SSE
+	CreateTriangleBlocks(m_triangleBlocks, m_tree);
+#endif
+}
+
+#ifdef USE_SSE
+void CollisionMesh::CreateTriangleBlocks(std::vector<TriangleBlock> & blocks, const CollisionTree & tree) const
+{
+	const std::vector<uint32> & indices = tree.TriangleIndices();
+	// the leaf ranges are padded to whole blocks, the rounding keeps a broken tree inside the vector
+	blocks.resize((indices.size() + 3) / 4);
+	for (size_t i = 0; i < indices.size(); i++)
+		blocks[i / 4].Set(static_cast<int>(i % 4), m_intersections[indices[i]]);
+}
+#endif
+
+// ------------------------------------------------------------------------ //
+
+void CollisionMesh::BuildAsync(byte nMaxNodesLevel, int numThreads, int nodeWidth, bool bQuantizedNodes)
+{
+	Build(COARSE_NODES_LEVEL, numThreads, nodeWidth, bQuantizedNodes, BUILD_FAST);
+
+	// a refit rebuilds the full tree
+	m_nMaxNodesLevel = nMaxNodesLevel;
+	m_buildPreset = BUILD_HIGH_QUALITY;
+
+	if (m_triangles.empty())
+		return;
+
+	m_bBuildFinished = false;
+	m_pBuildThread.reset(new Thread(&BuildThreadFunc, this));
+}
+
+// reads the triangles and intersections, the tracing threads only read them too and Refit waits for the thread
+void CollisionMesh::BuildThreadFunc(void * pMesh)
+{
+	CollisionMesh * pThis = reinterpret_cast<CollisionMesh *>(pMesh);
+
+	byte nMaxNodesLevel = pThis->m_nMaxNodesLevel;
+	if (nMaxNodesLevel == 0 || nMaxNodesLevel > CollisionNode::MAX_NODES_LEVEL)
+		nMaxNodesLevel = CollisionNode::MAX_NODES_LEVEL;
+
+	double tm1 = Timer::GetSeconds();
+	pThis->CreateTree(pThis->m_builtTree, nMaxNodesLevel, pThis->m_numThreads, pThis->m_nodeWidth, pThis->m_bQuantizedNodes, BUILD_HIGH_QUALITY);
+#ifdef USE_SSE
+	pThis->CreateTriangleBlocks(pThis->m_builtTriangleBlocks, pThis->m_builtTree);
+#endif
+	double tm2 = Timer::GetSeconds();
+	printf("Collision mesh built in background: %d nodes, %f ms\n", static_cast<int>(pThis->m_builtTree.NumNodes()), (tm2 - tm1) * 1000.0);
+
+	pThis->m_bBuildFinished = true;
+}
+
+bool CollisionMesh::FinishBuild()
+{
+	if (!IsBuildFinished())
+		return false;
+
+	JoinBuildThread(true);
+	return true;
+}
+
+void CollisionMesh::JoinBuildThread(bool bKeepTree)
+{
+	if (!m_pBuildThread)
+		return;
+
+	m_pBuildThread->join();
+	m_pBuildThread.reset();
+
+	if (bKeepTree)
+	{
+		m_tree.Swap(m_builtTree);
+#ifdef USE_SSE
+		m_triangleBlocks.swap(m_builtTriangleBlocks);
+#endif
+		m_fBuildSAHCost = m_tree.GetSAHCost();
+	}
+
+	m_builtTree.Clear();
+#ifdef USE_SSE
+	std::vector<TriangleBlock>().swap(m_builtTriangleBlocks);
+#endif
+}
+
+bool CollisionMesh::Refit(const CollisionTriangleArray & triangles)
+{
+	if (triangles.size() != m_numSourceTriangles)
+		return false;
+
+	JoinBuildThread(true); // the background build reads the triangles
+
+	if (!m_tree.IsRefitPrepared())
+		m_tree.PrepareRefit(m_triangles.data());
+
+	for (size_t i = 0; i < m_triangles.size(); i++)
+	{
+		assert(triangles[m_sourceIndices[i]].Material() == m_triangles[i].Material());
+		m_triangles[i] = triangles[m_sourceIndices[i]];
+	}
+
+	UpdateIntersections();
+
+	if (m_tree.Empty())
+		return true;
+
+	m_tree.Refit(m_triangles.data());
+
+	const float fSAHCost = m_tree.GetSAHCost();
+	if (fSAHCost > m_fBuildSAHCost * REBUILD_SAH_RATIO)
+	{
+		printf("Collision mesh SAH cost grew from %g to %g after refit, rebuilding...\n", m_fBuildSAHCost, fSAHCost);
+		Build(m_nMaxNodesLevel, m_numThreads, m_nodeWidth, m_bQuantizedNodes, m_buildPreset);
+	}
+
+	return true;
+}
+
+// ------------------------------------------------------------------------ //
+
+namespace
+{
+	const uint32 CACHE_MAGIC = 0x4842524d; // "MRBH"
+
+	struct MeshCacheHeader
+	{
+		uint32	magic;
+		uint32	version;
+		uint64	key;
+		uint32	triangleSize; // the triangles are stored as they are in memory
+		uint32	nodeSize;
+		uint32	numSourceTriangles;
+		uint32	numTriangles;
+		uint32	nMaxNodesLevel;
+		uint32	nodeWidth;
+		float	fBuildSAHCost;
+		uint32	quantizedNodes;
+	};
+}
+
+uint64 CollisionMesh::CacheKey(const char * pSourceFilename, byte nMaxNodesLevel, int nodeWidth, bool bQuantizedNodes)
+{
+	MappedFile file;
+	if (!file.Open(pSourceFilename))
+		return 0;
+
+	if (nMaxNodesLevel == 0 || nMaxNodesLevel > CollisionNode::MAX_NODES_LEVEL)
+		nMaxNodesLevel = CollisionNode::MAX_NODES_LEVEL;
+	if (nodeWidth <= 0)
+		nodeWidth = CollisionTree::DEFAULT_NODE_WIDTH;
+
+	const uint32 settings[] = { CACHE_VERSION, nMaxNodesLevel, static_cast<uint32>(nodeWidth), bQuantizedNodes ? 1u : 0u };
+	uint64 key = HashBytes(file.Data(), file.Size());
+	key = HashBytes(settings, sizeof(settings), key);
+	return key ? key : 1;
+}
+
+bool CollisionMesh::SaveCache(const char * pFilename, uint64 key, const std::vector<const IMaterial *> & materials) const
+{
+	if (m_buildPreset == BUILD_FAST || m_pBuildThread)
+		return false; // the cache must give the high quality tree
+
+	std::map<const IMaterial *, uint32> materialIndices;
+	for (size_t i = 0; i < materials.size(); i++)
+		materialIndices.insert(std::make_pair(materials[i], static_cast<uint32>(i)));
+
+	std::vector<uint32> triangleMaterials(m_triangles.size());
+	for (size_t i = 0; i < m_triangles.size(); i++)
+	{
+		std::map<const IMaterial *, uint32>::const_iterator it = materialIndices.find(m_triangles[i].Material());
+		if (it == materialIndices.end())
+			return false;
+		triangleMaterials[i] = it->second;
+	}
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.key = key;
+	header.triangleSize = sizeof(CollisionTriangle);
+	header.nodeSize = sizeof(CollisionTree::Node);
+	header.numSourceTriangles = m_numSourceTriangles;
+	header.numTriangles = static_cast<uint32>(m_triangles.size());
+	header.nMaxNodesLevel = m_nMaxNodesLevel;
+	header.nodeWidth = m_nodeWidth;
+	header.fBuildSAHCost = m_fBuildSAHCost;
+	header.quantizedNodes = m_bQuantizedNodes ? 1 : 0;
+
+	// written aside and renamed, so a mapped old file stays valid and a broken write leaves nothing
+	std::string strTempFilename = std::string(pFilename) + ".tmp";
+	FILE * f = fopen(strTempFilename.c_str(), "wb");
+	if (!f)
+	{
+		printf("Can't write collision cache '%s'\n", strTempFilename.c_str());
+		return false;
+	}
+
+	bool res = MappedFile::WriteArray(f, &header, sizeof(header)) &&
+		MappedFile::WriteArray(f, m_triangles.data(), m_triangles.size() * sizeof(CollisionTriangle)) &&
+		MappedFile::WriteArray(f, triangleMaterials.data(), triangleMaterials.size() * sizeof(uint32)) &&
+		MappedFile::WriteArray(f, m_sourceIndices.data(), m_sourceIndices.size() * sizeof(uint32)) &&
+		m_tree.Write(f);
+	res = (fclose(f) == 0) && res;
+
+	if (res)
+	{
+		remove(pFilename);
+		res = (rename(strTempFilename.c_str(), pFilename) == 0);
+	}
+
+	if (!res)
+	{
+		remove(strTempFilename.c_str());
+		printf("Can't write collision cache '%s'\n", pFilename);
+	}
+
+	return res;
+}
+
+bool CollisionMesh::LoadCache(const char * pFilename, uint64 key, const std::vector<const IMaterial *> & materials)
+{
+	JoinBuildThread(false);
+
+	std::shared_ptr<MappedFile> pFile = std::make_shared<MappedFile>();
+	if (!pFile->Open(pFilename))
+		return false;
+
+	size_t offset = 0;
+	const MeshCacheHeader * pHeader = pFile->Array<MeshCacheHeader>(offset, 1);
+	if (!pHeader || pHeader->magic != CACHE_MAGIC || pHeader->version != CACHE_VERSION || pHeader->key != key ||
+		pHeader->triangleSize != sizeof(CollisionTriangle) || pHeader->nodeSize != sizeof(CollisionTree::Node))
+		return false;
+
+	const CollisionTriangle * pTriangles = pFile->Array<CollisionTriangle>(offset, pHeader->numTriangles);
+	const uint32 * pTriangleMaterials = pFile->Array<uint32>(offset, pHeader->numTriangles);
+	const uint32 * pSourceIndices = pFile->Array<uint32>(offset, pHeader->numTriangles);
+	if (!pTriangles || !pTriangleMaterials || !pSourceIndices)
+		return false;
+
+	for (uint32 i = 0; i < pHeader->numTriangles; i++)
+	{
+		if (pTriangleMaterials[i] >= materials.size() || pSourceIndices[i] >= pHeader->numSourceTriangles)
+			return false;
+	}
+
+	bool res = m_tree.Read(pFile, offset);
+	for (size_t i = 0; res && i < m_tree.TriangleIndices().size(); i++)
+		res = m_tree.TriangleIndices()[i] < pHeader->numTriangles;
+
+	if (!res)
+	{
+		m_tree.Clear();
+		return false;
+	}
+
+	m_triangles.assign(pTriangles, pTriangles + pHeader->numTriangles);
+	for (uint32 i = 0; i < pHeader->numTriangles; i++)
+		m_triangles[i].SetMaterial(materials[pTriangleMaterials[i]]);
+
+	UpdateIntersections();
+
+	m_sourceIndices.assign(pSourceIndices, pSourceIndices + pHeader->numTriangles);
+	m_numSourceTriangles = pHeader->numSourceTriangles;
+	m_nMaxNodesLevel = static_cast<byte>(pHeader->nMaxNodesLevel);
+	m_nodeWidth = static_cast<int>(pHeader->nodeWidth);
+	m_bQuantizedNodes = pHeader->quantizedNodes != 0;
+	m_fBuildSAHCost = pHeader->fBuildSAHCost;
+	return true;
+}
@@ -0,0 +1,112 @@
+//
+//  CollisionMesh.h
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+#include "CollisionTriangle.h"
+#include "CollisionNode.h"
+#include "CollisionTree.h"
+#include "../common/thread.h"
+#include <atomic>
+#include <memory>
+
+namespace mr
+{
+
+// Triangles and collision tree in the local space of a mesh.
+// One mesh can be shared by many collision volumes, each of them places it with its own transformation.
+class CollisionMesh
+{
+public:
+	enum eBuildPreset
+	{
+		BUILD_HIGH_QUALITY, // SAH splits with the triangles clipped at the split planes, see CollisionNode::Create
+		BUILD_FAST, // linear tree of the Morton order, see CollisionTree::CreateLinear; not cached
+	};
+
+private:
+	CollisionTree m_tree;
+	CollisionTriangleArray m_triangles;
+	std::vector<TriangleIntersection> m_intersections; // intersection data of m_triangles, the only part the leaf tests read
+#ifdef USE_SSE
+	std::vector<TriangleBlock> m_triangleBlocks; // m_intersections by 4 in the order of the tree leaves
+#endif
+	std::vector<uint32> m_sourceIndices; // index of every kept triangle in the sequence passed to AddTriangle
+	uint32	m_numSourceTriangles;
+
+	// parameters of the last build to rebuild the tree when refitting makes it too slow
+	byte	m_nMaxNodesLevel;
+	int		m_numThreads;
+	int		m_nodeWidth;
+	bool	m_bQuantizedNodes;
+	eBuildPreset m_buildPreset;
+	float	m_fBuildSAHCost;
+
+	// the full tree of BuildAsync and its blocks, built on m_pBuildThread
+	CollisionTree m_builtTree;
+#ifdef USE_SSE
+	std::vector<TriangleBlock> m_builtTriangleBlocks;
+#endif
+	std::unique_ptr<Thread> m_pBuildThread;
+	std::atomic<bool> m_bBuildFinished;
+
+	CollisionMesh(const CollisionMesh &);
+	CollisionMesh & operator = (const CollisionMesh &);
+
+	void CreateTree(CollisionTree & tree, byte nMaxNodesLevel, int numThreads, int nodeWidth, bool bQuantizedNodes, eBuildPreset preset);
+	void UpdateIntersections();
+#ifdef USE_SSE
+	void CreateTriangleBlocks(std::vector<TriangleBlock> & blocks, const CollisionTree & tree) const;
+#endif
+	static void BuildThreadFunc(void * pMesh);
+	void JoinBuildThread(bool bKeepTree); // waits for the background build, its tree is put in place or dropped
+
+public:
+	CollisionMesh(size_t nReserveTrangles = 0);
+	~CollisionMesh();
+
+	const CollisionTree & Tree() const { return m_tree; }
+	const CollisionTriangleArray & Triangles() const { return m_triangles; }
+	const std::vector<TriangleIntersection> & Intersections() const { return m_intersections; }
+#ifdef USE_SSE
+	const std::vector<TriangleBlock> & TriangleBlocks() const { return m_triangleBlocks; } // leaf blocks start at Node::FirstTriangle() / 4
+#endif
+	const BBox & BoundingBox() const { return m_tree.BoundingBox(); }
+
+	void AddTriangle(const CollisionTriangle & t);
+	// numThreads = 0 uses all CPUs, 1 builds on the calling thread; nodeWidth and bQuantizedNodes are passed to CollisionTree::CreateWideNodes
+	void Build(byte nMaxNodesLevel = 0, int numThreads = 0, int nodeWidth = 0, bool bQuantizedNodes = false, eBuildPreset preset = BUILD_HIGH_QUALITY);
+	eBuildPreset BuildPreset() const { return m_buildPreset; }
+
+	// Builds a coarse tree of COARSE_NODES_LEVEL levels with the fast preset at once, so the mesh can be traced right away,
+	// and the high quality tree on a background thread. FinishBuild puts it in place when IsBuildFinished.
+	void BuildAsync(byte nMaxNodesLevel = 0, int numThreads = 0, int nodeWidth = 0, bool bQuantizedNodes = false);
+	bool IsBuilding() const { return m_pBuildThread != NULL; } // the coarse tree is in place
+	bool IsBuildFinished() const { return m_pBuildThread && m_bBuildFinished; } // may be called from any thread
+	// Swaps the background built tree in, rendering must be stopped; the BVH has to update the volumes of the mesh after it.
+	// Returns false if there is nothing to finish yet.
+	bool FinishBuild();
+
+	// Replaces the triangles by their deformed copies, in the same order and number as they were added (degenerate ones too),
+	// and refits the tree. The tree is rebuilt when its SAH cost grows more than REBUILD_SAH_RATIO times since the last build.
+	// Returns false if the triangles don't match the mesh topology.
+	bool Refit(const CollisionTriangleArray & triangles);
+
+	// Cache files keep the built mesh to skip the build next time, they are found by the key of the source file and build settings.
+	// Materials are stored as indices into the array the caller passes, it has to list them in the same order on saving and loading.
+	static uint64 CacheKey(const char * pSourceFilename, byte nMaxNodesLevel = 0, int nodeWidth = 0, bool bQuantizedNodes = false); // 0 if the source can't be read
+	bool SaveCache(const char * pFilename, uint64 key, const std::vector<const IMaterial *> & materials) const;
+	bool LoadCache(const char * pFilename, uint64 key, const std::vector<const IMaterial *> & materials); // false if it's missing or stale
+
+	static const float REBUILD_SAH_RATIO;
+	static const uint32 CACHE_VERSION;
+	static const byte COARSE_NODES_LEVEL;
+};
+
+typedef std::shared_ptr<CollisionMesh>	CollisionMeshPtr;
+
+}
@@ -7,15 +7,20 @@
 //
 
 #include "CollisionNode.h"
+#include "../common/threadpool.h"
 
 using namespace mr;
 
+const float CollisionNode::TRAVERSAL_COST = 1.f;
+const float CollisionNode::INTERSECTION_COST = 1.5f;
+
 // ------------------------------------------------------------------------ //
 
-CollisionNode::CollisionNode(CollisionNode * pParent)
-	: m_pParent(pParent)
-	, m_axis(0)
+CollisionNode::CollisionNode()
+	: m_axis(0)
 	, m_dist(FLT_MAX)
+	, m_pReferences(NULL)
+	, m_numReferences(0)
 {
 	m_pChilds[0] = m_pChilds[1] = NULL;
 	m_bbox.ClearBounds();
@@ -44,7 +49,7 @@ size_t CollisionNode::GetNodeCount() const
 
 size_t CollisionNode::GetTriangleCount() const
 {
-	size_t c = m_triangles.size();
+	size_t c = m_numReferences;
 	
 	if (m_pChilds[0])
 		c += m_pChilds[0]->GetTriangleCount();
@@ -55,370 +60,378 @@ size_t CollisionNode::GetTriangleCount() const
 	return c;
 }
 
-size_t CollisionNode::GetChildrenDepth() const
-{
-	return m_triangles.empty() ? 1 + std::max<size_t>(m_pChilds[0]->GetChildrenDepth(), m_pChilds[1]->GetChildrenDepth()) : 0;
-}
-
 // ------------------------------------------------------------------------ //
 
-//struct SplitVolume
-//{
-//	uint32 numTriangles;
-//	BBox bbox;
-//
-//	void AddTriangle(const BBox & triBBox)
-//	{
-//		bbox.AddToBounds(triBBox);
-//		numTriangles++;
-//	}
-//
-//	float GetSAH() const
-//	{
-//		return bbox.Area() * numTriangles;
-//	}
-//};
-//
-//struct SplitPlane
-//{
-//	float dist;
-//	SplitVolume volume[2];
-//	
-//	bool GetSide(const BBox &bbox, int axis) const // left = true, right = false;
-//	{
-//		float dmin = (dist - bbox.vMins[axis]);
-//		if (dmin <= 0.f)
-//			return false; // right
-//		
-//		float dmax = (bbox.vMaxs[axis] - dist);
-//		if (dmax <= 0.f)
-//			return true; // left
-//		
-//		return (dmax <= dmin);
-//	}
-//};
-
-bool CollisionNode::FindSplitPlane(const PolygonArray & polygons)
+struct SplitVolume
 {
-	const Vec3 vBoxSize = m_bbox.Size();
-	m_axis = vBoxSize.x >= vBoxSize.y ? (vBoxSize.x >= vBoxSize.z ? 0 : 2) : (vBoxSize.y >= vBoxSize.z ? 1 : 2);
-	m_dist = m_bbox.Center()[m_axis];
-	return true;
-	
-//	enum { NUM_SPLIT_VOLUMES = 64, NUM_SPLIT_PLANES = NUM_SPLIT_VOLUMES - 1 };
-//	SplitPlane pSplitPlanes[NUM_SPLIT_PLANES * 3];
-//	SplitVolume pSplitVolumes[NUM_SPLIT_VOLUMES * 3];
-//	
-//	{// reset split planes array
-//		const Vec3 dSize = vBoxSize / static_cast<float>(NUM_SPLIT_VOLUMES);
-//		SplitPlane *pSP = pSplitPlanes;
-//		for (int iAxis = 0; iAxis < 3; iAxis++)
-//		{
-//			for (int vi = 1; vi < NUM_SPLIT_VOLUMES; vi++, pSP++)
-//				pSP->dist = m_bbox.vMins[iAxis] + dSize[iAxis] * static_cast<float>(vi);
-//		}
-//	}
-//	
-//	{// reset split volumes array
-//		SplitVolume * pSV = pSplitVolumes;
-//		for (int i = NUM_SPLIT_VOLUMES * 3; i > 0; i--, pSV++)
-//		{
-//			pSV->numTriangles = 0;
-//			pSV->bbox.ClearBounds();
-//		}
-//	}
-//	
-//	const Vec3 vScale = Vec3(NUM_SPLIT_VOLUMES / vBoxSize[0], NUM_SPLIT_VOLUMES / vBoxSize[1], NUM_SPLIT_VOLUMES / vBoxSize[2]);
-//	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-//	{
-//		Vec3 vTriangleCenter = it->bbox.Center() - m_bbox.vMins;
-//		for (int iAxis = 0; iAxis < 3; iAxis++)
-//		{
-//			if (vBoxSize[iAxis] == 0.f)
-//				continue;
-//			
-//			int vi = std::min<int>(static_cast<int>(vTriangleCenter[iAxis] * vScale[iAxis]), NUM_SPLIT_PLANES); // volume index
-//			assert(vi >= 0 && vi < NUM_SPLIT_VOLUMES);
-//			
-//			// adjust index value (floating point error correction)
-//			if (vi < NUM_SPLIT_PLANES && !pSplitPlanes[iAxis * NUM_SPLIT_PLANES + vi].GetSide(it->bbox, iAxis))
-//				vi++;
-//			else if (vi > 0 && pSplitPlanes[iAxis * NUM_SPLIT_PLANES + vi - 1].GetSide(it->bbox, iAxis))
-//				vi--;
-//			
-//			pSplitVolumes[iAxis * NUM_SPLIT_VOLUMES + vi].AddTriangle(it->bbox);
-//		}
-//	}
-//	
-//	for (int iAxis = 0; iAxis < 3; iAxis++)
-//	{
-//		if (vBoxSize[iAxis] == 0.f)
-//			continue;
-//		
-//		SplitPlane * pSP = pSplitPlanes + iAxis * NUM_SPLIT_PLANES;
-//		const SplitVolume * pSV = pSplitVolumes + iAxis * NUM_SPLIT_VOLUMES;
-//		for (int i = 0; i < NUM_SPLIT_PLANES; i++)
-//		{
-//			pSP[i].volume[1].numTriangles = pSV[i].numTriangles;
-//			pSP[i].volume[1].bbox = pSV[i].bbox;
-//			
-//			int ri = NUM_SPLIT_PLANES - 1 - i; // reverse index
-//			pSP[ri].volume[0].numTriangles = pSV[ri + 1].numTriangles;
-//			pSP[ri].volume[0].bbox = pSV[ri + 1].bbox;
-//			
-//			if (i > 0)
-//			{
-//				pSP[i].volume[1].numTriangles += pSP[i - 1].volume[1].numTriangles;
-//				pSP[i].volume[1].bbox.AddToBounds(pSP[i - 1].volume[1].bbox);
-//				
-//				pSP[ri].volume[0].numTriangles += pSP[ri + 1].volume[0].numTriangles;
-//				pSP[ri].volume[0].bbox.AddToBounds(pSP[ri + 1].volume[0].bbox);
-//			}
-//		}
-//	}
-//	
-//	m_axis = -1;
-//	m_dist = 0.f;
-//	float fBestCost = FLT_MAX;
-//	for (int iAxis = 0; iAxis < 3; iAxis++)
-//	{
-//		if (vBoxSize[iAxis] == 0.f)
-//			continue;
-//		
-//		const SplitPlane * pSP = pSplitPlanes + iAxis * NUM_SPLIT_PLANES;
-//		for (int pi = 0; pi < NUM_SPLIT_PLANES; pi++, pSP++)
-//		{
-//			if (pSP->volume[0].numTriangles && pSP->volume[1].numTriangles)
-//			{
-//				float fCost = pSP->volume[0].GetSAH() + pSP->volume[1].GetSAH();
-//				if (fBestCost > fCost)
-//				{
-//					fBestCost = fCost;
-//					m_axis = iAxis;
-//					m_dist = pSP->dist;
-//				}
-//			}
-//		}
-//	}
-//	
-//	return m_axis >= 0;
-}
+	uint32 numTriangles;
+	BBox bbox;
 
-//struct SplitPlane
-//{
-//	float dist;
-//	SplitVolume volume[2];
-//};
-
-//bool CollisionNode::FindSplitPlane(const PolygonArray & polygons)
-//{
-//	const Vec3 vBoxSize = m_bbox.Size();
-//	m_axis = vBoxSize.x >= vBoxSize.y ? (vBoxSize.x >= vBoxSize.z ? 0 : 2) : (vBoxSize.y >= vBoxSize.z ? 1 : 2);
-//	m_dist = m_bbox.Center()[m_axis];
-//	return true;
-//
-//	enum { NUM_SPLIT_VOLUMES = 64, NUM_SPLIT_PLANES = NUM_SPLIT_VOLUMES - 1 };
-//	SplitPlane pSplitPlanes[3][NUM_SPLIT_PLANES];
-//
-//	{// reset split planes array
-//		const Vec3 dSize = vBoxSize / static_cast<float>(NUM_SPLIT_VOLUMES);
-//		for (int iAxis = 0; iAxis < 3; iAxis++)
-//		{
-//			SplitPlane * pSP = pSplitPlanes[iAxis];
-//			for (int vi = 0; vi < NUM_SPLIT_PLANES; vi++, pSP++)
-//			{
-//				pSP->dist = m_bbox.vMins[iAxis] + dSize[iAxis] * static_cast<float>(vi + 1);
-//				pSP->volume[0].numTriangles = 0;
-//				pSP->volume[0].bbox.ClearBounds();
-//				pSP->volume[1].numTriangles = 0;
-//				pSP->volume[1].bbox.ClearBounds();
-//			}
-//		}
-//	}
-//
-//	const Vec3 vScale = Vec3(NUM_SPLIT_VOLUMES / vBoxSize[0], NUM_SPLIT_VOLUMES / vBoxSize[1], NUM_SPLIT_VOLUMES / vBoxSize[2]);
-//	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-//	{
-//		for (int iAxis = 0; iAxis < 3; iAxis++)
-//		{
-//			if (vBoxSize[iAxis] == 0.f)
-//				continue;
-//
-//			int minVI = static_cast<int>((it->bbox.vMins[iAxis] - m_bbox.vMins[iAxis]) * vScale[iAxis]); // volume index
-//			if (minVI < NUM_SPLIT_PLANES - 1)
-//				pSplitPlanes[iAxis][minVI].volume[0].AddTriangle(it->bbox);
-//
-//			int maxVI = static_cast<int>((it->bbox.vMaxs[iAxis] - m_bbox.vMins[iAxis]) * vScale[iAxis]); // volume index
-//			if (maxVI > 1)
-//				pSplitPlanes[iAxis][maxVI - 1].volume[1].AddTriangle(it->bbox);
-//		}
-//	}
-//
-//	for (int iAxis = 0; iAxis < 3; iAxis++)
-//	{
-//		if (vBoxSize[iAxis] == 0.f)
-//			continue;
-//
-//		SplitPlane * pSP = pSplitPlanes[iAxis];
-//		for (int i = 1; i < NUM_SPLIT_PLANES; i++)
-//		{
-//			pSP[i].volume[0].numTriangles += pSP[i - 1].volume[0].numTriangles;
-//			pSP[i].volume[0].bbox.AddToBounds(pSP[i - 1].volume[0].bbox);
-//		}
-//		for (int i = NUM_SPLIT_PLANES - 1; i > 0; i--)
-//		{
-//			pSP[i - 1].volume[1].numTriangles += pSP[i].volume[1].numTriangles;
-//			pSP[i - 1].volume[1].bbox.AddToBounds(pSP[i].volume[1].bbox);
-//		}
-//	}
-//
-//	m_axis = -1;
-//	m_dist = 0.f;
-//	float fBestCost = FLT_MAX;
-//	for (int iAxis = 0; iAxis < 3; iAxis++)
-//	{
-//		if (vBoxSize[iAxis] == 0.f)
-//			continue;
-//
-//		const SplitPlane * pSP = pSplitPlanes[iAxis];	
-//		for (int pi = 0; pi < NUM_SPLIT_PLANES; pi++, pSP++)
-//		{
-////			if (!pSP->volume[0].numTriangles || !pSP->volume[1].numTriangles)
-////				continue;
-//
-//			float fCost = pSP->volume[0].GetSAH() + pSP->volume[1].GetSAH();
-//			if (fBestCost > fCost)
-//			{
-//				fBestCost = fCost;
-//				m_axis = iAxis;
-//				m_dist = pSP->dist;
-//			}
-//		}
-//	}
-//
-//	return m_axis >= 0;
-//}
+	void Clear()
+	{
+		numTriangles = 0;
+		bbox.ClearBounds();
+	}
+
+	void AddTriangle(const BBox & triBBox)
+	{
+		bbox.AddToBounds(triBBox);
+		numTriangles++;
+	}
+
+	void Add(const SplitVolume & sv)
+	{
+		bbox.AddToBounds(sv.bbox);
+		numTriangles += sv.numTriangles;
+	}
+};
 
-void CollisionNode::FillTriangles(const PolygonArray & polygons)
+struct CollisionNode::SplitBins
 {
-	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-		m_triangles.push_back(it->pTriangle);
-}
+	Vec3 vMinTriangleSize;
+	SplitVolume enter[3][NUM_SPLIT_BINS]; // polygons starting in the bin
+	SplitVolume exit[3][NUM_SPLIT_BINS]; // polygons ending in the bin
+
+	void Clear()
+	{
+		vMinTriangleSize = Vec3(FLT_MAX);
+		for (int iAxis = 0; iAxis < 3; iAxis++)
+		{
+			for (int i = 0; i < NUM_SPLIT_BINS; i++)
+			{
+				enter[iAxis][i].Clear();
+				exit[iAxis][i].Clear();
+			}
+		}
+	}
 
-BBox CollisionNode::CalculateBBox(const PolygonArray & polygons)
+	void Add(const SplitBins & sb)
+	{// min/max and integer sums only, so the result doesn't depend on the order of merging
+		for (int iAxis = 0; iAxis < 3; iAxis++)
+		{
+			vMinTriangleSize[iAxis] = fminf(vMinTriangleSize[iAxis], sb.vMinTriangleSize[iAxis]);
+			for (int i = 0; i < NUM_SPLIT_BINS; i++)
+			{
+				enter[iAxis][i].Add(sb.enter[iAxis][i]);
+				exit[iAxis][i].Add(sb.exit[iAxis][i]);
+			}
+		}
+	}
+};
+
+// Number of chunks processed by separate tasks, 1 if the work isn't worth splitting
+static size_t NumChunks(ThreadPool * pThreadPool, size_t count)
 {
-	BBox bbox;
-	bbox.ClearBounds();
-	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-		bbox.AddToBounds(it->bbox);
-	return bbox;
+	if (!pThreadPool || pThreadPool->NumThreads() < 2 || count < CollisionNode::PARALLEL_SPLIT_POLYGONS)
+		return 1;
+	return std::min<size_t>(pThreadPool->NumThreads() * 4, count / (CollisionNode::PARALLEL_SPLIT_POLYGONS / 4));
 }
 
-void CollisionNode::Create(byte level, const PolygonArray & polygons)
+void CollisionNode::BinReferences(SplitBins & bins, const Reference * pReferences, size_t count) const
 {
-	m_bbox = CalculateBBox(polygons);
-	Vec3 boxCenter = m_bbox.Center();
-	m_center = boxCenter;
-	m_extents = boxCenter - m_bbox.vMins;
+	const Vec3 vBoxSize = m_bbox.Size();
+	bins.Clear();
 
-	if (level == 0 || polygons.size() <= MAX_NODE_TRIANGLES || !FindSplitPlane(polygons))
+	for (const Reference * p = pReferences, * pEnd = pReferences + count; p < pEnd; p++)
 	{
-		FillTriangles(polygons);
-		return;
+		const BBox & triBBox = p->pTriangle->BoundingBox();
+		for (int iAxis = 0; iAxis < 3; iAxis++)
+		{
+			bins.vMinTriangleSize[iAxis] = fminf(bins.vMinTriangleSize[iAxis], triBBox.vMaxs[iAxis] - triBBox.vMins[iAxis]);
+			if (vBoxSize[iAxis] <= 0.f)
+				continue;
+
+			const float fMin = m_bbox.vMins[iAxis];
+			const float fScale = NUM_SPLIT_BINS / vBoxSize[iAxis];
+			int enterBin = clamp(static_cast<int>((p->bbox.vMins[iAxis] - fMin) * fScale), 0, NUM_SPLIT_BINS - 1);
+			int exitBin = clamp(static_cast<int>((p->bbox.vMaxs[iAxis] - fMin) * fScale), 0, NUM_SPLIT_BINS - 1);
+			bins.enter[iAxis][enterBin].AddTriangle(p->bbox);
+			bins.exit[iAxis][exitBin].AddTriangle(p->bbox);
+		}
 	}
+}
 
-	float fMinSize = FLT_MAX;
-	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-	{
-		const BBox & bbox = it->pTriangle->BoundingBox();
-		fMinSize = fminf(fMinSize, bbox.vMaxs[m_axis] - bbox.vMins[m_axis]);
-	}
+bool CollisionNode::FindSplitPlane(const Reference * pReferences, size_t count, ThreadPool * pThreadPool)
+{// binned SAH: polygons are clipped by the split plane, so the ones crossing it are counted on both sides
+	const Vec3 vBoxSize = m_bbox.Size();
+	const float fNodeArea = m_bbox.Area();
+	const float fLeafCost = INTERSECTION_COST * count;
+	if (fNodeArea <= 0.f)
+		return false;
+
+	const size_t numChunks = NumChunks(pThreadPool, count);
+	std::vector<SplitBins> chunkBins(numChunks);
+	ParallelFor(pThreadPool, numChunks, count, [&](size_t chunk, size_t begin, size_t end) {
+		BinReferences(chunkBins[chunk], pReferences + begin, end - begin);
+	});
+
+	SplitBins & bins = chunkBins[0];
+	for (size_t i = 1; i < numChunks; i++)
+		bins.Add(chunkBins[i]);
+
+	enum { NUM_SPLIT_PLANES = NUM_SPLIT_BINS - 1 };
+	SplitVolume pLeftVolumes[NUM_SPLIT_PLANES];
+
+	m_axis = -1;
+	m_dist = 0.f;
+	float fBestCost = FLT_MAX;
+	uint32 nBestMaxChildTriangles = 0;
+	for (int iAxis = 0; iAxis < 3; iAxis++)
+	{// don't split nodes smaller than the polygons' source triangles, it only clips them into slivers
+		if (vBoxSize[iAxis] <= 0.f || vBoxSize[iAxis] < bins.vMinTriangleSize[iAxis] * 2.f)
+			continue;
+
+		const SplitVolume * pEnterBins = bins.enter[iAxis];
+		const SplitVolume * pExitBins = bins.exit[iAxis];
+
+		pLeftVolumes[0] = pEnterBins[0];
+		for (int i = 1; i < NUM_SPLIT_PLANES; i++)
+		{
+			pLeftVolumes[i] = pLeftVolumes[i - 1];
+			pLeftVolumes[i].Add(pEnterBins[i]);
+		}
 
-	if ((m_bbox.vMaxs[m_axis] - m_bbox.vMins[m_axis]) < (fMinSize * 2.f))
-	{
-		FillTriangles(polygons);
-		return;
+		SplitVolume right;
+		right.Clear();
+		for (int i = NUM_SPLIT_PLANES - 1; i >= 0; i--)
+		{
+			right.Add(pExitBins[i + 1]);
+
+			const SplitVolume & left = pLeftVolumes[i];
+			if (!left.numTriangles || !right.numTriangles)
+				continue;
+
+			const float fDist = m_bbox.vMins[iAxis] + vBoxSize[iAxis] * static_cast<float>(i + 1) / NUM_SPLIT_BINS;
+
+			// child volumes are clipped by the split plane
+			BBox leftBBox = left.bbox;
+			leftBBox.vMaxs[iAxis] = fminf(leftBBox.vMaxs[iAxis], fDist);
+			BBox rightBBox = right.bbox;
+			rightBBox.vMins[iAxis] = fmaxf(rightBBox.vMins[iAxis], fDist);
+
+			float fCost = TRAVERSAL_COST + INTERSECTION_COST *
+				(leftBBox.Area() * left.numTriangles + rightBBox.Area() * right.numTriangles) / fNodeArea;
+			if (fBestCost > fCost)
+			{
+				fBestCost = fCost;
+				nBestMaxChildTriangles = std::max(left.numTriangles, right.numTriangles);
+				m_axis = iAxis;
+				m_dist = fDist;
+			}
+		}
 	}
 
-	PolygonArray childPolygons[2];
-	childPolygons[0].reserve(polygons.size());
-	childPolygons[1].reserve(polygons.size());
+	if (m_axis < 0)
+		return false;
 
-	for (PolygonArray::const_iterator it = polygons.begin(), itEnd = polygons.end(); it != itEnd; ++it)
-	{
-		if (it->bbox.vMaxs[m_axis] <= m_dist)
-			childPolygons[0].push_back(*it);
-		else if (it->bbox.vMins[m_axis] >= m_dist)
-			childPolygons[1].push_back(*it);
-		else
-		{// split polygon
-			Polygon p1(it->pTriangle);
-			Polygon p2(it->pTriangle);
+	if (fBestCost < fLeafCost)
+		return true;
 
-			float fDist1 = it->vertices[0][m_axis] - m_dist;
-			for (int i = 0; i < it->numVertices; i++)
+	// big leaves are split anyway unless the polygons can't be separated (e.g. triangle fans around one vertex)
+	return (count > MAX_LEAF_TRIANGLES) && (nBestMaxChildTriangles < count);
+}
+
+// Bounds of the triangle clipped by the box, false if no more than an edge is left
+static bool ClipTriangleBBox(BBox & bbox, const CollisionTriangle & t, const BBox & box)
+{
+	Vec3 polygons[2][9]; // every plane adds one vertex at most
+	Vec3 * pVertices = polygons[0];
+	int numVertices = 3;
+	for (int i = 0; i < 3; i++)
+		pVertices[i] = t.Vertex(i).pos;
+
+	const BBox & triBBox = t.BoundingBox();
+	for (int iAxis = 0; iAxis < 3; iAxis++)
+	{
+		for (int side = 0; side < 2; side++)
+		{
+			const float fPlane = side ? box.vMaxs[iAxis] : box.vMins[iAxis];
+			const float fSign = side ? 1.f : -1.f; // vertices at positive distances are clipped
+			if ((triBBox.vMaxs[iAxis] - fPlane) * fSign <= 0.f && (triBBox.vMins[iAxis] - fPlane) * fSign <= 0.f)
+				continue;
+
+			Vec3 * pClipped = (pVertices == polygons[0]) ? polygons[1] : polygons[0];
+			int numClipped = 0;
+
+			float fDist1 = (pVertices[0][iAxis] - fPlane) * fSign;
+			for (int i = 0; i < numVertices; i++)
 			{
-				const Vec3 & v1 = it->vertices[i];
-				const Vec3 & v2 = it->vertices[i < it->numVertices-1 ? i + 1 : 0];
-				if (fDist1 > 0.f)
-					p2.AddVertex(v1);
-				else
-					p1.AddVertex(v1);
-
-				float fDist2 = v2[m_axis] - m_dist;
+				const Vec3 & v1 = pVertices[i];
+				const Vec3 & v2 = pVertices[i < numVertices - 1 ? i + 1 : 0];
+				if (fDist1 <= 0.f)
+					pClipped[numClipped++] = v1;
+
+				float fDist2 = (v2[iAxis] - fPlane) * fSign;
 				if ((fDist1 > 0.f) ^ (fDist2 > 0.f))
 				{
 					float f = fDist1 / (fDist1 - fDist2);
-					Vec3 clip = Vec3::Lerp(v1, v2, f);
-					clip[m_axis] = m_dist; // interpolation error correction
-					p1.AddVertex(clip);
-					p2.AddVertex(clip);
+					Vec3 & clip = pClipped[numClipped++];
+					clip = Vec3::Lerp(v1, v2, f);
+					clip[iAxis] = fPlane; // interpolation error correction
 				}
 
 				fDist1 = fDist2;
 			}
 
-			assert(p1.numVertices >= 3);
-			assert(p2.numVertices >= 3);
+			if (numClipped < 3)
+				return false;
 
-			if (p1.numVertices >= 3)
-				childPolygons[0].push_back(p1);
-
-			if (p2.numVertices >= 3)
-				childPolygons[1].push_back(p2);
+			pVertices = pClipped;
+			numVertices = numClipped;
 		}
 	}
 
-	assert(!childPolygons[0].empty() && !childPolygons[1].empty());
-	if (childPolygons[0].empty() || childPolygons[1].empty())
+	bbox.ClearBounds();
+	for (int i = 0; i < numVertices; i++)
+		bbox.AddToBounds(pVertices[i]);
+	return true;
+}
+
+bool CollisionNode::SplitReference(Reference & left, Reference & right, const Reference & ref) const
+{// the fragments are clipped from the source triangles, so the references don't need to keep their vertices
+	CollisionTriangle * pTriangle = ref.pTriangle;
+	BBox leftBox = ref.bbox;
+	BBox rightBox = ref.bbox;
+	leftBox.vMaxs[m_axis] = m_dist;
+	rightBox.vMins[m_axis] = m_dist;
+
+	left.pTriangle = ClipTriangleBBox(left.bbox, *pTriangle, leftBox) ? pTriangle : NULL;
+	right.pTriangle = ClipTriangleBBox(right.bbox, *pTriangle, rightBox) ? pTriangle : NULL;
+	return left.pTriangle && right.pTriangle;
+}
+
+BBox CollisionNode::CalculateBBox(const Reference * pReferences, size_t count, ThreadPool * pThreadPool)
+{
+	const size_t numChunks = NumChunks(pThreadPool, count);
+	std::vector<BBox> chunkBBoxes(numChunks);
+	ParallelFor(pThreadPool, numChunks, count, [&](size_t chunk, size_t begin, size_t end) {
+		BBox & bbox = chunkBBoxes[chunk];
+		bbox.ClearBounds();
+		for (size_t i = begin; i < end; i++)
+			bbox.AddToBounds(pReferences[i].bbox);
+	});
+
+	BBox bbox = chunkBBoxes[0];
+	for (size_t i = 1; i < numChunks; i++)
+		bbox.AddToBounds(chunkBBoxes[i]);
+	return bbox;
+}
+
+void CollisionNode::Create(byte level, ReferenceArray & references, ThreadPool * pThreadPool)
+{
+	const size_t count = references.size();
+	references.resize(count * REFERENCES_CAPACITY_SCALE); // doesn't reallocate if the caller has reserved it
+	m_references.swap(references);
+	Create(level, m_references.data(), count, m_references.size(), pThreadPool);
+}
+
+void CollisionNode::Create(byte level, Reference * pReferences, size_t count, size_t capacity, ThreadPool * pThreadPool)
+{// the references are partitioned in place: the left ones and the left fragments of the crossing ones stay at the beginning,
+ // the right fragments and the right ones are moved after the left child's share of the free space
+	m_bbox = CalculateBBox(pReferences, count, pThreadPool);
+
+	if (level == 0 || count <= MIN_LEAF_TRIANGLES || !FindSplitPlane(pReferences, count, pThreadPool))
 	{
-		FillTriangles(polygons);
+		m_pReferences = pReferences;
+		m_numReferences = static_cast<uint32>(count);
 		return;
 	}
-	
-//	if ((CalculateBBox(childPolygons[0]).Area() * childPolygons[0].size()) +
-//		(CalculateBBox(childPolygons[1]).Area() * childPolygons[1].size()) >
-//		(m_bbox.Area() * polygons.size()))
-//	{
-//		FillTriangles(polygons);
-//		return;
-//	}
 
-	level--;
+	// left | crossing | right
+	Reference * pCrossing = pReferences;
+	Reference * pRight = pReferences + count;
+	for (Reference * it = pReferences; it < pRight; )
+	{
+		if (it->bbox.vMaxs[m_axis] <= m_dist)
+			std::swap(*it++, *pCrossing++);
+		else if (it->bbox.vMins[m_axis] >= m_dist)
+			std::swap(*it, *--pRight);
+		else
+			++it;
+	}
 
-	m_pChilds[0] = new CollisionNode(this);
-	m_pChilds[0]->Create(level, childPolygons[0]);
+	const size_t numLeft = pCrossing - pReferences;
+	const size_t numCrossing = pRight - pCrossing;
+	const size_t numRight = pReferences + count - pRight;
+	if (count + numCrossing > capacity)
+	{// the subtree continues in its own array, the parent's one is left as is
+		ReferenceArray references(count * REFERENCES_CAPACITY_SCALE);
+		std::copy(pReferences, pReferences + count, references.begin());
+		m_references.swap(references);
+
+		pReferences = m_references.data();
+		pCrossing = pReferences + numLeft;
+		pRight = pCrossing + numCrossing;
+		capacity = m_references.size();
+	}
+
+	// the free space is shared in proportion to the children sizes
+	const size_t freeSpace = capacity - count - numCrossing;
+	const size_t leftCapacity = numLeft + numCrossing + freeSpace * (numLeft + numCrossing) / (count + numCrossing);
+	Reference * pLeftChild = pReferences;
+	Reference * pRightChild = pReferences + leftCapacity;
+	std::copy_backward(pRight, pRight + numRight, pRightChild + numCrossing + numRight);
+
+	bool bClipped = true;
+	const size_t numChunks = NumChunks(pThreadPool, numCrossing);
+	std::vector<char> chunkClipped(numChunks, true);
+	ParallelFor(pThreadPool, numChunks, numCrossing, [&](size_t chunk, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			if (!SplitReference(pCrossing[i], pRightChild[i], pCrossing[i]))
+				chunkClipped[chunk] = false;
+		}
+	});
+
+	for (size_t i = 0; i < numChunks; i++)
+		bClipped &= (chunkClipped[i] != 0);
+
+	size_t numLeftChild = numLeft + numCrossing;
+	size_t numRightChild = numCrossing + numRight;
+	if (!bClipped)
+	{// remove the fragments clipped to edges
+		numLeftChild = numLeft;
+		for (size_t i = 0; i < numCrossing; i++)
+		{
+			if (pCrossing[i].pTriangle)
+				pLeftChild[numLeftChild++] = pCrossing[i];
+		}
 
-	m_pChilds[1] = new CollisionNode(this);
-	m_pChilds[1]->Create(level, childPolygons[1]);
+		numRightChild = 0;
+		for (size_t i = 0; i < numCrossing; i++)
+		{
+			if (pRightChild[i].pTriangle)
+				pRightChild[numRightChild++] = pRightChild[i];
+		}
+
+		std::copy(pRightChild + numCrossing, pRightChild + numCrossing + numRight, pRightChild + numRightChild);
+		numRightChild += numRight;
+	}
 
-	if (polygons.size() <= GetChildrenDepth() * 2)
+	if (numLeftChild == 0 || numRightChild == 0)
 	{
-		delete m_pChilds[0];
-		m_pChilds[0] = NULL;
-		delete m_pChilds[1];
-		m_pChilds[1] = NULL;
+		m_pReferences = numLeftChild ? pLeftChild : pRightChild;
+		m_numReferences = static_cast<uint32>(numLeftChild + numRightChild);
+		return;
+	}
+
+	level--;
 
-		FillTriangles(polygons);
+	m_pChilds[0] = new CollisionNode();
+	m_pChilds[1] = new CollisionNode();
+
+	const size_t rightCapacity = capacity - leftCapacity;
+	if (pThreadPool && pThreadPool->NumThreads() > 1 && count >= PARALLEL_BUILD_POLYGONS)
+	{// build the subtrees as separate tasks, each node only writes to itself and its part of the references
+		ThreadPool::TaskGroup group;
+		CollisionNode * pChild = m_pChilds[0];
+		pThreadPool->Run(group, [=]() { pChild->Create(level, pLeftChild, numLeftChild, leftCapacity, pThreadPool); });
+		m_pChilds[1]->Create(level, pRightChild, numRightChild, rightCapacity, pThreadPool);
+		pThreadPool->Wait(group);
+	}
+	else
+	{
+		m_pChilds[0]->Create(level, pLeftChild, numLeftChild, leftCapacity, pThreadPool);
+		m_pChilds[1]->Create(level, pRightChild, numRightChild, rightCapacity, pThreadPool);
 	}
 }
@@ -12,84 +12,69 @@
 namespace mr
 {
 
+class ThreadPool;
+
 class CollisionNode
 {
 public:
-	struct Polygon
+	// a triangle or its fragment clipped by the split planes of the parent nodes, the fragment is the triangle clipped by the bounds
+	struct Reference
 	{
 		CollisionTriangle * pTriangle;
 		BBox bbox;
-		int  numVertices;
-		Vec3 vertices[9];
-
-		Polygon(CollisionTriangle * pOriginTriangle)
-			: pTriangle(pOriginTriangle)
-			, numVertices(0)
-		{
-			bbox.ClearBounds();
-		}
-
-//		Polygon(const Polygon & p) : pTriangle(p.pTriangle), bbox(p.bbox), numVertices(p.numVertices)
-//		{
-//			memcpy(vertices, p.vertices, numVertices * sizeof(Vec3));
-//		}
-
-		void AddVertex(const Vec3 & p)
-		{
-			assert(numVertices < 9);
-			vertices[numVertices++] = p;
-			bbox.AddToBounds(p);
-		}
 	};
 
-	typedef std::vector<Polygon> PolygonArray;
+	typedef std::vector<Reference> ReferenceArray;
 
-private:
-	enum { MAX_NODE_TRIANGLES = 8 };
+	enum
+	{
+		MAX_NODES_LEVEL = 60, // traversal stacks hold 64 nodes
+		MIN_LEAF_TRIANGLES = 2,
+		MAX_LEAF_TRIANGLES = 32, // bigger leaves are split even if SAH says otherwise
+		NUM_SPLIT_BINS = 32,
+		PARALLEL_BUILD_POLYGONS = 4096, // subtrees with fewer polygons are built by one task
+		PARALLEL_SPLIT_POLYGONS = 65536, // nodes with more polygons are binned and split by several tasks
+		REFERENCES_CAPACITY_SCALE = 3, // space for the fragments, a subtree running out of it allocates its own
+	};
 
-	CollisionNode * const m_pParent;
+	// surface area heuristic costs
+	static const float TRAVERSAL_COST;
+	static const float INTERSECTION_COST;
 
+private:
 	BBox		m_bbox;
-#ifdef USE_SSE
-	__m128		m_center;
-	__m128		m_extents;
-#else
-	Vec3		m_center;
-	Vec3		m_extents;
-#endif
 	int			m_axis;
 	float		m_dist;
 
 	CollisionNode *	m_pChilds[2];
-	std::vector<CollisionTriangle *>	m_triangles;
+	const Reference *	m_pReferences; // leaf references
+	uint32				m_numReferences;
+	ReferenceArray		m_references; // the array the subtree references are partitioned in, only when the parent's one is full
+
+	struct SplitBins;
 
-	bool FindSplitPlane(const PolygonArray & polygons);
-	void FillTriangles(const PolygonArray & polygons);
-	static BBox CalculateBBox(const PolygonArray & polygons);
-	static float CalculateSAH(const PolygonArray & polygons);
+	void BinReferences(SplitBins & bins, const Reference * pReferences, size_t count) const;
+	bool FindSplitPlane(const Reference * pReferences, size_t count, ThreadPool * pThreadPool);
+	bool SplitReference(Reference & left, Reference & right, const Reference & ref) const;
+	void Create(byte level, Reference * pReferences, size_t count, size_t capacity, ThreadPool * pThreadPool);
+	static BBox CalculateBBox(const Reference * pReferences, size_t count, ThreadPool * pThreadPool);
 
 public:
-	CollisionNode(CollisionNode * pParent);
+	CollisionNode();
 	~CollisionNode();
 
 	const BBox & BoundingBox() const { return m_bbox; }
-#ifdef USE_SSE
-	const __m128 & Center() const { return m_center; }
-	const __m128 & Extents() const { return m_extents; }
-#else
-	const Vec3 & Center() const { return m_center; }
-	const Vec3 & Extents() const { return m_extents; }
-#endif
 	byte Axis() const { return m_axis; }
 	float Dist() const { return m_dist; }
 	CollisionNode * Child(int i) const { return m_pChilds[i]; }
-	const std::vector<CollisionTriangle *> & Triangles() const { return m_triangles; }
+	const Reference * References() const { return m_pReferences; }
+	uint32 NumReferences() const { return m_numReferences; }
 
 	size_t GetNodeCount() const;
 	size_t GetTriangleCount() const;
-	size_t GetChildrenDepth() const;
 
-	void Create(byte level, const PolygonArray & polygons);
+	// the references are moved into the node, grown for the clipped fragments and partitioned in place
+	void Create(byte level, ReferenceArray & references, ThreadPool * pThreadPool = NULL);
 };
 
 }
@@ -0,0 +1,132 @@
+//
+//  CollisionPacket.h
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+#include "CollisionRay.h"
+#include <new>
+
+namespace mr
+{
+
+// Up to MAX_RAYS coherent rays walking a tree together. Every ray keeps its own segment clipped by its own hits,
+// the packet only keeps a copy of the segments as SoA to test a node box against 4 of them at once.
+// Sets of rays are passed around as bit masks of their indices.
+class CollisionPacket
+{
+public:
+	enum { MAX_RAYS = 16 };
+
+private:
+	float	m_center[3][MAX_RAYS];
+	float	m_halfDir[3][MAX_RAYS];
+	float	m_halfSize[3][MAX_RAYS];
+
+	// rays are set one by one, CollisionRay has no default constructor
+	struct RayStorage
+	{
+#ifdef USE_SSE
+		__m128	align;
+#endif
+		byte	data[sizeof(CollisionRay)];
+	};
+	RayStorage	m_rays[MAX_RAYS];
+
+public:
+	void SetRay(int i, const Vec3 & origin, const Vec3 & end, TraceResult & tr)
+	{
+		new (m_rays[i].data) CollisionRay(origin, end, tr);
+		UpdateRay(i);
+	}
+
+	CollisionRay & Ray(int i) { return *reinterpret_cast<CollisionRay *>(m_rays[i].data); }
+	const CollisionRay & Ray(int i) const { return *reinterpret_cast<const CollisionRay *>(m_rays[i].data); }
+
+	// has to be called after the ray is clipped
+	void UpdateRay(int i)
+	{
+		const CollisionRay & ray = Ray(i);
+		for (int j = 0; j < 3; j++)
+		{
+			const float fHalfDir = ray.Direction()[j] * 0.5f;
+			m_center[j][i] = ray.Origin()[j] + fHalfDir;
+			m_halfDir[j][i] = fHalfDir;
+			m_halfSize[j][i] = fabsf(fHalfDir);
+		}
+	}
+
+	// the rays of the mask with the origin above the split plane of the axis
+	uint32 OriginsAbove(int axis, float dist, uint32 mask) const
+	{
+		uint32 res = 0;
+		for (int i = 0; i < MAX_RAYS; i++)
+		{
+			if ((mask & (1 << i)) && Ray(i).Origin()[axis] > dist)
+				res |= 1 << i;
+		}
+		return res;
+	}
+
+	// the first ray of the mask
+	static int FirstRay(uint32 mask)
+	{
+		int i = 0;
+		while (!(mask & (1 << i)))
+			i++;
+		return i;
+	}
+
+	// segments vs box separating axis test, returns the rays of the mask intersecting the box
+	uint32 TestIntersection(const Vec3 & boxCenter, const Vec3 & boxExtents, uint32 mask) const
+	{
+		uint32 res = 0;
+#ifdef USE_SSE
+		const __m128 cx = _mm_set1_ps(boxCenter.x), cy = _mm_set1_ps(boxCenter.y), cz = _mm_set1_ps(boxCenter.z);
+		const __m128 ex = _mm_set1_ps(boxExtents.x), ey = _mm_set1_ps(boxExtents.y), ez = _mm_set1_ps(boxExtents.z);
+		for (int i = 0; i < MAX_RAYS; i += 4)
+		{
+			if (!((mask >> i) & 0xF))
+				continue;
+
+			const __m128 dx = _mm_sub_ps(_mm_loadu_ps(m_center[0] + i), cx);
+			const __m128 dy = _mm_sub_ps(_mm_loadu_ps(m_center[1] + i), cy);
+			const __m128 dz = _mm_sub_ps(_mm_loadu_ps(m_center[2] + i), cz);
+			const __m128 hdx = _mm_loadu_ps(m_halfDir[0] + i), hdy = _mm_loadu_ps(m_halfDir[1] + i), hdz = _mm_loadu_ps(m_halfDir[2] + i);
+			const __m128 hsx = _mm_loadu_ps(m_halfSize[0] + i), hsy = _mm_loadu_ps(m_halfSize[1] + i), hsz = _mm_loadu_ps(m_halfSize[2] + i);
+
+			__m128 m = _mm_cmple_ps(_mm_abs_ps(dx), _mm_add_ps(ex, hsx));
+			m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(dy), _mm_add_ps(ey, hsy)));
+			m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(dz), _mm_add_ps(ez, hsz)));
+			m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(hdy, dz), _mm_mul_ps(hdz, dy))),
+										   _mm_add_ps(_mm_mul_ps(ey, hsz), _mm_mul_ps(ez, hsy))));
+			m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(hdz, dx), _mm_mul_ps(hdx, dz))),
+										   _mm_add_ps(_mm_mul_ps(ez, hsx), _mm_mul_ps(ex, hsz))));
+			m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(hdx, dy), _mm_mul_ps(hdy, dx))),
+										   _mm_add_ps(_mm_mul_ps(ex, hsy), _mm_mul_ps(ey, hsx))));
+			res |= static_cast<uint32>(_mm_movemask_ps(m)) << i;
+		}
+#else
+		for (int i = 0; i < MAX_RAYS; i++)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			const float dx = m_center[0][i] - boxCenter.x, dy = m_center[1][i] - boxCenter.y, dz = m_center[2][i] - boxCenter.z;
+			if (fabsf(dx) <= boxExtents.x + m_halfSize[0][i] &&
+				fabsf(dy) <= boxExtents.y + m_halfSize[1][i] &&
+				fabsf(dz) <= boxExtents.z + m_halfSize[2][i] &&
+				fabsf(m_halfDir[1][i] * dz - m_halfDir[2][i] * dy) <= boxExtents.y * m_halfSize[2][i] + boxExtents.z * m_halfSize[1][i] &&
+				fabsf(m_halfDir[2][i] * dx - m_halfDir[0][i] * dz) <= boxExtents.z * m_halfSize[0][i] + boxExtents.x * m_halfSize[2][i] &&
+				fabsf(m_halfDir[0][i] * dy - m_halfDir[1][i] * dx) <= boxExtents.x * m_halfSize[1][i] + boxExtents.y * m_halfSize[0][i])
+				res |= 1 << i;
+		}
+#endif
+		return res & mask;
+	}
+};
+
+}
@@ -12,6 +12,21 @@ namespace mr
 
 struct TraceResult;
 
+// Polygons are clipped at the split planes, so a triangle lands in every leaf it crosses and a ray would test it
+// in each of them. The ray keeps the indices of its last tested triangles in a small direct mapped table, a miss stays
+// a miss as the ray only gets shorter. It belongs to the ray on the stack of the tracing thread, so nothing is shared.
+class TriangleMailbox
+{
+	enum { SIZE = 8 };
+	uint32 m_indices[SIZE];
+
+public:
+	TriangleMailbox() { memset(m_indices, 0xFF, sizeof(m_indices)); }
+
+	bool Contains(uint32 index) const { return m_indices[index & (SIZE - 1)] == index; }
+	void Add(uint32 index) { m_indices[index & (SIZE - 1)] = index; }
+};
+
 class CollisionRay
 {
 	Vec3 m_vOrigin;
@@ -32,6 +47,7 @@ class CollisionRay
 #endif
 
 	TraceResult & m_tr;
+	TriangleMailbox m_mailbox;
 	
 public:
 	
@@ -58,6 +74,7 @@ public:
 	const Vec3 & End() const { return m_vEnd; }
 	const Vec3 & Direction() const { return m_vDir; }
 	TraceResult & TraceResult() { return m_tr; }
+	TriangleMailbox & Mailbox() { return m_mailbox; }
 
 	void Clip(float f)
 	{
@@ -130,7 +147,7 @@ public:
 		__m128 v2 = _mm_add_ps(_mm_mul_ps(boxExtents, m_halfSizeShuffled),
 							   _mm_mul_ps(m_halfSize, _mm_shuffle_ps(boxExtents, boxExtents, _MM_SHUFFLE(3, 0, 2, 1))));
 
-		return _mm_movemask_epi8(_mm_castps_si128(_mm_cmple_ps(_mm_abs_ps(v1), v2))) == 0xFFFF;
+		return (_mm_movemask_ps(_mm_cmple_ps(_mm_abs_ps(v1), v2)) & 7) == 7; // w holds unrelated node data
 	}
 #else
 	inline bool TestIntersection(const Vec3 & vBoxCenter, const Vec3 & vBoxExtents) const
@@ -0,0 +1,920 @@
+//
+//  CollisionTree.cpp
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#include "CollisionTree.h"
+#include "CollisionNode.h"
+#include "../common/threadpool.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace mr;
+
+static_assert(sizeof(CollisionTree::Node) == CollisionTree::NODE_ALIGNMENT, "collision tree nodes must fill cache lines exactly");
+static_assert(sizeof(CollisionTree::WideNode<4>) == 128, "4 wide nodes must fill two cache lines");
+static_assert(sizeof(CollisionTree::WideNode<8>) == 256, "8 wide nodes must fill four cache lines");
+static_assert(sizeof(CollisionTree::QuantizedNode) == 64, "quantized nodes must fill one cache line");
+
+static void * AlignedAlloc(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void * p = NULL;
+	return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+#endif
+}
+
+static void AlignedFree(void * p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static bool CPUSupportsAVX()
+{
+#if defined(USE_AVX) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	const bool bOSXSave = (info[2] & (1 << 27)) != 0;
+	const bool bAVX = (info[2] & (1 << 28)) != 0;
+	return bOSXSave && bAVX && (_xgetbv(0) & 6) == 6; // OS saves YMM registers
+#elif defined(USE_AVX)
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+// ------------------------------------------------------------------------ //
+
+CollisionTree::CollisionTree()
+	: m_pNodes(NULL)
+	, m_numNodes(0)
+	, m_bDisjoint(true)
+	, m_pWideNodes(NULL)
+	, m_numWideNodes(0)
+	, m_nodeWidth(2)
+	, m_bQuantized(false)
+	, m_bMappedWideNodes(false)
+{
+	m_bbox.ClearBounds();
+}
+
+CollisionTree::~CollisionTree()
+{
+	Clear();
+}
+
+void CollisionTree::Clear()
+{
+	ClearWideNodes();
+
+	if (m_pNodes && !m_pMappedFile)
+		AlignedFree(m_pNodes);
+	m_pNodes = NULL;
+	m_pMappedFile.reset();
+
+	m_numNodes = 0;
+	std::vector<uint32>().swap(m_triangleIndices);
+	std::vector<uint32>().swap(m_partOffsets);
+	std::vector<Vec2>().swap(m_partVertices);
+	std::vector<uint32>().swap(m_parentLinks);
+	m_bbox.ClearBounds();
+	m_bDisjoint = true;
+}
+
+void CollisionTree::Swap(CollisionTree & tree)
+{
+	std::swap(m_pNodes, tree.m_pNodes);
+	std::swap(m_numNodes, tree.m_numNodes);
+	m_triangleIndices.swap(tree.m_triangleIndices);
+	m_partOffsets.swap(tree.m_partOffsets);
+	m_partVertices.swap(tree.m_partVertices);
+	m_parentLinks.swap(tree.m_parentLinks);
+	std::swap(m_bbox, tree.m_bbox);
+	std::swap(m_bDisjoint, tree.m_bDisjoint);
+	std::swap(m_pWideNodes, tree.m_pWideNodes);
+	std::swap(m_numWideNodes, tree.m_numWideNodes);
+	std::swap(m_nodeWidth, tree.m_nodeWidth);
+	std::swap(m_bQuantized, tree.m_bQuantized);
+	m_pMappedFile.swap(tree.m_pMappedFile);
+	std::swap(m_bMappedWideNodes, tree.m_bMappedWideNodes);
+}
+
+// ------------------------------------------------------------------------ //
+
+void CollisionTree::Create(const CollisionNode & root, const CollisionTriangle * pTriangles)
+{
+	Clear();
+
+	const size_t numNodes = root.GetNodeCount();
+	m_pNodes = reinterpret_cast<Node *>(AlignedAlloc(numNodes * sizeof(Node), NODE_ALIGNMENT));
+	if (!m_pNodes)
+	{
+		printf("Failed to allocate %d collision tree nodes!\n", static_cast<int>(numNodes));
+		return;
+	}
+
+	m_numNodes = static_cast<uint32>(numNodes);
+	m_triangleIndices.reserve(root.GetTriangleCount());
+
+	uint32 count = AddNode(&root, pTriangles, 0);
+	assert(count == m_numNodes);
+	(void)count;
+
+	CreateParentLinks();
+	m_bbox = root.BoundingBox();
+}
+
+uint32 CollisionTree::AddNode(const CollisionNode * pNode, const CollisionTriangle * pTriangles, uint32 index)
+{
+	Node & node = m_pNodes[index];
+	node.center = pNode->BoundingBox().Center();
+	node.extents = node.center - pNode->BoundingBox().vMins;
+
+	if (!pNode->Child(0))
+	{
+		node.numTriangles = pNode->NumReferences();
+		node.data = (static_cast<uint32>(m_triangleIndices.size()) << 2) | Node::LEAF;
+		for (const CollisionNode::Reference * it = pNode->References(), * itEnd = it + pNode->NumReferences(); it != itEnd; ++it)
+			m_triangleIndices.push_back(static_cast<uint32>(it->pTriangle - pTriangles));
+		while (m_triangleIndices.size() % LEAF_TRIANGLES_ALIGNMENT)
+			m_triangleIndices.push_back(m_triangleIndices.back());
+		return index + 1;
+	}
+
+	assert(pNode->Child(0) && pNode->Child(1));
+	uint32 secondChild = AddNode(pNode->Child(0), pTriangles, index + 1);
+	node.dist = pNode->Dist();
+	node.data = (secondChild << 2) | pNode->Axis();
+	return AddNode(pNode->Child(1), pTriangles, secondChild);
+}
+
+// ------------------------------------------------------------------------ //
+
+void CollisionTree::CreateLinear(const CollisionTriangle * pTriangles, uint32 numTriangles, byte nMaxNodesLevel, ThreadPool * pThreadPool)
+{
+	Clear();
+	if (!numTriangles)
+		return;
+
+	const size_t numChunks = pThreadPool && pThreadPool->NumThreads() > 1 && numTriangles >= PARALLEL_LINEAR_BUILD_TRIANGLES ?
+		pThreadPool->NumThreads() * 4 : 1;
+
+	// the triangles are big, their centers are gathered in one pass
+	std::vector<Vec3> centers(numTriangles);
+	std::vector<BBox> chunkBBoxes(numChunks);
+	ParallelFor(pThreadPool, numChunks, numTriangles, [&](size_t chunk, size_t begin, size_t end) {
+		BBox & bbox = chunkBBoxes[chunk];
+		bbox.ClearBounds();
+		for (size_t i = begin; i < end; i++)
+		{
+			centers[i] = pTriangles[i].BoundingBox().Center();
+			bbox.AddToBounds(centers[i]);
+		}
+	});
+
+	BBox centerBBox = chunkBBoxes[0];
+	for (size_t i = 1; i < numChunks; i++)
+		centerBBox.AddToBounds(chunkBBoxes[i]);
+
+	// every level splits at a lower bit than its parent, so nodes above nMaxNodesLevel need only that many top bits;
+	// the rest are dropped to sort less for coarse trees
+	const int numBits = std::min<int>(nMaxNodesLevel, 30);
+	const uint32 codeMask = ~((1u << (30 - numBits)) - 1);
+	std::vector<MortonTriangle> triangles(numTriangles);
+	ParallelFor(pThreadPool, numChunks, numTriangles, [&](size_t chunk, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			triangles[i].code = MortonCode(centers[i], centerBBox) & codeMask;
+			triangles[i].index = static_cast<uint32>(i);
+		}
+	});
+	std::vector<Vec3>().swap(centers);
+
+	SortMortonTriangles(triangles, 30 - numBits, pThreadPool);
+
+	std::vector<Node> nodes;
+	nodes.reserve(numTriangles / LINEAR_LEAF_TRIANGLES * 2 + 1);
+	m_triangleIndices.reserve(numTriangles + numTriangles / 2);
+	m_bbox = AddLinearNode(nodes, triangles.data(), triangles.data() + numTriangles, nMaxNodesLevel - 1, pTriangles, centerBBox);
+
+	m_pNodes = reinterpret_cast<Node *>(AlignedAlloc(nodes.size() * sizeof(Node), NODE_ALIGNMENT));
+	if (!m_pNodes)
+	{
+		printf("Failed to allocate %d collision tree nodes!\n", static_cast<int>(nodes.size()));
+		Clear();
+		return;
+	}
+
+	std::copy(nodes.begin(), nodes.end(), m_pNodes);
+	m_numNodes = static_cast<uint32>(nodes.size());
+	m_bDisjoint = false; // whole triangles, the children overlap
+	CreateParentLinks();
+}
+
+// LSD radix sort by 8 bit digits of the 30 bit codes from firstBit up. Every pass counts the digits of the chunks
+// on the thread pool, then the chunks scatter their keys to the offsets of their own counts, so the order of equal keys is kept.
+void CollisionTree::SortMortonTriangles(std::vector<MortonTriangle> & triangles, int firstBit, ThreadPool * pThreadPool)
+{
+	enum { DIGIT_BITS = 8, NUM_DIGITS = 1 << DIGIT_BITS };
+
+	const size_t count = triangles.size();
+	const size_t numChunks = pThreadPool && pThreadPool->NumThreads() > 1 && count >= PARALLEL_LINEAR_BUILD_TRIANGLES ?
+		pThreadPool->NumThreads() * 4 : 1;
+
+	std::vector<MortonTriangle> sorted(count);
+	std::vector<uint32> offsets(numChunks * NUM_DIGITS);
+	for (int shift = firstBit; shift < 30; shift += DIGIT_BITS)
+	{
+		ParallelFor(pThreadPool, numChunks, count, [&](size_t chunk, size_t begin, size_t end) {
+			uint32 * pCounts = &offsets[chunk * NUM_DIGITS];
+			std::fill(pCounts, pCounts + NUM_DIGITS, 0);
+			for (size_t i = begin; i < end; i++)
+				pCounts[(triangles[i].code >> shift) & (NUM_DIGITS - 1)]++;
+		});
+
+		uint32 offset = 0;
+		for (int digit = 0; digit < NUM_DIGITS; digit++)
+		{
+			for (size_t chunk = 0; chunk < numChunks; chunk++)
+			{
+				const uint32 n = offsets[chunk * NUM_DIGITS + digit];
+				offsets[chunk * NUM_DIGITS + digit] = offset;
+				offset += n;
+			}
+		}
+
+		ParallelFor(pThreadPool, numChunks, count, [&](size_t chunk, size_t begin, size_t end) {
+			uint32 * pOffsets = &offsets[chunk * NUM_DIGITS];
+			for (size_t i = begin; i < end; i++)
+				sorted[pOffsets[(triangles[i].code >> shift) & (NUM_DIGITS - 1)]++] = triangles[i];
+		});
+
+		triangles.swap(sorted);
+	}
+}
+
+// coordinate of the cell of the code along the axis, see MortonCode
+static inline uint32 MortonCell(uint32 code, int axis)
+{
+	uint32 cell = 0;
+	for (int i = 0; i < 10; i++)
+		cell |= ((code >> (i * 3 + 2 - axis)) & 1) << i;
+	return cell;
+}
+
+// Adds the node of the sorted range and its subtree in depth-first order, returns the bounding box of the range.
+// The split plane is kept for ordering the children along rays: the cell border of the split bit, or the middle of the node
+// when all codes are equal and the range is just halved.
+BBox CollisionTree::AddLinearNode(std::vector<Node> & nodes, const MortonTriangle * pBegin, const MortonTriangle * pEnd, byte level,
+								  const CollisionTriangle * pTriangles, const BBox & centerBBox)
+{
+	const uint32 index = static_cast<uint32>(nodes.size());
+	nodes.push_back(Node());
+
+	BBox bbox;
+	const uint32 count = static_cast<uint32>(pEnd - pBegin);
+	if (count <= LINEAR_LEAF_TRIANGLES || level == 0)
+	{
+		bbox.ClearBounds();
+		Node & leaf = nodes[index];
+		leaf.numTriangles = count;
+		leaf.data = (static_cast<uint32>(m_triangleIndices.size()) << 2) | Node::LEAF;
+		for (const MortonTriangle * p = pBegin; p < pEnd; p++)
+		{
+			bbox.AddToBounds(pTriangles[p->index].BoundingBox());
+			m_triangleIndices.push_back(p->index);
+		}
+		while (m_triangleIndices.size() % LEAF_TRIANGLES_ALIGNMENT)
+			m_triangleIndices.push_back(m_triangleIndices.back());
+	}
+	else
+	{
+		const MortonTriangle * pSplit;
+		int axis;
+		float dist;
+		const uint32 diff = pBegin->code ^ (pEnd - 1)->code;
+		if (diff)
+		{
+			int bit = 0;
+			while (diff >> (bit + 1))
+				bit++;
+
+			// the codes share the bits above, so the split bit is 0 in the first part and 1 in the second one
+			const MortonTriangle * pFirst = pBegin, * pLast = pEnd - 1;
+			while (pLast - pFirst > 1)
+			{
+				const MortonTriangle * pMiddle = pFirst + (pLast - pFirst) / 2;
+				if (pMiddle->code & (1 << bit))
+					pLast = pMiddle;
+				else
+					pFirst = pMiddle;
+			}
+			pSplit = pLast;
+
+			// the border of the cells along the axis of the split bit
+			axis = 2 - bit % 3;
+			const uint32 cell = MortonCell(pSplit->code, axis) & ~((1u << (bit / 3)) - 1);
+			dist = centerBBox.vMins[axis] + centerBBox.Size()[axis] * (cell / 1024.f);
+		}
+		else
+		{
+			pSplit = pBegin + count / 2;
+			axis = 0;
+			dist = centerBBox.vMins.x + centerBBox.Size().x * ((MortonCell(pBegin->code, 0) + 0.5f) / 1024.f);
+		}
+
+		const BBox bbox0 = AddLinearNode(nodes, pBegin, pSplit, level - 1, pTriangles, centerBBox);
+		const uint32 secondChild = static_cast<uint32>(nodes.size());
+		const BBox bbox1 = AddLinearNode(nodes, pSplit, pEnd, level - 1, pTriangles, centerBBox);
+
+		bbox = bbox0;
+		bbox.AddToBounds(bbox1);
+		nodes[index].dist = dist;
+		nodes[index].data = (secondChild << 2) | axis;
+	}
+
+	Node & node = nodes[index];
+	node.center = bbox.Center();
+	node.extents = node.center - bbox.vMins;
+	return bbox;
+}
+
+bool CollisionTree::CreateParentLinks()
+{
+	m_parentLinks.assign(m_numNodes, 0);
+	for (uint32 i = 0; i < m_numNodes; i++)
+	{
+		const Node & node = m_pNodes[i];
+		if (node.IsLeaf())
+			continue;
+
+		if (node.SecondChild() <= i + 1 || node.SecondChild() >= m_numNodes)
+			return false;
+
+		m_parentLinks[i + 1] = i;
+		m_parentLinks[node.SecondChild()] = i;
+	}
+	return true;
+}
+
+// Clips the triangle by the box and adds the parametric coordinates of the rest polygon
+static void ClipTriangle(std::vector<Vec2> & vertices, const CollisionTriangle & t, const BBox & bbox)
+{
+	struct ClipVertex
+	{
+		Vec3	pos;
+		Vec2	pc;
+	};
+
+	enum { MAX_CLIP_VERTICES = 9 }; // a triangle clipped by 6 planes
+	ClipVertex buffers[2][MAX_CLIP_VERTICES];
+	ClipVertex * pIn = buffers[0], * pOut = buffers[1];
+	int numIn = 3;
+	pIn[0].pos = t.Vertex(0).pos; pIn[0].pc = Vec2(0.f, 0.f);
+	pIn[1].pos = t.Vertex(1).pos; pIn[1].pc = Vec2(1.f, 0.f);
+	pIn[2].pos = t.Vertex(2).pos; pIn[2].pc = Vec2(0.f, 1.f);
+
+	for (int plane = 0; plane < 6 && numIn > 0; plane++)
+	{
+		const int axis = plane >> 1;
+		const float sign = (plane & 1) ? -1.f : 1.f; // keeps sign * (p - limit) >= 0
+		const float limit = (plane & 1) ? bbox.vMaxs[axis] : bbox.vMins[axis];
+
+		int numOut = 0;
+		for (int i = 0; i < numIn; i++)
+		{
+			const ClipVertex & a = pIn[i];
+			const ClipVertex & b = pIn[(i + 1) % numIn];
+			const float da = sign * (a.pos[axis] - limit);
+			const float db = sign * (b.pos[axis] - limit);
+			if (da >= 0.f)
+				pOut[numOut++] = a;
+			if ((da < 0.f) != (db < 0.f) && numOut < MAX_CLIP_VERTICES)
+			{
+				const float f = da / (da - db);
+				ClipVertex & c = pOut[numOut++];
+				c.pos = Vec3::Lerp(a.pos, b.pos, f);
+				c.pc = a.pc + (b.pc - a.pc) * f;
+			}
+		}
+
+		std::swap(pIn, pOut);
+		numIn = numOut;
+	}
+
+	if (numIn == 0)
+	{// the triangle just touches the box, keep all of it
+		vertices.push_back(Vec2(0.f, 0.f));
+		vertices.push_back(Vec2(1.f, 0.f));
+		vertices.push_back(Vec2(0.f, 1.f));
+		return;
+	}
+
+	for (int i = 0; i < numIn; i++)
+		vertices.push_back(pIn[i].pc);
+}
+
+void CollisionTree::PrepareRefit(const CollisionTriangle * pTriangles)
+{
+	m_partOffsets.resize(m_triangleIndices.size() + 1);
+	m_partVertices.clear();
+	m_partVertices.reserve(m_triangleIndices.size() * 4);
+
+	for (uint32 i = 0; i < m_numNodes; i++)
+	{
+		const Node & node = m_pNodes[i];
+		if (!node.IsLeaf())
+			continue;
+
+		BBox bbox = node.BoundingBox(); // a bit larger not to lose triangles lying on its sides
+		const Vec3 vSize = bbox.Size();
+		const Vec3 vEpsilon(std::max(vSize.x, std::max(vSize.y, vSize.z)) * 1e-4f);
+		bbox.vMins -= vEpsilon;
+		bbox.vMaxs += vEpsilon;
+		uint32 j = node.FirstTriangle();
+		for (const uint32 jEnd = j + node.numTriangles; j < jEnd; j++)
+		{
+			m_partOffsets[j] = static_cast<uint32>(m_partVertices.size());
+			ClipTriangle(m_partVertices, pTriangles[m_triangleIndices[j]], bbox);
+		}
+
+		for (; j % LEAF_TRIANGLES_ALIGNMENT; j++)
+			m_partOffsets[j] = static_cast<uint32>(m_partVertices.size()); // padding has no parts
+	}
+
+	m_partOffsets.back() = static_cast<uint32>(m_partVertices.size());
+}
+
+void CollisionTree::Refit(const CollisionTriangle * pTriangles)
+{
+	if (!m_numNodes)
+		return;
+
+	assert(IsRefitPrepared());
+
+	// children follow their parents, so walking backwards sees every node after its subtree
+	for (uint32 i = m_numNodes; i-- > 0; )
+	{
+		Node & node = m_pNodes[i];
+		BBox bbox;
+		bbox.ClearBounds();
+		if (node.IsLeaf())
+		{
+			for (uint32 j = node.FirstTriangle(), jEnd = j + node.numTriangles; j < jEnd; j++)
+			{// the part keeps its parametric coordinates when the triangle moves
+				const CollisionTriangle & t = pTriangles[m_triangleIndices[j]];
+				const Vec3 & p0 = t.Vertex(0).pos;
+				const Vec3 edgeU = t.Vertex(1).pos - p0;
+				const Vec3 edgeV = t.Vertex(2).pos - p0;
+				for (const Vec2 * pVertex = m_partVertices.data() + m_partOffsets[j], * pVertexEnd = m_partVertices.data() + m_partOffsets[j + 1]; pVertex < pVertexEnd; pVertex++)
+					bbox.AddToBounds(p0 + edgeU * pVertex->x + edgeV * pVertex->y);
+			}
+		}
+		else
+		{
+			bbox = m_pNodes[i + 1].BoundingBox();
+			bbox.AddToBounds(m_pNodes[node.SecondChild()].BoundingBox());
+		}
+
+		node.center = bbox.Center();
+		node.extents = node.center - bbox.vMins;
+	}
+
+	m_bbox = m_pNodes[0].BoundingBox();
+	m_bDisjoint = false;
+
+	if (m_nodeWidth > 2)
+		CreateWideNodes(m_nodeWidth, m_bQuantized); // wide nodes are cheap to collapse again
+}
+
+// ------------------------------------------------------------------------ //
+
+int CollisionTree::MaxNodeWidth()
+{
+#ifdef USE_SSE
+	static const int width = CPUSupportsAVX() ? 8 : 4;
+	return width;
+#else
+	return 2;
+#endif
+}
+
+void CollisionTree::ClearWideNodes()
+{
+	if (m_pWideNodes && !m_bMappedWideNodes)
+		AlignedFree(m_pWideNodes);
+	m_pWideNodes = NULL;
+	m_bMappedWideNodes = false;
+
+	m_numWideNodes = 0;
+	m_nodeWidth = 2;
+	m_bQuantized = false;
+}
+
+size_t CollisionTree::WideNodeSize() const
+{
+	if (m_bQuantized)
+		return sizeof(QuantizedNode);
+	if (m_nodeWidth == 4)
+		return sizeof(WideNode<4>);
+	if (m_nodeWidth == 8)
+		return sizeof(WideNode<8>);
+	return 0;
+}
+
+void CollisionTree::CreateWideNodes(int width, bool bQuantized)
+{
+	ClearWideNodes();
+
+	if (width <= 0)
+		width = DEFAULT_NODE_WIDTH;
+	width = std::min(width, MaxNodeWidth());
+
+	if (m_numNodes < 2) // a single leaf
+		return;
+
+	if (width >= 8 && !bQuantized)
+		CreateWideNodes<8>();
+	else if (width >= 4 && bQuantized)
+	{
+		std::vector<WideNode<4> > nodes;
+		nodes.reserve(m_numNodes / 3 + 1);
+		AddWideNode<4>(nodes, 0);
+		CreateQuantizedNodes(nodes);
+	}
+	else if (width >= 4)
+		CreateWideNodes<4>();
+}
+
+template<int WIDTH>
+void CollisionTree::CreateWideNodes()
+{
+	std::vector<WideNode<WIDTH> > nodes;
+	nodes.reserve(m_numNodes / (WIDTH - 1) + 1);
+	AddWideNode<WIDTH>(nodes, 0);
+
+	m_pWideNodes = AlignedAlloc(nodes.size() * sizeof(WideNode<WIDTH>), WIDE_NODE_ALIGNMENT);
+	if (!m_pWideNodes)
+	{
+		printf("Failed to allocate %d wide collision tree nodes!\n", static_cast<int>(nodes.size()));
+		return;
+	}
+
+	memcpy(m_pWideNodes, nodes.data(), nodes.size() * sizeof(WideNode<WIDTH>));
+	m_numWideNodes = static_cast<uint32>(nodes.size());
+	m_nodeWidth = WIDTH;
+}
+
+template<int WIDTH>
+uint32 CollisionTree::AddWideNode(std::vector<WideNode<WIDTH> > & nodes, uint32 index) const
+{
+	const uint32 wideIndex = static_cast<uint32>(nodes.size());
+	nodes.push_back(WideNode<WIDTH>());
+
+	WideNode<WIDTH> & node = nodes.back();
+	for (int i = 0; i < WIDTH; i++)
+	{// empty boxes never intersect a ray
+		node.center[0][i] = node.center[1][i] = node.center[2][i] = 0.f;
+		node.extents[0][i] = node.extents[1][i] = node.extents[2][i] = -FLT_MAX;
+		node.childs[i] = EMPTY_CHILD;
+	}
+
+	for (int i = 0; i < WIDTH - 1; i++)
+		node.dist[i] = 0.f;
+	node.axes = 0xFFFFFFFF;
+
+	CollapseNode<WIDTH>(nodes, wideIndex, index, 1);
+	return wideIndex;
+}
+
+template<int WIDTH>
+void CollisionTree::CollapseNode(std::vector<WideNode<WIDTH> > & nodes, uint32 wideIndex, uint32 index, uint32 heapIndex) const
+{
+	const Node & node = m_pNodes[index];
+	if (heapIndex < WIDTH && !node.IsLeaf())
+	{
+		const uint32 shift = (heapIndex - 1) * 2;
+		nodes[wideIndex].axes = (nodes[wideIndex].axes & ~(3u << shift)) | (static_cast<uint32>(node.Axis()) << shift);
+		nodes[wideIndex].dist[heapIndex - 1] = node.dist;
+		CollapseNode<WIDTH>(nodes, wideIndex, index + 1, heapIndex * 2);
+		CollapseNode<WIDTH>(nodes, wideIndex, node.SecondChild(), heapIndex * 2 + 1);
+		return;
+	}
+
+	// leaves of the collapsed subtree take its leftmost slot
+	while (heapIndex < WIDTH)
+		heapIndex *= 2;
+	const uint32 slot = heapIndex - WIDTH;
+
+	const uint32 child = node.IsLeaf() ? (LEAF_CHILD | index) : AddWideNode<WIDTH>(nodes, index);
+
+	WideNode<WIDTH> & wideNode = nodes[wideIndex]; // AddWideNode might reallocate the array
+	for (int i = 0; i < 3; i++)
+	{
+		wideNode.center[i][slot] = node.center[i];
+		wideNode.extents[i][slot] = node.extents[i];
+	}
+	wideNode.childs[slot] = child;
+}
+
+// Quantizes [vMin, vMax] of one axis; the step is a power of two, the origin is its multiple and both are chosen
+// so that origin * 2 + (min + max) * step stays below 2^24 steps - all decoded bounds are exact floats.
+static void QuantizeAxis(double vMin, double vMax, float & origin, byte & stepExponent)
+{
+	const double fMaxAbs = std::max(fabs(vMin), fabs(vMax));
+	int exponent = -126;
+	if (vMax > vMin)
+		exponent = std::max(exponent, static_cast<int>(ceil(log2((vMax - vMin) / 255.0))));
+	if (fMaxAbs > 0.0)
+		exponent = std::max(exponent, static_cast<int>(floor(log2(fMaxAbs))) - 21);
+
+	for (;; exponent++)
+	{
+		const double fStep = ldexp(1.0, exponent);
+		const double fOrigin = floor(vMin / fStep) * fStep;
+		if (ceil((vMax - fOrigin) / fStep) <= 255.0 || exponent >= 127)
+		{
+			origin = static_cast<float>(fOrigin);
+			stepExponent = static_cast<byte>(exponent + 127);
+			return;
+		}
+	}
+}
+
+void CollisionTree::CreateQuantizedNodes(const std::vector<WideNode<4> > & nodes)
+{
+	QuantizedNode * pNodes = reinterpret_cast<QuantizedNode *>(AlignedAlloc(nodes.size() * sizeof(QuantizedNode), WIDE_NODE_ALIGNMENT));
+	if (!pNodes)
+	{
+		printf("Failed to allocate %d quantized collision tree nodes!\n", static_cast<int>(nodes.size()));
+		return;
+	}
+
+	for (size_t n = 0; n < nodes.size(); n++)
+	{
+		const WideNode<4> & node = nodes[n];
+		QuantizedNode & qnode = pNodes[n];
+		memset(&qnode, 0, sizeof(qnode));
+		qnode.axes = static_cast<byte>(node.axes);
+
+		for (int i = 0; i < 4; i++)
+			qnode.childs[i] = node.childs[i];
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double vMins[4], vMaxs[4];
+			double vMin = DBL_MAX, vMax = -DBL_MAX;
+			for (int i = 0; i < 4; i++)
+			{
+				if (node.childs[i] == EMPTY_CHILD)
+					continue;
+
+				vMins[i] = static_cast<double>(node.center[axis][i]) - node.extents[axis][i];
+				vMaxs[i] = static_cast<double>(node.center[axis][i]) + node.extents[axis][i];
+				vMin = std::min(vMin, vMins[i]);
+				vMax = std::max(vMax, vMaxs[i]);
+			}
+
+			QuantizeAxis(vMin, vMax, qnode.origin[axis], qnode.stepExponents[axis]);
+			const double fInvStep = ldexp(1.0, 127 - qnode.stepExponents[axis]);
+			for (int i = 0; i < 4; i++)
+			{
+				if (node.childs[i] == EMPTY_CHILD)
+					continue; // skipped by the traversal
+
+				qnode.bounds[axis][0][i] = static_cast<byte>(clamp(floor((vMins[i] - qnode.origin[axis]) * fInvStep), 0.0, 255.0));
+				qnode.bounds[axis][1][i] = static_cast<byte>(clamp(ceil((vMaxs[i] - qnode.origin[axis]) * fInvStep), 0.0, 255.0));
+			}
+		}
+	}
+
+	m_pWideNodes = pNodes;
+	m_numWideNodes = static_cast<uint32>(nodes.size());
+	m_nodeWidth = 4;
+	m_bQuantized = true;
+}
+
+// ------------------------------------------------------------------------ //
+
+namespace
+{
+	struct TreeCacheHeader
+	{
+		uint32	numNodes;
+		uint32	numTriangleIndices;
+		uint32	numWideNodes;
+		uint32	nodeWidth;
+		BBox	bbox;
+		uint32	disjoint;
+		uint32	quantized;
+	};
+
+	// A cache file is trusted only after these checks: the traversals don't test the ranges and their stacks are fixed.
+	// CreateParentLinks has checked already that the children follow their parents inside the array.
+	bool CheckNodes(const CollisionTree::Node * pNodes, uint32 numNodes, uint32 numTriangleIndices)
+	{
+		std::vector<byte> depths(numNodes, 0);
+		for (uint32 i = 0; i < numNodes; i++)
+		{
+			const CollisionTree::Node & node = pNodes[i];
+			if (node.IsLeaf())
+			{
+				// the SSE leaf tests take the triangle blocks from FirstTriangle() / LEAF_TRIANGLES_ALIGNMENT
+				if (node.FirstTriangle() % CollisionTree::LEAF_TRIANGLES_ALIGNMENT ||
+					static_cast<uint64>(node.FirstTriangle()) + node.numTriangles > numTriangleIndices)
+					return false;
+				continue;
+			}
+
+			const byte depth = depths[i] + 1;
+			if (depth > CollisionNode::MAX_NODES_LEVEL)
+				return false;
+			depths[i + 1] = depths[node.SecondChild()] = depth;
+		}
+		return true;
+	}
+
+	// wide children follow their parents too, every wide level collapses log2(WIDTH) binary ones
+	template<int WIDTH, class WideNodeType>
+	bool CheckWideNodes(const WideNodeType * pWideNodes, uint32 numWideNodes, const CollisionTree::Node * pNodes, uint32 numNodes)
+	{
+		const byte maxDepth = CollisionNode::MAX_NODES_LEVEL / (WIDTH == 8 ? 3 : 2);
+		std::vector<byte> depths(numWideNodes, 0);
+		for (uint32 i = 0; i < numWideNodes; i++)
+		{
+			for (int j = 0; j < WIDTH; j++)
+			{
+				const uint32 child = pWideNodes[i].childs[j];
+				if (child == CollisionTree::EMPTY_CHILD)
+					continue;
+
+				if (child & CollisionTree::LEAF_CHILD)
+				{
+					const uint32 leaf = child & ~CollisionTree::LEAF_CHILD;
+					if (leaf >= numNodes || !pNodes[leaf].IsLeaf())
+						return false;
+				}
+				else if (child <= i || child >= numWideNodes || (depths[child] = depths[i] + 1) > maxDepth)
+					return false;
+			}
+		}
+		return true;
+	}
+}
+
+bool CollisionTree::Write(FILE * f) const
+{
+	TreeCacheHeader header = TreeCacheHeader();
+	header.numNodes = m_numNodes;
+	header.numTriangleIndices = static_cast<uint32>(m_triangleIndices.size());
+	header.numWideNodes = m_numWideNodes;
+	header.nodeWidth = m_nodeWidth;
+	header.bbox = m_bbox;
+	header.disjoint = m_bDisjoint ? 1 : 0;
+	header.quantized = m_bQuantized ? 1 : 0;
+
+	const size_t wideNodeSize = WideNodeSize();
+	return MappedFile::WriteArray(f, &header, sizeof(header)) &&
+		MappedFile::WriteArray(f, m_pNodes, m_numNodes * sizeof(Node)) &&
+		MappedFile::WriteArray(f, m_triangleIndices.data(), m_triangleIndices.size() * sizeof(uint32)) &&
+		MappedFile::WriteArray(f, m_pWideNodes, m_numWideNodes * wideNodeSize);
+}
+
+bool CollisionTree::Read(const std::shared_ptr<MappedFile> & pFile, size_t & offset)
+{
+	Clear();
+
+	const TreeCacheHeader * pHeader = pFile->Array<TreeCacheHeader>(offset, 1);
+	if (!pHeader)
+		return false;
+
+	size_t wideNodeSize = 0;
+	if (pHeader->nodeWidth == 4)
+		wideNodeSize = pHeader->quantized ? sizeof(QuantizedNode) : sizeof(WideNode<4>);
+	else if (pHeader->nodeWidth == 8 && !pHeader->quantized)
+		wideNodeSize = sizeof(WideNode<8>);
+	else if (pHeader->nodeWidth != 2 || pHeader->numWideNodes)
+		return false;
+
+	if (pHeader->numTriangleIndices % LEAF_TRIANGLES_ALIGNMENT)
+		return false;
+
+	// the traversals start at the first wide node
+	if (wideNodeSize && (pHeader->numWideNodes == 0) != (pHeader->numNodes == 0))
+		return false;
+	if (wideNodeSize && pHeader->numWideNodes > ~static_cast<size_t>(0) / wideNodeSize)
+		return false;
+
+	Node * pNodes = pFile->Array<Node>(offset, pHeader->numNodes);
+	const uint32 * pIndices = pFile->Array<uint32>(offset, pHeader->numTriangleIndices);
+	byte * pWideNodes = pFile->Array<byte>(offset, pHeader->numWideNodes * wideNodeSize);
+	if (!pNodes || !pIndices || !pWideNodes)
+		return false;
+
+	bool bValid = true;
+	if (pHeader->nodeWidth == 4 && pHeader->quantized)
+		bValid = CheckWideNodes<4>(reinterpret_cast<const QuantizedNode *>(pWideNodes), pHeader->numWideNodes, pNodes, pHeader->numNodes);
+	else if (pHeader->nodeWidth == 4)
+		bValid = CheckWideNodes<4>(reinterpret_cast<const WideNode<4> *>(pWideNodes), pHeader->numWideNodes, pNodes, pHeader->numNodes);
+	else if (pHeader->nodeWidth == 8)
+		bValid = CheckWideNodes<8>(reinterpret_cast<const WideNode<8> *>(pWideNodes), pHeader->numWideNodes, pNodes, pHeader->numNodes);
+	if (!bValid)
+		return false;
+
+	m_pMappedFile = pFile;
+	m_pNodes = pNodes;
+	m_numNodes = pHeader->numNodes;
+	m_triangleIndices.assign(pIndices, pIndices + pHeader->numTriangleIndices);
+	m_bbox = pHeader->bbox;
+	m_bDisjoint = pHeader->disjoint != 0;
+
+	if (!CreateParentLinks() || !CheckNodes(m_pNodes, m_numNodes, pHeader->numTriangleIndices))
+	{
+		Clear();
+		return false;
+	}
+
+	if (static_cast<int>(pHeader->nodeWidth) <= MaxNodeWidth())
+	{
+		m_pWideNodes = pHeader->numWideNodes ? pWideNodes : NULL;
+		m_numWideNodes = pHeader->numWideNodes;
+		m_nodeWidth = pHeader->nodeWidth;
+		m_bQuantized = pHeader->quantized != 0;
+		m_bMappedWideNodes = true;
+	}
+	else // written on a CPU with wider vector units
+		CreateWideNodes(MaxNodeWidth());
+
+	return true;
+}
+
+// ------------------------------------------------------------------------ //
+
+size_t CollisionTree::GetDepth() const
+{
+	if (!m_numNodes)
+		return 0;
+
+	std::pair<uint32, size_t> stack[64]; // node index and its depth
+	size_t nStack = 0, depth = 0;
+	stack[nStack++] = std::make_pair(0u, size_t(0));
+
+	while (nStack)
+	{
+		std::pair<uint32, size_t> item = stack[--nStack];
+		const Node & node = m_pNodes[item.first];
+		if (node.IsLeaf())
+		{
+			depth = std::max(depth, item.second);
+			continue;
+		}
+
+		stack[nStack++] = std::make_pair(node.SecondChild(), item.second + 1);
+		stack[nStack++] = std::make_pair(item.first + 1, item.second + 1);
+	}
+
+	return depth;
+}
+
+float CollisionTree::GetSAHCost() const
+{
+	if (!m_numNodes)
+		return 0.f;
+
+	// children follow their parents, so walking backwards sees every node after its subtree
+	std::vector<float> costs(m_numNodes);
+	for (uint32 i = m_numNodes; i-- > 0; )
+	{
+		const Node & node = m_pNodes[i];
+		if (node.IsLeaf())
+		{
+			costs[i] = CollisionNode::INTERSECTION_COST * node.numTriangles;
+			continue;
+		}
+
+		float fArea = node.BoundingBox().Area();
+		if (fArea <= 0.f)
+		{
+			costs[i] = CollisionNode::TRAVERSAL_COST;
+			continue;
+		}
+
+		const uint32 child0 = i + 1, child1 = node.SecondChild();
+		costs[i] = CollisionNode::TRAVERSAL_COST +
+			(m_pNodes[child0].BoundingBox().Area() * costs[child0] +
+			 m_pNodes[child1].BoundingBox().Area() * costs[child1]) / fArea;
+	}
+
+	return costs[0];
+}
@@ -0,0 +1,198 @@
+//
+//  CollisionTree.h
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+#include "CollisionTriangle.h"
+#include "../common/mappedfile.h"
+#include <memory>
+
+namespace mr
+{
+
+class CollisionNode;
+class ThreadPool;
+
+// Finished collision tree stored as one array of nodes in depth-first order:
+// the first child of an inner node is the next node, leaves refer to ranges of one triangle index buffer.
+class CollisionTree
+{
+public:
+	struct Node
+	{
+		enum { LEAF = 3 };
+
+		Vec3	center;
+		union
+		{
+			float	dist; // split plane of an inner node
+			uint32	numTriangles; // number of triangles in a leaf
+		};
+		Vec3	extents;
+		uint32	data; // bits 0..1 - split axis or LEAF, bits 2..31 - index of the second child or of the first leaf triangle
+
+		bool IsLeaf() const { return (data & 3) == LEAF; }
+		byte Axis() const { return static_cast<byte>(data & 3); }
+		uint32 SecondChild() const { return data >> 2; }
+		uint32 FirstTriangle() const { return data >> 2; }
+
+#ifdef USE_SSE
+		__m128 Center() const { return _mm_load_ps(&center.x); }
+		__m128 Extents() const { return _mm_load_ps(&extents.x); }
+#else
+		const Vec3 & Center() const { return center; }
+		const Vec3 & Extents() const { return extents; }
+#endif
+
+		BBox BoundingBox() const { return BBox(center - extents, center + extents); }
+		bool Contains(const Vec3 & p) const
+		{
+			return fabsf(p.x - center.x) <= extents.x && fabsf(p.y - center.y) <= extents.y && fabsf(p.z - center.z) <= extents.z;
+		}
+	};
+
+	// Several levels of the binary tree collapsed into one node, child boxes are stored as SoA to test them at once.
+	// The collapsed split planes are kept in heap order (root is 1, children of k are 2k and 2k+1),
+	// so children can be visited in the same front to back order as the binary tree does.
+	template<int WIDTH>
+	struct WideNode
+	{
+		enum { NONE = 3 }; // no split, the subtree below is a single child
+
+		float	center[3][WIDTH];
+		float	extents[3][WIDTH];
+		uint32	childs[WIDTH]; // wide node index, LEAF_CHILD | leaf node index or EMPTY_CHILD
+		float	dist[WIDTH - 1];
+		uint32	axes; // 2 bits per split plane
+
+		byte Axis(uint32 heapIndex) const { return static_cast<byte>((axes >> ((heapIndex - 1) * 2)) & 3); }
+	};
+
+	// 4 wide node compressed to one cache line: child boxes are stored as 8 bit steps from the min corner of the node.
+	// The steps are powers of two big enough to keep every decoded bound exact in floats, so the boxes are never smaller
+	// than the binary tree ones. Split planes are dropped, children are ordered by the ray direction along the split axes.
+	struct QuantizedNode
+	{
+		float	origin[3]; // multiple of the step
+		byte	stepExponents[3]; // biased float exponents of the steps
+		byte	axes; // 2 bits per split plane in heap order
+		byte	bounds[3][2][4]; // axis, min / max, child
+		uint32	childs[4];
+		uint32	reserved[2];
+
+		byte Axis(uint32 heapIndex) const { return static_cast<byte>((axes >> ((heapIndex - 1) * 2)) & 3); }
+	};
+
+	enum
+	{
+		DEFAULT_NODE_WIDTH = 4, // 8 wide nodes of our deep clipped trees are mostly half empty and were measured slower
+		NODE_ALIGNMENT = 32,
+		WIDE_NODE_ALIGNMENT = 64,
+		LEAF_TRIANGLES_ALIGNMENT = 4, // leaf ranges of the triangle indices are padded with their last index to fill TriangleBlock
+		LINEAR_LEAF_TRIANGLES = 4, // leaves of CreateLinear, one TriangleBlock each
+		PARALLEL_LINEAR_BUILD_TRIANGLES = 65536, // fewer triangles are sorted by the calling thread
+		LEAF_CHILD = 0x80000000,
+		EMPTY_CHILD = 0xFFFFFFFF,
+	};
+
+private:
+	Node *		m_pNodes;
+	uint32		m_numNodes;
+	std::vector<uint32>	m_triangleIndices;
+	// parts of the triangles clipped by their leaves as polygons in parametric coordinates, refitted leaves bound only these parts
+	std::vector<uint32>	m_partOffsets; // first vertex of the part of every triangle index and the end of the last one
+	std::vector<Vec2>	m_partVertices;
+	std::vector<uint32>	m_parentLinks; // parent of every node for the stackless traversal, the root refers to itself
+	BBox		m_bbox;
+	bool		m_bDisjoint;
+
+	void *		m_pWideNodes;
+	uint32		m_numWideNodes;
+	int			m_nodeWidth;
+	bool		m_bQuantized;
+
+	// nodes read from a cache file point into its mapping instead of own memory
+	std::shared_ptr<MappedFile>	m_pMappedFile;
+	bool		m_bMappedWideNodes;
+
+	CollisionTree(const CollisionTree &);
+	CollisionTree & operator = (const CollisionTree &);
+
+	uint32 AddNode(const CollisionNode * pNode, const CollisionTriangle * pTriangles, uint32 index);
+
+	struct MortonTriangle
+	{
+		uint32	code;
+		uint32	index;
+	};
+
+	static void SortMortonTriangles(std::vector<MortonTriangle> & triangles, int firstBit, ThreadPool * pThreadPool);
+	BBox AddLinearNode(std::vector<Node> & nodes, const MortonTriangle * pBegin, const MortonTriangle * pEnd, byte level,
+					   const CollisionTriangle * pTriangles, const BBox & centerBBox);
+	bool CreateParentLinks(); // false if the children of the nodes are out of the array
+	void ClearWideNodes();
+	template<int WIDTH> void CreateWideNodes();
+	template<int WIDTH> uint32 AddWideNode(std::vector<WideNode<WIDTH> > & nodes, uint32 index) const;
+	template<int WIDTH> void CollapseNode(std::vector<WideNode<WIDTH> > & nodes, uint32 wideIndex, uint32 index, uint32 heapIndex) const;
+	void CreateQuantizedNodes(const std::vector<WideNode<4> > & nodes);
+	size_t WideNodeSize() const;
+
+public:
+	CollisionTree();
+	~CollisionTree();
+
+	void Clear();
+	void Swap(CollisionTree & tree);
+	void Create(const CollisionNode & root, const CollisionTriangle * pTriangles); // pTriangles is the array the tree triangles point into
+	// Linear tree over the triangles sorted by the Morton codes of their centers, the fast build preset. Ranges are split where
+	// the highest differing bit of the codes changes and the triangles are not clipped, so it builds many times faster than
+	// CollisionNode::Create, but the children overlap and tracing is slower.
+	void CreateLinear(const CollisionTriangle * pTriangles, uint32 numTriangles, byte nMaxNodesLevel, ThreadPool * pThreadPool = NULL);
+	// Updates the node bounds bottom-up after the triangles have moved, the topology must be the same as at Create.
+	// PrepareRefit has to be called once before the triangles first move, with the triangles the tree was created for.
+	void PrepareRefit(const CollisionTriangle * pTriangles);
+	bool IsRefitPrepared() const { return !m_partOffsets.empty() || m_triangleIndices.empty(); }
+	void Refit(const CollisionTriangle * pTriangles);
+
+	// cache file block; Read takes the nodes in place from the mapping and moves the offset past the block
+	bool Write(FILE * f) const;
+	bool Read(const std::shared_ptr<MappedFile> & pFile, size_t & offset);
+
+	bool Empty() const { return m_numNodes == 0; }
+	const Node * Nodes() const { return m_pNodes; }
+	uint32 NumNodes() const { return m_numNodes; }
+	const std::vector<uint32> & TriangleIndices() const { return m_triangleIndices; }
+	const uint32 * ParentLinks() const { return m_parentLinks.data(); }
+	const BBox & BoundingBox() const { return m_bbox; }
+	// true for built trees: children are clipped by the split planes, so a hit inside a leaf is the closest one;
+	// refitted children can overlap
+	bool Disjoint() const { return m_bDisjoint; }
+
+	// collapses the binary tree into 4 or 8 wide nodes (limited by MaxNodeWidth), 0 - DEFAULT_NODE_WIDTH, 2 - binary tree only;
+	// bQuantized stores 4 wide nodes as QuantizedNode, wider ones are not quantized
+	void CreateWideNodes(int width, bool bQuantized = false);
+	int NodeWidth() const { return m_nodeWidth; }
+	bool Quantized() const { return m_bQuantized; }
+	uint32 NumWideNodes() const { return m_numWideNodes; }
+	template<int WIDTH> const WideNode<WIDTH> * WideNodes() const
+	{
+		assert(m_nodeWidth == WIDTH && !m_bQuantized);
+		return reinterpret_cast<const WideNode<WIDTH> *>(m_pWideNodes);
+	}
+	const QuantizedNode * QuantizedNodes() const
+	{
+		assert(m_nodeWidth == 4 && m_bQuantized);
+		return reinterpret_cast<const QuantizedNode *>(m_pWideNodes);
+	}
+
+	static int MaxNodeWidth(); // the widest nodes the CPU can test at once
+
+	size_t GetDepth() const;
+	float GetSAHCost() const; // expected traversal cost of a random ray hitting the tree
+};
+
+}
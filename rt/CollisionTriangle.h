@@ -38,18 +38,182 @@ struct TraceResult
 	TraceResult() : pTriangle(NULL), pVolume(NULL), fraction(1.f), pTC(NULL) {}
 };
 
+// Data of the ray intersection test only. Collision meshes keep a copy of it for every triangle in a separate array,
+// so leaf tests read these 44 bytes instead of the whole triangle with its vertices and material.
+struct TriangleIntersection
+{
+	Vec3		normal;
+	Vec3		origin; // the first vertex
+	float		e1u, e1v;
+	float		e2u, e2v;
+	uint16		axis_u, axis_v;
+
+	// t, u and v are not divided by det yet
+	inline bool Intersect(const CollisionRay & ray, float & det, float & t, float & u, float & v) const
+	{
+		det = Vec3::Dot(normal, ray.Direction());
+		if (det == 0.f)
+			return false;
+
+		const bool backface = (det > 0.f);
+		Vec3 delta = origin - ray.Origin();
+		t = Vec3::Dot(normal, delta);
+
+		if (!backface)
+		{// front face
+			if (t > 0.f || t <= det)
+				return false;
+
+			float du = ray.Direction()[axis_u] * t - delta[axis_u] * det;
+			float dv = ray.Direction()[axis_v] * t - delta[axis_v] * det;
+
+			u = e2u * dv - e2v * du;
+			if (u > 0.f || u < det)
+				return false;
+
+			v = e1v * du - e1u * dv;
+			if (v > 0.f || u + v < det)
+				return false;
+
+		}
+		else
+		{// back face
+			if (t < 0.f || t >= det)
+				return false;
+
+			float du = ray.Direction()[axis_u] * t - delta[axis_u] * det;
+			float dv = ray.Direction()[axis_v] * t - delta[axis_v] * det;
+
+			u = e2u * dv - e2v * du;
+			if (u < 0.f || u > det)
+				return false;
+
+			v = e1v * du - e1u * dv;
+			if (v < 0.f || u + v > det)
+				return false;
+		}
+
+		return true;
+	}
+
+	// clips the ray by the hit and fills tr with it, pTriangle is the triangle these data belong to
+	bool TraceRay(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pTriangle) const
+	{
+		float det, t, u, v;
+		if (!Intersect(ray, det, t, u, v))
+			return false;
+
+		bool backface = (det > 0.f);
+//		if (tr.pTC && !tr.pTC->CheckTriangle(pTriangle, backface))
+//			return false;
+
+		float invDet = 1.f / det;
+		t *= invDet;
+		u *= invDet;
+		v *= invDet;
+		t += backface ? 1e-6f : -1e-6f;
+
+		ray.Clip(t);
+
+		tr.pTriangle = pTriangle;
+		tr.fraction *= t;
+		tr.backface = backface;
+		tr.pc = Vec2(u, v);
+
+		return true;
+	}
+
+	// any hit test for occlusion queries, nothing is computed beyond the answer
+	bool TestIntersection(const CollisionRay & ray) const
+	{
+		float det, t, u, v;
+		return Intersect(ray, det, t, u, v);
+	}
+};
+
+#ifdef USE_SSE
+// Intersection data of 4 triangles of one leaf as structure of arrays, tested at once with the same arithmetic
+// as TriangleIntersection::Intersect does, so every lane gets exactly the scalar answer.
+struct TriangleBlock
+{
+	float		normal[3][4];
+	float		origin[3][4];
+	float		e1u[4], e1v[4];
+	float		e2u[4], e2v[4];
+	uint32		axis_u[4]; // axis_v is the next one
+
+	void Set(int lane, const TriangleIntersection & ti)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			normal[i][lane] = ti.normal[i];
+			origin[i][lane] = ti.origin[i];
+		}
+		e1u[lane] = ti.e1u;
+		e1v[lane] = ti.e1v;
+		e2u[lane] = ti.e2u;
+		e2v[lane] = ti.e2v;
+		axis_u[lane] = ti.axis_u;
+		assert(ti.axis_v == (ti.axis_u < 2 ? ti.axis_u + 1 : 0));
+	}
+
+	// returns the mask of lanes intersected by the ray
+	int Intersect(const CollisionRay & ray) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 dir[3] = { _mm_set1_ps(ray.Direction().x), _mm_set1_ps(ray.Direction().y), _mm_set1_ps(ray.Direction().z) };
+		const __m128 rayOrigin[3] = { _mm_set1_ps(ray.Origin().x), _mm_set1_ps(ray.Origin().y), _mm_set1_ps(ray.Origin().z) };
+
+		const __m128 n[3] = { _mm_loadu_ps(normal[0]), _mm_loadu_ps(normal[1]), _mm_loadu_ps(normal[2]) };
+		const __m128 delta[3] = { _mm_sub_ps(_mm_loadu_ps(origin[0]), rayOrigin[0]),
+								  _mm_sub_ps(_mm_loadu_ps(origin[1]), rayOrigin[1]),
+								  _mm_sub_ps(_mm_loadu_ps(origin[2]), rayOrigin[2]) };
+
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], dir[0]), _mm_mul_ps(n[1], dir[1])), _mm_mul_ps(n[2], dir[2]));
+		const __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], delta[0]), _mm_mul_ps(n[1], delta[1])), _mm_mul_ps(n[2], delta[2]));
+
+		// picks the u and v components by the lane axes
+		const __m128i axes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(axis_u));
+		const __m128 u0 = _mm_castsi128_ps(_mm_cmpeq_epi32(axes, _mm_set1_epi32(0)));
+		const __m128 u1 = _mm_castsi128_ps(_mm_cmpeq_epi32(axes, _mm_set1_epi32(1)));
+		const __m128 u2 = _mm_castsi128_ps(_mm_cmpeq_epi32(axes, _mm_set1_epi32(2)));
+		const __m128 dirU = _mm_or_ps(_mm_or_ps(_mm_and_ps(u0, dir[0]), _mm_and_ps(u1, dir[1])), _mm_and_ps(u2, dir[2]));
+		const __m128 dirV = _mm_or_ps(_mm_or_ps(_mm_and_ps(u2, dir[0]), _mm_and_ps(u0, dir[1])), _mm_and_ps(u1, dir[2]));
+		const __m128 deltaU = _mm_or_ps(_mm_or_ps(_mm_and_ps(u0, delta[0]), _mm_and_ps(u1, delta[1])), _mm_and_ps(u2, delta[2]));
+		const __m128 deltaV = _mm_or_ps(_mm_or_ps(_mm_and_ps(u2, delta[0]), _mm_and_ps(u0, delta[1])), _mm_and_ps(u1, delta[2]));
+
+		const __m128 du = _mm_sub_ps(_mm_mul_ps(dirU, t), _mm_mul_ps(deltaU, det));
+		const __m128 dv = _mm_sub_ps(_mm_mul_ps(dirV, t), _mm_mul_ps(deltaV, det));
+		const __m128 u = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(e2u), dv), _mm_mul_ps(_mm_loadu_ps(e2v), du));
+		const __m128 v = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(e1v), du), _mm_mul_ps(_mm_loadu_ps(e1u), dv));
+		const __m128 uv = _mm_add_ps(u, v);
+
+		// the rejection conditions of the scalar test as they are, so NaNs pass or fail the same way
+		const __m128 rejectFront = _mm_or_ps(_mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(t, zero), _mm_cmple_ps(t, det)),
+													   _mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, det))),
+											 _mm_or_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(uv, det)));
+		const __m128 rejectBack = _mm_or_ps(_mm_or_ps(_mm_or_ps(_mm_cmplt_ps(t, zero), _mm_cmpge_ps(t, det)),
+													  _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, det))),
+											_mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(uv, det)));
+		const __m128 backface = _mm_cmpgt_ps(det, zero);
+		const __m128 reject = _mm_or_ps(_mm_cmpeq_ps(det, zero),
+										_mm_or_ps(_mm_and_ps(backface, rejectBack), _mm_andnot_ps(backface, rejectFront)));
+		return _mm_movemask_ps(reject) ^ 0xF;
+	}
+};
+#endif
+
 class CollisionTriangle
 {
-	Vec3		m_normal;
-	int			m_axis_u, m_axis_v;
-	float		m_e1u, m_e1v;
-	float		m_e2u, m_e2v;
+	TriangleIntersection m_intersection;
 	const IMaterial * m_pMaterial;
 
 	Vertex		m_vertices[3];
 	BBox		m_bbox;
 	Vec3		m_edgeU;
 	Vec3		m_edgeV;
+	Vec3		m_tangent; // tangent frame of the texture coordinates without the bump depth, see GetTangents
+	Vec3		m_binormal;
 
 //#ifdef USE_SSE
 //	__m128		m_center;
@@ -63,7 +227,6 @@ class CollisionTriangle
 //	float		m_uu;
 //	float		m_uv;
 //	float		m_vv;
-//	uint32		m_nLastTraceCount;
 
 public:
 	CollisionTriangle(const Vertex & v0, const Vertex & v1, const Vertex & v2, const IMaterial * pMaterial)
@@ -86,34 +249,48 @@ public:
 
 		//////////////////////////////////////////////////////////////////////////
 
-		m_normal = Vec3::Cross(m_edgeV, m_edgeU);
-		m_normal.Normalize();
+		TriangleIntersection & ti = m_intersection;
+		ti.origin = v0.pos;
+		ti.normal = Vec3::Cross(m_edgeV, m_edgeU);
+		ti.normal.Normalize();
 
 		int normAxis;
-		if (fabs(m_normal.x) > fabs(m_normal.y))
-			normAxis = fabs(m_normal.x) > fabs(m_normal.z) ? 0 : 2;
+		if (fabs(ti.normal.x) > fabs(ti.normal.y))
+			normAxis = fabs(ti.normal.x) > fabs(ti.normal.z) ? 0 : 2;
 		else
-			normAxis = fabs(m_normal.y) > fabs(m_normal.z) ? 1 : 2;
-		m_axis_u = normAxis < 2 ? normAxis + 1 : 0;
-		m_axis_v = m_axis_u < 2 ? m_axis_u + 1 : 0;
+			normAxis = fabs(ti.normal.y) > fabs(ti.normal.z) ? 1 : 2;
+		ti.axis_u = static_cast<uint16>(normAxis < 2 ? normAxis + 1 : 0);
+		ti.axis_v = static_cast<uint16>(ti.axis_u < 2 ? ti.axis_u + 1 : 0);
 
-		m_e1u = m_edgeU[m_axis_u];
-		m_e1v = m_edgeU[m_axis_v];
-		m_e2u = m_edgeV[m_axis_u];
-		m_e2v = m_edgeV[m_axis_v];
+		ti.e1u = m_edgeU[ti.axis_u];
+		ti.e1v = m_edgeU[ti.axis_v];
+		ti.e2u = m_edgeV[ti.axis_u];
+		ti.e2v = m_edgeV[ti.axis_v];
 
-		float f = (m_e2u * m_e1v - m_e2v * m_e1u);
+		float f = (ti.e2u * ti.e1v - ti.e2v * ti.e1u);
 		if (f != 0.f)
 		{
 			f = 1.f / f;
-			m_e1u *= f;
-			m_e1v *= f;
-			m_e2u *= f;
-			m_e2v *= f;
+			ti.e1u *= f;
+			ti.e1v *= f;
+			ti.e2u *= f;
+			ti.e2v *= f;
 		}
 
 		//////////////////////////////////////////////////////////////////////////
 
+		const Vec2 dUV1 = v1.tc - v0.tc;
+		const Vec2 dUV2 = v2.tc - v0.tc;
+		const float fUVArea = dUV1.x * dUV2.y - dUV1.y * dUV2.x;
+
+		m_tangent = (m_edgeU * dUV2.y - m_edgeV * dUV1.y);
+		m_tangent *= fUVArea / m_tangent.LengthSquared();
+
+		m_binormal = (m_edgeV * dUV1.x - m_edgeU * dUV2.x);
+		m_binormal *= fUVArea / m_binormal.LengthSquared();
+
+		//////////////////////////////////////////////////////////////////////////
+
 //		m_normal = Vec3::Cross(m_edgeU, m_edgeV);
 //		m_normal.Normalize();
 //		m_dist = Vec3::Dot(m_normal, v0.pos);
@@ -135,8 +312,10 @@ public:
 
 	const Vertex & Vertex(int i) const { return m_vertices[i]; }
 	const IMaterial * Material() const { return m_pMaterial; }
+	void SetMaterial(const IMaterial * pMaterial) { m_pMaterial = pMaterial; } // for triangles read from cache files
 	const BBox & BoundingBox() const { return m_bbox; }
-	const Vec3 & Normal() const { return m_normal; }
+	const Vec3 & Normal() const { return m_intersection.normal; }
+	const TriangleIntersection & Intersection() const { return m_intersection; }
 
 //	bool IsDegenerate() const { return (m_normal.Length2() == 0.f) || ((m_uv * m_uv - m_uu * m_vv) == 0.f); }
 	bool IsDegenerate() const { return Vec3::Cross(m_edgeU, m_edgeV).LengthSquared() == 0.f; }
@@ -184,28 +363,13 @@ public:
 
 	void GetTangents(Vec3 & tangent, Vec3 & binormal, const Vec3 & normal, float bumpDepth) const
 	{
-		Vec2 dUV1 = m_vertices[1].tc - m_vertices[0].tc;
-		Vec2 dUV2 = m_vertices[2].tc - m_vertices[0].tc;
-		bumpDepth *= dUV1.x * dUV2.y - dUV1.y * dUV2.x;
-
-		tangent = (m_edgeU * dUV2.y - m_edgeV * dUV1.y);
-		tangent *= bumpDepth / tangent.LengthSquared();
+		tangent = m_tangent * bumpDepth;
 		tangent -= normal * Vec3::Dot(tangent, normal);
 
-		binormal = (m_edgeV * dUV1.x - m_edgeU * dUV2.x);
-		binormal *= bumpDepth / binormal.LengthSquared();
+		binormal = m_binormal * bumpDepth;
 		binormal -= normal * Vec3::Dot(binormal, normal);
 	}
 
-//	bool CheckTraceCount(uint32 nTraceCount)
-//	{
-//		if (m_nLastTraceCount == nTraceCount)
-//			return false;
-//	
-//		m_nLastTraceCount = nTraceCount;
-//		return true;
-//	}
-
 //	inline static __m128 cross(const __m128 &a, const __m128 &b)
 //	{
 //		__m128 result = _mm_sub_ps(_mm_mul_ps(b, _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1))),
@@ -347,80 +511,26 @@ public:
 //			}
 //		}
 
-		float det = Vec3::Dot(m_normal, ray.Direction());
-		if (det == 0.f)
-			return false;
-
-		bool backface = (det > 0.f);
-//		if (tr.pTC && !tr.pTC->CheckTriangle(this, backface))
-//			return false;
-
-		Vec3 delta = m_vertices[0].pos - ray.Origin();
-		float t = Vec3::Dot(m_normal, delta);
-		float u, v;
-
-		if (!backface)
-		{// front face
-			if (t > 0.f || t <= det)
-				return false;
-
-			float du = ray.Direction()[m_axis_u] * t - delta[m_axis_u] * det;
-			float dv = ray.Direction()[m_axis_v] * t - delta[m_axis_v] * det;
-
-			u = m_e2u * dv - m_e2v * du;
-			if (u > 0.f || u < det)
-				return false;
-
-			v = m_e1v * du - m_e1u * dv;
-			if (v > 0.f || u + v < det)
-				return false;
-
-		}
-		else
-		{// back face
-			if (t < 0.f || t >= det)
-				return false;
-
-			float du = ray.Direction()[m_axis_u] * t - delta[m_axis_u] * det;
-			float dv = ray.Direction()[m_axis_v] * t - delta[m_axis_v] * det;
-
-			u = m_e2u * dv - m_e2v * du;
-			if (u < 0.f || u > det)
-				return false;
-
-			v = m_e1v * du - m_e1u * dv;
-			if (v < 0.f || u + v > det)
-				return false;
-		}
-
-		float invDet = 1.f / det;
-		t *= invDet;
-		u *= invDet;
-		v *= invDet;
-		t += backface ? 1e-6f : -1e-6f;
-
-		//////////////////////////////////////////////////////////////////////////
-
-		ray.Clip(t);
-
-		tr.pTriangle = this;
-		tr.fraction *= t;
-		tr.backface = backface;
-		tr.pc = Vec2(u, v);
+		return m_intersection.TraceRay(ray, tr, this);
+	}
 
-		return true;
+	// any hit test for occlusion queries, nothing is computed beyond the answer
+	bool TestIntersection(const CollisionRay & ray) const
+	{
+		return m_intersection.TestIntersection(ray);
 	}
 
 	Vec2 GetTexCoord(const Vec3 & origin, const Vec3 & direction) const
 	{
+		const TriangleIntersection & ti = m_intersection;
 		Vec3 delta = m_vertices[0].pos - origin;
-		float t = Vec3::Dot(m_normal, delta);
-		float det = Vec3::Dot(m_normal, direction);
+		float t = Vec3::Dot(ti.normal, delta);
+		float det = Vec3::Dot(ti.normal, direction);
 
-		float du = direction[m_axis_u] * t - delta[m_axis_u] * det;
-		float dv = direction[m_axis_v] * t - delta[m_axis_v] * det;
+		float du = direction[ti.axis_u] * t - delta[ti.axis_u] * det;
+		float dv = direction[ti.axis_v] * t - delta[ti.axis_v] * det;
 
-		Vec2 pc(m_e2u * dv - m_e2v * du, m_e1v * du - m_e1u * dv);
+		Vec2 pc(ti.e2u * dv - ti.e2v * du, ti.e1v * du - ti.e1u * dv);
 
 		return GetTexCoord(pc / det);
 	}
@@ -7,19 +7,24 @@
 //
 
 #include "CollisionVolume.h"
+#include "BVH.h"
+#ifdef USE_SSE
+#include <emmintrin.h>
+#endif
 
 using namespace mr;
 
 // ------------------------------------------------------------------------ //
 
-CollisionVolume::CollisionVolume(size_t nReserveTrangles)
-	: m_root(NULL)
+CollisionVolume::CollisionVolume(BVH * pBVH, const CollisionMeshPtr & pMesh)
+	: m_pBVH(pBVH)
+	, m_pMesh(pMesh)
 	, m_nTraceCount(0)
 	, m_matTransformation(Matrix::Identity)
 	, m_matInvTransformation(Matrix::Identity)
+	, m_transformType(TRANSFORM_IDENTITY)
 {
-	m_triangles.reserve(nReserveTrangles);
-	m_aabb.ClearBounds();
+	UpdateAABB();
 }
 
 // ------------------------------------------------------------------------ //
@@ -29,104 +34,1100 @@ void CollisionVolume::SetTransformation(const Matrix & m)
 	m_matTransformation = m;
 	m_matInvTransformation.Inverse(m);
 
-	m_aabb = m_root.BoundingBox();
-	m_aabb.Transform(m);
+	if (m.m11 == 1.f && m.m12 == 0.f && m.m13 == 0.f && m.m14 == 0.f &&
+		m.m21 == 0.f && m.m22 == 1.f && m.m23 == 0.f && m.m24 == 0.f &&
+		m.m31 == 0.f && m.m32 == 0.f && m.m33 == 1.f && m.m34 == 0.f && m.m44 == 1.f)
+	{
+		m_transformType = (m.m41 == 0.f && m.m42 == 0.f && m.m43 == 0.f) ? TRANSFORM_IDENTITY : TRANSFORM_TRANSLATION;
+	}
+	else
+		m_transformType = TRANSFORM_GENERAL;
+
+	UpdateAABB();
+	if (m_pBVH)
+		m_pBVH->UpdateVolumesTree();
+}
+
+inline Vec3 CollisionVolume::ToLocal(const Vec3 & v) const
+{
+	switch (m_transformType)
+	{
+	case TRANSFORM_IDENTITY: return v;
+	case TRANSFORM_TRANSLATION: return v - m_matTransformation.Pos();
+	default: return v.GetTransformedCoord(m_matInvTransformation);
+	}
+}
+
+inline Vec3 CollisionVolume::ToWorld(const Vec3 & v) const
+{
+	switch (m_transformType)
+	{
+	case TRANSFORM_IDENTITY: return v;
+	case TRANSFORM_TRANSLATION: return v + m_matTransformation.Pos();
+	default: return v.GetTransformedCoord(m_matTransformation);
+	}
+}
+
+void CollisionVolume::UpdateAABB()
+{
+	m_aabb = m_pMesh->BoundingBox();
+	if (!m_aabb.IsNull())
+		m_aabb.Transform(m_matTransformation);
 }
 
 // ------------------------------------------------------------------------ //
 
-void CollisionVolume::AddTriangle(const CollisionTriangle & t)
+void CollisionVolume::Build(byte nMaxNodesLevel, int numThreads, int nodeWidth, bool bQuantizedNodes, CollisionMesh::eBuildPreset preset)
+{
+	m_pMesh->Build(nMaxNodesLevel, numThreads, nodeWidth, bQuantizedNodes, preset);
+
+	if (m_pBVH)
+		m_pBVH->UpdateMeshVolumes(m_pMesh.get());
+	else
+		UpdateAABB();
+}
+
+void CollisionVolume::BuildAsync()
+{
+	m_pMesh->BuildAsync();
+
+	if (m_pBVH)
+		m_pBVH->UpdateMeshVolumes(m_pMesh.get());
+	else
+		UpdateAABB();
+}
+
+bool CollisionVolume::Refit(const CollisionTriangleArray & triangles)
 {
-	if (!t.IsDegenerate())
-		m_triangles.push_back(t);
+	if (!m_pMesh->Refit(triangles))
+		return false;
+
+	if (m_pBVH)
+		m_pBVH->UpdateMeshVolumes(m_pMesh.get());
+	else
+		UpdateAABB();
+
+	return true;
 }
 
-void CollisionVolume::Build(byte nMaxNodesLevel)
+// ------------------------------------------------------------------------ //
+
+#ifdef USE_SSE
+struct WideRay4
 {
-	if (nMaxNodesLevel == 0)
+	__m128 center[3];
+	__m128 halfDir[3];
+	__m128 halfSize[3];
+
+	void Set(const CollisionRay & ray)
 	{
-		while ((nMaxNodesLevel < 32) && ((size_t)(1 << nMaxNodesLevel) < m_triangles.size()))
-			nMaxNodesLevel++;
+		for (int i = 0; i < 3; i++)
+		{
+			const float fHalfDir = ray.Direction()[i] * 0.5f;
+			center[i] = _mm_set1_ps(ray.Origin()[i] + fHalfDir);
+			halfDir[i] = _mm_set1_ps(fHalfDir);
+			halfSize[i] = _mm_set1_ps(fabsf(fHalfDir));
+		}
 	}
-	
-	if (nMaxNodesLevel > 0)
+
+	// segment vs 4 boxes separating axis test, returns the mask of intersected boxes
+	int Test(const CollisionTree::WideNode<4> & node) const
 	{
-		CollisionNode::PolygonArray polygons;
-		polygons.reserve(m_triangles.size());
-		for (CollisionTriangleArray::iterator it = m_triangles.begin(), itEnd = m_triangles.end(); it != itEnd; ++it)
+		const __m128 dx = _mm_sub_ps(center[0], _mm_load_ps(node.center[0]));
+		const __m128 dy = _mm_sub_ps(center[1], _mm_load_ps(node.center[1]));
+		const __m128 dz = _mm_sub_ps(center[2], _mm_load_ps(node.center[2]));
+		const __m128 ex = _mm_load_ps(node.extents[0]);
+		const __m128 ey = _mm_load_ps(node.extents[1]);
+		const __m128 ez = _mm_load_ps(node.extents[2]);
+
+		__m128 m = _mm_cmple_ps(_mm_abs_ps(dx), _mm_add_ps(ex, halfSize[0]));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(dy), _mm_add_ps(ey, halfSize[1])));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(dz), _mm_add_ps(ez, halfSize[2])));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(halfDir[1], dz), _mm_mul_ps(halfDir[2], dy))),
+									   _mm_add_ps(_mm_mul_ps(ey, halfSize[2]), _mm_mul_ps(ez, halfSize[1]))));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(halfDir[2], dx), _mm_mul_ps(halfDir[0], dz))),
+									   _mm_add_ps(_mm_mul_ps(ez, halfSize[0]), _mm_mul_ps(ex, halfSize[2]))));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(halfDir[0], dy), _mm_mul_ps(halfDir[1], dx))),
+									   _mm_add_ps(_mm_mul_ps(ex, halfSize[1]), _mm_mul_ps(ey, halfSize[0]))));
+		return _mm_movemask_ps(m);
+	}
+};
+#endif
+
+#ifdef USE_SSE
+struct QuantizedRay4
+{
+	__m128 center2[3]; // doubled, so the doubled box centers and extents are exact
+	__m128 dir[3];
+	__m128 absDir[3];
+
+	void Set(const CollisionRay & ray)
+	{
+		for (int i = 0; i < 3; i++)
 		{
-			polygons.push_back(CollisionNode::Polygon(&(*it)));
-			polygons.back().AddVertex(it->Vertex(0).pos);
-			polygons.back().AddVertex(it->Vertex(1).pos);
-			polygons.back().AddVertex(it->Vertex(2).pos);
+			center2[i] = _mm_set1_ps(ray.Origin()[i] * 2.f + ray.Direction()[i]);
+			dir[i] = _mm_set1_ps(ray.Direction()[i]);
+			absDir[i] = _mm_set1_ps(fabsf(ray.Direction()[i]));
 		}
-		
-		m_root.Create(nMaxNodesLevel - 1, polygons);
-		m_aabb = m_root.BoundingBox();
-		m_aabb.Transform(m_matTransformation);
+	}
+
+	// the same separating axis test as WideRay4 does, all terms are doubled
+	int Test(const CollisionTree::QuantizedNode & node) const
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128 d[3], e[3];
+		for (int i = 0; i < 3; i++)
+		{
+			const __m128i q = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.bounds[i])), zero);
+			const __m128i qmin = _mm_unpacklo_epi16(q, zero);
+			const __m128i qmax = _mm_unpackhi_epi16(q, zero);
+			const __m128 step = _mm_castsi128_ps(_mm_set1_epi32(static_cast<int>(node.stepExponents[i]) << 23));
+			const __m128 center2 = _mm_add_ps(_mm_set1_ps(node.origin[i] * 2.f), _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(qmin, qmax)), step));
+			d[i] = _mm_sub_ps(this->center2[i], center2);
+			e[i] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(qmax, qmin)), step);
+		}
+
+		__m128 m = _mm_cmple_ps(_mm_abs_ps(d[0]), _mm_add_ps(e[0], absDir[0]));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(d[1]), _mm_add_ps(e[1], absDir[1])));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(d[2]), _mm_add_ps(e[2], absDir[2])));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(dir[1], d[2]), _mm_mul_ps(dir[2], d[1]))),
+									   _mm_add_ps(_mm_mul_ps(e[1], absDir[2]), _mm_mul_ps(e[2], absDir[1]))));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(dir[2], d[0]), _mm_mul_ps(dir[0], d[2]))),
+									   _mm_add_ps(_mm_mul_ps(e[2], absDir[0]), _mm_mul_ps(e[0], absDir[2]))));
+		m = _mm_and_ps(m, _mm_cmple_ps(_mm_abs_ps(_mm_sub_ps(_mm_mul_ps(dir[0], d[1]), _mm_mul_ps(dir[1], d[0]))),
+									   _mm_add_ps(_mm_mul_ps(e[0], absDir[1]), _mm_mul_ps(e[1], absDir[0]))));
+		return _mm_movemask_ps(m);
+	}
+};
+#endif
+
+#ifdef USE_AVX
+struct WideRay8
+{
+	__m256 center[3];
+	__m256 halfDir[3];
+	__m256 halfSize[3];
+
+	TARGET_AVX void Set(const CollisionRay & ray)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			const float fHalfDir = ray.Direction()[i] * 0.5f;
+			center[i] = _mm256_set1_ps(ray.Origin()[i] + fHalfDir);
+			halfDir[i] = _mm256_set1_ps(fHalfDir);
+			halfSize[i] = _mm256_set1_ps(fabsf(fHalfDir));
+		}
+	}
+
+	static TARGET_AVX __m256 Abs(const __m256 & v) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), v); }
+	static TARGET_AVX __m256 LessEqual(const __m256 & a, const __m256 & b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+
+	// segment vs 8 boxes separating axis test, returns the mask of intersected boxes
+	TARGET_AVX int Test(const CollisionTree::WideNode<8> & node) const
+	{
+		const __m256 dx = _mm256_sub_ps(center[0], _mm256_load_ps(node.center[0]));
+		const __m256 dy = _mm256_sub_ps(center[1], _mm256_load_ps(node.center[1]));
+		const __m256 dz = _mm256_sub_ps(center[2], _mm256_load_ps(node.center[2]));
+		const __m256 ex = _mm256_load_ps(node.extents[0]);
+		const __m256 ey = _mm256_load_ps(node.extents[1]);
+		const __m256 ez = _mm256_load_ps(node.extents[2]);
+
+		__m256 m = LessEqual(Abs(dx), _mm256_add_ps(ex, halfSize[0]));
+		m = _mm256_and_ps(m, LessEqual(Abs(dy), _mm256_add_ps(ey, halfSize[1])));
+		m = _mm256_and_ps(m, LessEqual(Abs(dz), _mm256_add_ps(ez, halfSize[2])));
+		m = _mm256_and_ps(m, LessEqual(Abs(_mm256_sub_ps(_mm256_mul_ps(halfDir[1], dz), _mm256_mul_ps(halfDir[2], dy))),
+									   _mm256_add_ps(_mm256_mul_ps(ey, halfSize[2]), _mm256_mul_ps(ez, halfSize[1]))));
+		m = _mm256_and_ps(m, LessEqual(Abs(_mm256_sub_ps(_mm256_mul_ps(halfDir[2], dx), _mm256_mul_ps(halfDir[0], dz))),
+									   _mm256_add_ps(_mm256_mul_ps(ez, halfSize[0]), _mm256_mul_ps(ex, halfSize[2]))));
+		m = _mm256_and_ps(m, LessEqual(Abs(_mm256_sub_ps(_mm256_mul_ps(halfDir[0], dy), _mm256_mul_ps(halfDir[1], dx))),
+									   _mm256_add_ps(_mm256_mul_ps(ex, halfSize[1]), _mm256_mul_ps(ey, halfSize[0]))));
+		return _mm256_movemask_ps(m);
+	}
+};
+#endif
+
+// Pushes intersected children of the collapsed subtree in the binary tree order: the far side first, so the near one is popped first.
+// Not recursive to be inlined into the AVX traversal, calls with dirty upper halves of YMM registers are expensive.
+template<int WIDTH>
+static inline void PushWideChilds(const CollisionTree::WideNode<WIDTH> & node, const Vec3 & origin, int mask, uint32 *& pTopNode)
+{
+	uint32 heapStack[4];
+	uint32 * pTopHeap = heapStack;
+	*pTopHeap++ = 1;
+
+	while (pTopHeap > heapStack)
+	{
+		uint32 heapIndex = *(--pTopHeap);
+		if (heapIndex < WIDTH)
+		{
+			const byte axis = node.Axis(heapIndex);
+			if (axis != CollisionTree::WideNode<WIDTH>::NONE)
+			{
+				if (origin[axis] > node.dist[heapIndex - 1])
+				{
+					*pTopHeap++ = heapIndex * 2 + 1;
+					*pTopHeap++ = heapIndex * 2;
+				}
+				else
+				{
+					*pTopHeap++ = heapIndex * 2;
+					*pTopHeap++ = heapIndex * 2 + 1;
+				}
+				continue;
+			}
+
+			while (heapIndex < WIDTH)
+				heapIndex *= 2;
+		}
+
+		const uint32 slot = heapIndex - WIDTH;
+		if (mask & (1 << slot))
+			*pTopNode++ = node.childs[slot];
 	}
 }
 
+#ifdef USE_SSE
+// Quantized nodes have no split planes: the ray crosses a plane towards its direction, so that side is the far one.
+static inline void PushQuantizedChilds(const CollisionTree::QuantizedNode & node, const Vec3 & dir, int mask, uint32 *& pTopNode)
+{
+	uint32 heapStack[4];
+	uint32 * pTopHeap = heapStack;
+	*pTopHeap++ = 1;
+
+	while (pTopHeap > heapStack)
+	{
+		uint32 heapIndex = *(--pTopHeap);
+		if (heapIndex < 4)
+		{
+			const byte axis = node.Axis(heapIndex);
+			if (axis != CollisionTree::WideNode<4>::NONE)
+			{
+				if (dir[axis] < 0.f)
+				{
+					*pTopHeap++ = heapIndex * 2 + 1;
+					*pTopHeap++ = heapIndex * 2;
+				}
+				else
+				{
+					*pTopHeap++ = heapIndex * 2;
+					*pTopHeap++ = heapIndex * 2 + 1;
+				}
+				continue;
+			}
+
+			while (heapIndex < 4)
+				heapIndex *= 2;
+		}
+
+		const uint32 slot = heapIndex - 4;
+		if ((mask & (1 << slot)) && node.childs[slot] != CollisionTree::EMPTY_CHILD)
+			*pTopNode++ = node.childs[slot];
+	}
+}
+#endif
+
 // ------------------------------------------------------------------------ //
 
 bool CollisionVolume::TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr)
 {
 	m_nTraceCount++;
+
+	// all volumes of a shared mesh have the same triangles, a triangle hit in another volume must not be skipped here
+	const CollisionTriangle * pPrevTriangle = tr.pTriangle;
+	if (tr.pVolume && tr.pVolume != this)
+		tr.pTriangle = NULL;
+
 	const CollisionTriangle * pSkipTriangle = tr.pTriangle;
 
-	CollisionRay ray(vFrom.GetTransformedCoord(m_matInvTransformation), vTo.GetTransformedCoord(m_matInvTransformation), tr);
+	CollisionRay ray(ToLocal(vFrom), ToLocal(vTo), tr);
 
-	const CollisionNode * pStackNodes[64]; // nMaxNodesLevel must be less than 64
-	const CollisionNode ** ppTopNode = pStackNodes;
-	*ppTopNode++ = &m_root;
+	const CollisionTree & tree = m_pMesh->Tree();
+	if (!tree.Empty())
+	{
+		switch (tree.NodeWidth())
+		{
+#ifdef USE_AVX
+		case 8:
+			TraceWideNodes8(ray, tr, pSkipTriangle);
+			break;
+#endif
+#ifdef USE_SSE
+		case 4:
+			if (tree.Quantized())
+				TraceQuantizedNodes(ray, tr, pSkipTriangle);
+			else
+				TraceWideNodes4(ray, tr, pSkipTriangle);
+			break;
+#endif
+		default:
+			if (m_pBVH->StacklessTraversal())
+				TraceNodesStackless(ray, tr, pSkipTriangle);
+			else
+				TraceNodes(ray, tr, pSkipTriangle);
+			break;
+		}
+	}
+
+	if (tr.pTriangle == pSkipTriangle)
+	{
+		tr.pTriangle = pPrevTriangle;
+		return false;
+	}
+
+	tr.pVolume = this;
+	tr.pos = ToWorld(ray.End());
+	tr.localPos = ray.End();
+	tr.localDir = ray.Direction();
+
+	return true;
+}
+
+#ifdef USE_SSE
+// lanes of a leaf block with triangles the ray hasn't tested in other leaves yet, they are put to its mailbox
+static inline int NewBlockLanes(CollisionRay & ray, const uint32 * pIndices, int numLanes)
+{
+	int lanes = 0;
+	for (int lane = 0; lane < numLanes; lane++)
+	{
+		if (!ray.Mailbox().Contains(pIndices[lane]))
+		{
+			ray.Mailbox().Add(pIndices[lane]);
+			lanes |= 1 << lane;
+		}
+	}
+	return lanes;
+}
+#endif
+
+inline bool CollisionVolume::TraceLeaf(const CollisionTree::Node & leaf, CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const
+{
+	const CollisionTriangle * pTriangles = m_pMesh->Triangles().data();
+	const TriangleIntersection * pIntersections = m_pMesh->Intersections().data();
+	const uint32 * pTriangleIndices = m_pMesh->Tree().TriangleIndices().data();
+#ifdef USE_SSE
+	// 4 triangles are tested at once, hits are replayed by the scalar test in the leaf order and the rest of the block
+	// is tested again with the clipped ray, so the result is exactly the one of the scalar loop
+	const TriangleBlock * pBlock = m_pMesh->TriangleBlocks().data() + leaf.FirstTriangle() / 4;
+	for (uint32 i = 0; i < leaf.numTriangles; i += 4, pBlock++)
+	{
+		const int lanes = NewBlockLanes(ray, pTriangleIndices + leaf.FirstTriangle() + i, std::min<int>(4, leaf.numTriangles - i));
+		if (!lanes)
+			continue;
+
+		int mask = pBlock->Intersect(ray) & lanes;
+		for (int lane = 0; mask; lane++)
+		{
+			if (!(mask & (1 << lane)))
+				continue;
+
+			mask &= ~(1 << lane);
+			const uint32 index = pTriangleIndices[leaf.FirstTriangle() + i + lane];
+			const CollisionTriangle * pTriangle = pTriangles + index;
+			if (tr.pTriangle != pTriangle && pIntersections[index].TraceRay(ray, tr, pTriangle))
+			{
+				assert(tr.pTriangle == pTriangle);
+				if (mask)
+					mask &= pBlock->Intersect(ray);
+			}
+		}
+	}
+#else
+	for (const uint32 * pIndex = pTriangleIndices + leaf.FirstTriangle(), * pIndexEnd = pIndex + leaf.numTriangles; pIndex < pIndexEnd; pIndex++)
+	{
+		const CollisionTriangle * pTriangle = pTriangles + *pIndex;
+		if (ray.Mailbox().Contains(*pIndex))
+			continue;
+
+		ray.Mailbox().Add(*pIndex);
+		if (tr.pTriangle != pTriangle && pIntersections[*pIndex].TraceRay(ray, tr, pTriangle))
+		{
+			assert(tr.pTriangle == pTriangle);
+		}
+	}
+#endif
+
+	// children of a built tree are disjoint, so nothing can be closer than a hit inside the leaf
+	return tr.pTriangle != pSkipTriangle && m_pMesh->Tree().Disjoint() && leaf.Contains(ray.End());
+}
+
+void CollisionVolume::TraceNodes(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle, uint32 root) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+
+	uint32 stackNodes[64]; // nMaxNodesLevel must be less than 64
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = root;
 	
-	while (ppTopNode > pStackNodes)
+	while (pTopNode > stackNodes)
 	{
-		const CollisionNode * pNode = *(--ppTopNode);
+		const uint32 index = *(--pTopNode);
+		const CollisionTree::Node * pNode = pNodes + index;
 		if (!ray.TestIntersection(pNode->Center(), pNode->Extents()))
 			continue;
 
-		if (pNode->Child(0))
+		if (!pNode->IsLeaf())
 		{
-			assert(pNode->Child(0) && pNode->Child(1));
-			if (ray.Origin()[pNode->Axis()] > pNode->Dist())
+			if (ray.Origin()[pNode->Axis()] > pNode->dist)
 			{
-				*ppTopNode++ = pNode->Child(0);
-				*ppTopNode++ = pNode->Child(1);
+				*pTopNode++ = index + 1;
+				*pTopNode++ = pNode->SecondChild();
 			}
 			else
 			{
-				*ppTopNode++ = pNode->Child(1);
-				*ppTopNode++ = pNode->Child(0);
+				*pTopNode++ = pNode->SecondChild();
+				*pTopNode++ = index + 1;
 			}
 		}
-		else
+		else if (TraceLeaf(*pNode, ray, tr, pSkipTriangle))
+			break;
+	}
+}
+
+// the child the ray origin is in front of, TraceNodes visits it first
+static inline uint32 NearChild(const CollisionTree::Node * pNodes, uint32 index, const Vec3 & origin)
+{
+	const CollisionTree::Node & node = pNodes[index];
+	return origin[node.Axis()] > node.dist ? node.SecondChild() : index + 1;
+}
+
+// TraceNodes without the stack: after the near child of a node the walk goes to its far sibling, after the far one
+// it goes up by the parent links until it comes out of a near child. The nodes are visited in the same order.
+void CollisionVolume::TraceNodesStackless(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const uint32 * pParents = m_pMesh->Tree().ParentLinks();
+
+	uint32 index = 0;
+	for (;;)
+	{
+		const CollisionTree::Node * pNode = pNodes + index;
+		if (ray.TestIntersection(pNode->Center(), pNode->Extents()))
 		{
-//			for (std::vector<CollisionTriangle *>::const_iterator it = pNode->Triangles().begin(), itEnd = pNode->Triangles().end(); it != itEnd; ++it)
-//			{
-//				CollisionTriangle * pTriangle = *it;
-			for (CollisionTriangle * pTriangle : pNode->Triangles())
+			if (!pNode->IsLeaf())
 			{
-//				if (pTriangle->CheckTraceCount(m_nTraceCount) && pTriangle->TraceRay(ray, tr))
-				if (tr.pTriangle != pTriangle && pTriangle->TraceRay(ray, tr))
-				{
-					assert(tr.pTriangle == pTriangle);
-				}
+				index = NearChild(pNodes, index, ray.Origin());
+				continue;
 			}
-			
-			if (tr.pTriangle != pSkipTriangle && pNode->BoundingBox().Test(ray.End()))
-//			if (tr.pTriangle != pSkipTriangle)
+
+			if (TraceLeaf(*pNode, ray, tr, pSkipTriangle))
+				return;
+		}
+
+		for (;;)
+		{
+			if (index == 0)
+				return;
+
+			const uint32 parent = pParents[index];
+			const uint32 nearChild = NearChild(pNodes, parent, ray.Origin());
+			if (index == nearChild)
+			{
+				index = nearChild == parent + 1 ? pNodes[parent].SecondChild() : parent + 1;
 				break;
+			}
+			index = parent;
 		}
 	}
+}
 
-	if (tr.pTriangle == pSkipTriangle)
+#ifdef USE_SSE
+void CollisionVolume::TraceWideNodes4(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::WideNode<4> * pWideNodes = m_pMesh->Tree().WideNodes<4>();
+	const CollisionTriangle * pLastTriangle = tr.pTriangle;
+
+	WideRay4 wideRay;
+	wideRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (TraceLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray, tr, pSkipTriangle))
+				break;
+
+			if (pLastTriangle != tr.pTriangle)
+			{// the ray was clipped by a hit
+				pLastTriangle = tr.pTriangle;
+				wideRay.Set(ray);
+			}
+			continue;
+		}
+
+		const CollisionTree::WideNode<4> & node = pWideNodes[child];
+		const int mask = wideRay.Test(node);
+		if (mask)
+			PushWideChilds<4>(node, ray.Origin(), mask, pTopNode);
+	}
+}
+#endif
+
+#ifdef USE_SSE
+void CollisionVolume::TraceQuantizedNodes(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::QuantizedNode * pQuantizedNodes = m_pMesh->Tree().QuantizedNodes();
+	const CollisionTriangle * pLastTriangle = tr.pTriangle;
+
+	QuantizedRay4 quantizedRay;
+	quantizedRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (TraceLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray, tr, pSkipTriangle))
+				break;
+
+			if (pLastTriangle != tr.pTriangle)
+			{// the ray was clipped by a hit
+				pLastTriangle = tr.pTriangle;
+				quantizedRay.Set(ray);
+			}
+			continue;
+		}
+
+		const CollisionTree::QuantizedNode & node = pQuantizedNodes[child];
+		const int mask = quantizedRay.Test(node);
+		if (mask)
+			PushQuantizedChilds(node, ray.Direction(), mask, pTopNode);
+	}
+}
+#endif
+
+#ifdef USE_AVX
+TARGET_AVX void CollisionVolume::TraceWideNodes8(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::WideNode<8> * pWideNodes = m_pMesh->Tree().WideNodes<8>();
+	const CollisionTriangle * pLastTriangle = tr.pTriangle;
+
+	WideRay8 wideRay;
+	wideRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (TraceLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray, tr, pSkipTriangle))
+				break;
+
+			if (pLastTriangle != tr.pTriangle)
+			{// the ray was clipped by a hit
+				pLastTriangle = tr.pTriangle;
+				wideRay.Set(ray);
+			}
+			continue;
+		}
+
+		const CollisionTree::WideNode<8> & node = pWideNodes[child];
+		const int mask = wideRay.Test(node);
+		if (mask)
+			PushWideChilds<8>(node, ray.Origin(), mask, pTopNode);
+	}
+}
+#endif
+
+// ------------------------------------------------------------------------ //
+
+uint32 CollisionVolume::TracePacket(const Vec3 * pFrom, const Vec3 * pTo, TraceResult * pResults, uint32 mask)
+{
+	m_nTraceCount++;
+
+	// the same per ray setup as TraceRay does
+	const CollisionTriangle * pPrevTriangles[CollisionPacket::MAX_RAYS];
+	const CollisionTriangle * pSkipTriangles[CollisionPacket::MAX_RAYS];
+	CollisionPacket packet;
+	for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+
+		TraceResult & tr = pResults[i];
+		pPrevTriangles[i] = tr.pTriangle;
+		if (tr.pVolume && tr.pVolume != this)
+			tr.pTriangle = NULL;
+
+		pSkipTriangles[i] = tr.pTriangle;
+		packet.SetRay(i, ToLocal(pFrom[i]), ToLocal(pTo[i]), tr);
+	}
+
+	if (!m_pMesh->Tree().Empty())
+		TracePacketNodes(packet, mask, pSkipTriangles);
+
+	uint32 res = 0;
+	for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+	{
+		if (!(mask & (1 << i)))
+			continue;
+
+		TraceResult & tr = pResults[i];
+		if (tr.pTriangle == pSkipTriangles[i])
+		{
+			tr.pTriangle = pPrevTriangles[i];
+			continue;
+		}
+
+		const CollisionRay & ray = packet.Ray(i);
+		tr.pVolume = this;
+		tr.pos = ToWorld(ray.End());
+		tr.localPos = ray.End();
+		tr.localDir = ray.Direction();
+		res |= 1 << i;
+	}
+
+	return res;
+}
+
+// Binary tree walked by the packet: every node is tested against all rays still in its mask, so rays leaving the packet
+// stop costing the others. Subtrees reached by one ray only are left to the single ray traversal.
+// Every ray visits the child on the side of its origin first, a ray finished in a disjoint leaf has no closer hit left.
+void CollisionVolume::TracePacketNodes(CollisionPacket & packet, uint32 mask, const CollisionTriangle * const * ppSkipTriangles) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+
+	struct StackEntry
+	{
+		uint32	index;
+		uint32	mask;
+	};
+	StackEntry stackNodes[64 * 3 + 1]; // nMaxNodesLevel must be less than 64, a node splitting the packet pushes 4 entries
+	StackEntry * pTopNode = stackNodes;
+	pTopNode->index = 0;
+	pTopNode->mask = mask;
+	pTopNode++;
+
+	uint32 activeMask = mask; // rays finished by a hit inside a disjoint leaf leave it
+	while (pTopNode > stackNodes)
+	{
+		--pTopNode;
+		const uint32 index = pTopNode->index;
+		const CollisionTree::Node * pNode = pNodes + index;
+		const uint32 nodeMask = packet.TestIntersection(pNode->center, pNode->extents, pTopNode->mask & activeMask);
+		if (!nodeMask)
+			continue;
+
+		if (!(nodeMask & (nodeMask - 1)))
+		{// the packet diverged to one ray, it's cheaper to trace the subtree by the single ray traversal
+			const int i = CollisionPacket::FirstRay(nodeMask);
+			CollisionRay & ray = packet.Ray(i);
+			TraceNodes(ray, ray.TraceResult(), ppSkipTriangles[i], index);
+			packet.UpdateRay(i);
+			continue;
+		}
+
+		if (!pNode->IsLeaf())
+		{
+			// the far children are pushed under the near ones, so both halves of the packet take their near child first
+			const uint32 aboveMask = packet.OriginsAbove(pNode->Axis(), pNode->dist, nodeMask);
+			const uint32 belowMask = nodeMask & ~aboveMask;
+			const StackEntry entries[4] =
+			{
+				{ index + 1, aboveMask },
+				{ pNode->SecondChild(), belowMask },
+				{ pNode->SecondChild(), aboveMask },
+				{ index + 1, belowMask },
+			};
+			for (int i = 0; i < 4; i++)
+			{
+				if (entries[i].mask)
+					*pTopNode++ = entries[i];
+			}
+			continue;
+		}
+
+		for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+		{
+			if (!(nodeMask & (1 << i)))
+				continue;
+
+			CollisionRay & ray = packet.Ray(i);
+			TraceResult & tr = ray.TraceResult();
+			const CollisionTriangle * pLastTriangle = tr.pTriangle;
+			if (TraceLeaf(*pNode, ray, tr, ppSkipTriangles[i]))
+				activeMask &= ~(1 << i);
+			else if (tr.pTriangle != pLastTriangle)
+				packet.UpdateRay(i);
+		}
+
+		if (!activeMask)
+			break;
+	}
+}
+
+// ------------------------------------------------------------------------ //
+
+bool CollisionVolume::Occluded(const Vec3 & vFrom, const Vec3 & vTo) const
+{
+	const CollisionTree & tree = m_pMesh->Tree();
+	if (tree.Empty())
 		return false;
 
-	tr.pVolume = this;
-	tr.pos = ray.End().GetTransformedCoord(m_matTransformation);
-	tr.localPos = ray.End();
-	tr.localDir = ray.Direction();
+	TraceResult tr; // the ray needs one, but it's never filled
+	const CollisionRay ray(ToLocal(vFrom), ToLocal(vTo), tr);
 
-	return true;
-}
\ No newline at end of file
+	switch (tree.NodeWidth())
+	{
+#ifdef USE_AVX
+	case 8:
+		return OccludedWideNodes8(ray);
+#endif
+#ifdef USE_SSE
+	case 4:
+		return tree.Quantized() ? OccludedQuantizedNodes(ray) : OccludedWideNodes4(ray);
+#endif
+	default:
+		return m_pBVH->StacklessTraversal() ? OccludedNodesStackless(ray) : OccludedNodes(ray);
+	}
+}
+
+uint32 CollisionVolume::OccludedPacket(const Vec3 * pFrom, const Vec3 * pTo, uint32 mask) const
+{
+	if (m_pMesh->Tree().Empty())
+		return 0;
+
+	TraceResult tr; // the rays need one, but it's never filled
+	CollisionPacket packet;
+	for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+	{
+		if (mask & (1 << i))
+			packet.SetRay(i, ToLocal(pFrom[i]), ToLocal(pTo[i]), tr);
+	}
+
+#ifdef USE_SSE
+	if (m_pMesh->Tree().NodeWidth() == 4 && !m_pMesh->Tree().Quantized())
+		return OccludedPacketWideNodes4(packet, mask);
+#endif
+	return OccludedPacketNodes(packet, mask);
+}
+
+// without the mailbox, any hit ends the traversal and the misses it would skip cost less than the lookups
+inline bool CollisionVolume::OccludedLeaf(const CollisionTree::Node & leaf, const CollisionRay & ray) const
+{
+#ifdef USE_SSE
+	const TriangleBlock * pBlock = m_pMesh->TriangleBlocks().data() + leaf.FirstTriangle() / 4;
+	for (uint32 i = 0; i < leaf.numTriangles; i += 4, pBlock++)
+	{
+		if (pBlock->Intersect(ray) & ((1 << std::min<int>(4, leaf.numTriangles - i)) - 1))
+			return true;
+	}
+#else
+	const TriangleIntersection * pIntersections = m_pMesh->Intersections().data();
+	const uint32 * pTriangleIndices = m_pMesh->Tree().TriangleIndices().data();
+	for (const uint32 * pIndex = pTriangleIndices + leaf.FirstTriangle(), * pIndexEnd = pIndex + leaf.numTriangles; pIndex < pIndexEnd; pIndex++)
+	{
+		if (pIntersections[*pIndex].TestIntersection(ray))
+			return true;
+	}
+#endif
+
+	return false;
+}
+
+// any hit ends the traversal, so children are visited in the tree order without sorting them along the ray
+bool CollisionVolume::OccludedNodes(const CollisionRay & ray, uint32 root) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+
+	uint32 stackNodes[64]; // nMaxNodesLevel must be less than 64
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = root;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 index = *(--pTopNode);
+		const CollisionTree::Node * pNode = pNodes + index;
+		if (!ray.TestIntersection(pNode->Center(), pNode->Extents()))
+			continue;
+
+		if (!pNode->IsLeaf())
+		{
+			*pTopNode++ = pNode->SecondChild();
+			*pTopNode++ = index + 1;
+		}
+		else if (OccludedLeaf(*pNode, ray))
+			return true;
+	}
+
+	return false;
+}
+
+// OccludedNodes without the stack, the tree order makes the parent links plain skip links:
+// the node after a subtree is the second child of the first ancestor entered by its first child
+bool CollisionVolume::OccludedNodesStackless(const CollisionRay & ray) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const uint32 * pParents = m_pMesh->Tree().ParentLinks();
+
+	uint32 index = 0;
+	for (;;)
+	{
+		const CollisionTree::Node * pNode = pNodes + index;
+		if (ray.TestIntersection(pNode->Center(), pNode->Extents()))
+		{
+			if (!pNode->IsLeaf())
+			{
+				index++;
+				continue;
+			}
+
+			if (OccludedLeaf(*pNode, ray))
+				return true;
+		}
+
+		while (index != 0 && index != pParents[index] + 1)
+			index = pParents[index];
+
+		if (index == 0)
+			return false;
+
+		index = pNodes[pParents[index]].SecondChild();
+	}
+}
+
+// the packet version of OccludedNodes, rays leave the packet at their first hit
+uint32 CollisionVolume::OccludedPacketNodes(const CollisionPacket & packet, uint32 mask) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+
+	struct StackEntry
+	{
+		uint32	index;
+		uint32	mask;
+	};
+	StackEntry stackNodes[64]; // nMaxNodesLevel must be less than 64
+	StackEntry * pTopNode = stackNodes;
+	pTopNode->index = 0;
+	pTopNode->mask = mask;
+	pTopNode++;
+
+	uint32 res = 0;
+	while (pTopNode > stackNodes)
+	{
+		--pTopNode;
+		const uint32 index = pTopNode->index;
+		const CollisionTree::Node * pNode = pNodes + index;
+		const uint32 nodeMask = packet.TestIntersection(pNode->center, pNode->extents, pTopNode->mask & ~res);
+		if (!nodeMask)
+			continue;
+
+		if (!(nodeMask & (nodeMask - 1)))
+		{// one ray left, see TracePacketNodes
+			const int i = CollisionPacket::FirstRay(nodeMask);
+			if (OccludedNodes(packet.Ray(i), index))
+				res |= nodeMask;
+			continue;
+		}
+
+		if (!pNode->IsLeaf())
+		{
+			pTopNode[0].index = pNode->SecondChild();
+			pTopNode[1].index = index + 1;
+			pTopNode[0].mask = pTopNode[1].mask = nodeMask;
+			pTopNode += 2;
+			continue;
+		}
+
+		for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+		{
+			if ((nodeMask & (1 << i)) && OccludedLeaf(*pNode, packet.Ray(i)))
+				res |= 1 << i;
+		}
+
+		if (res == mask)
+			break;
+	}
+
+	return res;
+}
+
+#ifdef USE_SSE
+bool CollisionVolume::OccludedWideNodes4(const CollisionRay & ray, uint32 root) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::WideNode<4> * pWideNodes = m_pMesh->Tree().WideNodes<4>();
+
+	WideRay4 wideRay;
+	wideRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = root;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (OccludedLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray))
+				return true;
+			continue;
+		}
+
+		const CollisionTree::WideNode<4> & node = pWideNodes[child];
+		const int mask = wideRay.Test(node);
+		for (int i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+				*pTopNode++ = node.childs[i];
+		}
+	}
+
+	return false;
+}
+#endif
+
+#ifdef USE_SSE
+// every child box is tested against 4 rays at once, children get the masks of the rays intersecting them
+uint32 CollisionVolume::OccludedPacketWideNodes4(const CollisionPacket & packet, uint32 mask) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::WideNode<4> * pWideNodes = m_pMesh->Tree().WideNodes<4>();
+
+	struct StackEntry
+	{
+		uint32	child;
+		uint32	mask;
+	};
+	StackEntry stackNodes[WIDE_STACK_SIZE];
+	StackEntry * pTopNode = stackNodes;
+	pTopNode->child = 0;
+	pTopNode->mask = mask;
+	pTopNode++;
+
+	uint32 res = 0;
+	while (pTopNode > stackNodes)
+	{
+		--pTopNode;
+		const uint32 child = pTopNode->child;
+		const uint32 childMask = pTopNode->mask & ~res;
+		if (!childMask)
+			continue;
+
+		if (!(childMask & (childMask - 1)))
+		{// one ray left, see TracePacketNodes
+			if (child & CollisionTree::LEAF_CHILD ? OccludedLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], packet.Ray(CollisionPacket::FirstRay(childMask))) :
+													OccludedWideNodes4(packet.Ray(CollisionPacket::FirstRay(childMask)), child))
+				res |= childMask;
+			continue;
+		}
+
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			const CollisionTree::Node & leaf = pNodes[child & ~CollisionTree::LEAF_CHILD];
+			for (int i = 0; i < CollisionPacket::MAX_RAYS; i++)
+			{
+				if ((childMask & (1 << i)) && OccludedLeaf(leaf, packet.Ray(i)))
+					res |= 1 << i;
+			}
+
+			if (res == mask)
+				break;
+			continue;
+		}
+
+		const CollisionTree::WideNode<4> & node = pWideNodes[child];
+		for (int i = 0; i < 4; i++)
+		{
+			const uint32 nodeMask = packet.TestIntersection(Vec3(node.center[0][i], node.center[1][i], node.center[2][i]),
+															Vec3(node.extents[0][i], node.extents[1][i], node.extents[2][i]), childMask);
+			if (nodeMask)
+			{
+				pTopNode->child = node.childs[i];
+				pTopNode->mask = nodeMask;
+				pTopNode++;
+			}
+		}
+	}
+
+	return res;
+}
+#endif
+
+#ifdef USE_SSE
+bool CollisionVolume::OccludedQuantizedNodes(const CollisionRay & ray) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::QuantizedNode * pQuantizedNodes = m_pMesh->Tree().QuantizedNodes();
+
+	QuantizedRay4 quantizedRay;
+	quantizedRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (OccludedLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray))
+				return true;
+			continue;
+		}
+
+		const CollisionTree::QuantizedNode & node = pQuantizedNodes[child];
+		const int mask = quantizedRay.Test(node);
+		for (int i = 0; i < 4; i++)
+		{
+			if ((mask & (1 << i)) && node.childs[i] != CollisionTree::EMPTY_CHILD)
+				*pTopNode++ = node.childs[i];
+		}
+	}
+
+	return false;
+}
+#endif
+
+#ifdef USE_AVX
+TARGET_AVX bool CollisionVolume::OccludedWideNodes8(const CollisionRay & ray) const
+{
+	const CollisionTree::Node * pNodes = m_pMesh->Tree().Nodes();
+	const CollisionTree::WideNode<8> * pWideNodes = m_pMesh->Tree().WideNodes<8>();
+
+	WideRay8 wideRay;
+	wideRay.Set(ray);
+
+	uint32 stackNodes[WIDE_STACK_SIZE];
+	uint32 * pTopNode = stackNodes;
+	*pTopNode++ = 0;
+
+	while (pTopNode > stackNodes)
+	{
+		const uint32 child = *(--pTopNode);
+		if (child & CollisionTree::LEAF_CHILD)
+		{
+			if (OccludedLeaf(pNodes[child & ~CollisionTree::LEAF_CHILD], ray))
+				return true;
+			continue;
+		}
+
+		const CollisionTree::WideNode<8> & node = pWideNodes[child];
+		const int mask = wideRay.Test(node);
+		for (int i = 0; i < 8; i++)
+		{
+			if (mask & (1 << i))
+				*pTopNode++ = node.childs[i];
+		}
+	}
+
+	return false;
+}
+#endif
@@ -7,38 +7,89 @@
 //
 #pragma once
 
-#include "CollisionTriangle.h"
-#include "CollisionNode.h"
+#include "CollisionMesh.h"
+#include "CollisionPacket.h"
 
 namespace mr
 {
 
+class BVH;
+
 class CollisionVolume
 {
-	CollisionNode m_root;
+	enum eTransformType
+	{
+		TRANSFORM_IDENTITY,
+		TRANSFORM_TRANSLATION,
+		TRANSFORM_GENERAL,
+	};
+
+	BVH *	m_pBVH;
+	CollisionMeshPtr m_pMesh;
 	uint32	m_nTraceCount;
 	Matrix	m_matTransformation;
 	Matrix	m_matInvTransformation;
+	eTransformType m_transformType;
 	BBox	m_aabb;
-	CollisionTriangleArray m_triangles;
+
+	Vec3 ToLocal(const Vec3 & v) const;
+	Vec3 ToWorld(const Vec3 & v) const;
+
+	enum { WIDE_STACK_SIZE = (CollisionNode::MAX_NODES_LEVEL / 3) * 7 + 1 }; // stack of 8 wide nodes, 4 wide nodes need less
+
+	bool TraceLeaf(const CollisionTree::Node & leaf, CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const;
+	void TraceNodes(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle, uint32 root = 0) const;
+	void TraceNodesStackless(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const;
+#ifdef USE_SSE
+	void TraceWideNodes4(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const;
+	void TraceQuantizedNodes(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const;
+#endif
+#ifdef USE_AVX
+	TARGET_AVX void TraceWideNodes8(CollisionRay & ray, TraceResult & tr, const CollisionTriangle * pSkipTriangle) const;
+#endif
+
+	void TracePacketNodes(CollisionPacket & packet, uint32 mask, const CollisionTriangle * const * ppSkipTriangles) const;
+
+	bool OccludedLeaf(const CollisionTree::Node & leaf, const CollisionRay & ray) const;
+	uint32 OccludedPacketNodes(const CollisionPacket & packet, uint32 mask) const;
+	bool OccludedNodes(const CollisionRay & ray, uint32 root = 0) const;
+	bool OccludedNodesStackless(const CollisionRay & ray) const;
+#ifdef USE_SSE
+	bool OccludedWideNodes4(const CollisionRay & ray, uint32 root = 0) const;
+	uint32 OccludedPacketWideNodes4(const CollisionPacket & packet, uint32 mask) const;
+	bool OccludedQuantizedNodes(const CollisionRay & ray) const;
+#endif
+#ifdef USE_AVX
+	TARGET_AVX bool OccludedWideNodes8(const CollisionRay & ray) const;
+#endif
 
 public:
-	CollisionVolume(size_t nReserveTrangles = 0);
+	CollisionVolume(BVH * pBVH, const CollisionMeshPtr & pMesh);
 
 	const Matrix & Transformation() const { return m_matTransformation; }
 	const Matrix & InverseTransformation() const { return m_matInvTransformation; }
 	void SetTransformation(const Matrix & m);
 
-	const CollisionNode * Root() const { return &m_root; }
-	const CollisionTriangleArray & Triangles() const { return m_triangles; }
+	const CollisionMeshPtr & Mesh() const { return m_pMesh; }
+	const CollisionTree & Tree() const { return m_pMesh->Tree(); }
+	const CollisionTriangleArray & Triangles() const { return m_pMesh->Triangles(); }
 
 	const BBox & AABB() const { return m_aabb; }
-	const BBox & OOBB() const { return m_root.BoundingBox(); }
+	const BBox & OOBB() const { return m_pMesh->BoundingBox(); }
+	void UpdateAABB(); // recalculates the world bounding box, the BVH has to update its tree after it
 
-	void AddTriangle(const CollisionTriangle & t);
-	void Build(byte nMaxNodesLevel = 0);
+	// the mesh may be shared, building it updates all volumes using it
+	void AddTriangle(const CollisionTriangle & t) { m_pMesh->AddTriangle(t); }
+	void Build(byte nMaxNodesLevel = 0, int numThreads = 0, int nodeWidth = 0, bool bQuantizedNodes = false,
+			   CollisionMesh::eBuildPreset preset = CollisionMesh::BUILD_HIGH_QUALITY);
+	void BuildAsync(); // see CollisionMesh::BuildAsync, the BVH is updated with the coarse tree
+	bool Refit(const CollisionTriangleArray & triangles); // see CollisionMesh::Refit, rendering must be stopped
 
 	bool TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr);
+	// TraceRay for the rays of the mask at once, ray i goes from pFrom[i] to pTo[i] into pResults[i]; returns the mask of hit rays
+	uint32 TracePacket(const Vec3 * pFrom, const Vec3 * pTo, TraceResult * pResults, uint32 mask);
+	bool Occluded(const Vec3 & vFrom, const Vec3 & vTo) const; // true if anything is hit, the closest hit is not searched
+	uint32 OccludedPacket(const Vec3 * pFrom, const Vec3 * pTo, uint32 mask) const; // Occluded for the rays of the mask, returns the occluded ones
 };
 
 }
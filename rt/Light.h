@@ -15,7 +15,8 @@ class ILight
 public:
 	virtual ~ILight() {}
 
-	virtual Vec3 Position(const Vec3 & p) const = 0;
+	// point of the light lit from p for the random unit vector sample, points seen with the same sample make a shared light sample
+	virtual Vec3 Position(const Vec3 & p, const Vec3 & sample) const = 0;
 	virtual Vec3 Intensity(float squared_distance) const = 0; // diffuse
 	virtual Vec3 Intensity(const Vec3 & rayPos, const Vec3 & rayDir) const = 0; // specular
 };
@@ -236,7 +236,8 @@ bool OpenCLRenderer::SetupComputeKernel(const char * pKernelFilename, const char
 	}
 
 	// Build the program executable
-	err = clBuildProgram(m_program, 0, NULL, NULL, NULL, NULL);
+	const char * pOptions = m_scene.StacklessTraversal() ? "-D STACKLESS_TRAVERSAL" : NULL;
+	err = clBuildProgram(m_program, 0, NULL, pOptions, NULL, NULL);
 	if (err != CL_SUCCESS)
 	{
 		size_t len;
@@ -303,7 +304,8 @@ struct KernelNode
 	cl_float3	center;
 	cl_float3	extents;
 	cl_float4	plane;
-	cl_uint		childs[2];
+	cl_uint		parent;
+	cl_uint		secondChild; // 0 for leaves, the first child is the next node
 	cl_uint		beginTriangle;
 	cl_uint		endTriangle;
 };
@@ -394,10 +396,11 @@ bool OpenCLRenderer::SetupSceneBuffers()
 		}
 	}
 
-	{// fill nodes buffer
+	{// fill nodes buffer, the collision tree is already flattened in the same depth-first order
 		enum { MAX_WRITE_NODES = 0x20000 };
 		const size_t sizeOfNode = sizeof(KernelNode);
-		const size_t numNodes = pVolume->Root()->GetNodeCount();
+		const CollisionTree & tree = pVolume->Tree();
+		const size_t numNodes = tree.NumNodes();
 
 		printf("Creating OpenCL %d nodes...\n", (int)numNodes);
 		m_nodes = clCreateBuffer(m_context, CL_MEM_READ_ONLY, numNodes * sizeOfNode, NULL, NULL);
@@ -407,44 +410,35 @@ bool OpenCLRenderer::SetupSceneBuffers()
 			return false;
 		}
 
-		std::vector<cl_uint>		nodeTriangles;
+		const std::vector<uint32> & nodeTriangles = tree.TriangleIndices();
 		std::vector<KernelNode>		nodes(std::min<size_t>(numNodes, MAX_WRITE_NODES));
 		size_t offset = 0, count = 0;
 
-		const CollisionNode * pStackNodes[64]; // BVH tree depth must be less than 64
-		const CollisionNode ** ppTopNode = pStackNodes;
-		*ppTopNode++ = pVolume->Root();
-
-		while (ppTopNode > pStackNodes)
+		for (size_t i = 0; i < numNodes; i++)
 		{
-			const CollisionNode * pNode = *(--ppTopNode);
+			const CollisionTree::Node & node = tree.Nodes()[i];
 			KernelNode & kernelNode = nodes[count++];
-			kernelNode.plane.s[0] = pNode->Axis() == 0 ? 1.f : 0.f;
-			kernelNode.plane.s[1] = pNode->Axis() == 1 ? 1.f : 0.f;
-			kernelNode.plane.s[2] = pNode->Axis() == 2 ? 1.f : 0.f;
-			kernelNode.plane.s[3] = pNode->Dist();
-			copy_float3(kernelNode.center, pNode->BoundingBox().Center());
-			copy_float3(kernelNode.extents, pNode->BoundingBox().Size() * 0.5f);
-
-			if (pNode->Triangles().empty())
+			copy_float3(kernelNode.center, node.center);
+			copy_float3(kernelNode.extents, node.extents);
+			kernelNode.parent = (cl_uint)tree.ParentLinks()[i];
+
+			if (!node.IsLeaf())
 			{
-				assert(pNode->Child(0) && pNode->Child(1));
-				*ppTopNode++ = pNode->Child(1);
-				*ppTopNode++ = pNode->Child(0);
-				kernelNode.childs[0] = (cl_uint)(offset + count);
-				kernelNode.childs[1] = (cl_uint)(offset + count + pNode->Child(0)->GetNodeCount());
+				kernelNode.plane.s[0] = node.Axis() == 0 ? 1.f : 0.f;
+				kernelNode.plane.s[1] = node.Axis() == 1 ? 1.f : 0.f;
+				kernelNode.plane.s[2] = node.Axis() == 2 ? 1.f : 0.f;
+				kernelNode.plane.s[3] = node.dist;
+				kernelNode.secondChild = (cl_uint)node.SecondChild();
 				kernelNode.beginTriangle = kernelNode.endTriangle = 0;
 			}
 			else
 			{
-				kernelNode.childs[0] = 0;
-				kernelNode.childs[1] = 0;
-
-				kernelNode.beginTriangle = (cl_uint)nodeTriangles.size();
-				for (std::vector<CollisionTriangle *>::const_iterator it = pNode->Triangles().begin(), itEnd = pNode->Triangles().end(); it != itEnd; ++it)
-					nodeTriangles.push_back(static_cast<cl_uint>((*it) - pVolume->Triangles().data()));
-
-				kernelNode.endTriangle = (cl_uint)nodeTriangles.size();
+				kernelNode.plane.s[0] = tree.Disjoint() ? 1.f : 0.f; // a hit inside the leaf ends the traversal
+				kernelNode.plane.s[1] = kernelNode.plane.s[2] = 0.f;
+				kernelNode.plane.s[3] = FLT_MAX;
+				kernelNode.secondChild = 0;
+				kernelNode.beginTriangle = (cl_uint)node.FirstTriangle();
+				kernelNode.endTriangle = (cl_uint)(node.FirstTriangle() + node.numTriangles);
 			}
 
 			if (count == MAX_WRITE_NODES || (offset + count) == numNodes)
@@ -536,7 +530,8 @@ void OpenCLRenderer::Render(IImage & image, const RectI * pViewportRect,
 	Vec3 vCamDeltaY = Vec3(p.x, p.y, p.z) / p.w - vCamDeltaZ;
 	vCamDeltaZ -= matCamera.Pos();
 
-	Vec2 vPixelOffset = nFrameNumber > 0 ? Vec2(frand(), frand()) : Vec2(0.5f, 0.5f);
+	Random rnd(0, nFrameNumber);
+	Vec2 vPixelOffset = nFrameNumber > 0 ? Vec2(rnd.Float(), rnd.Float()) : Vec2(0.5f, 0.5f);
 	vCamDeltaZ += vCamDeltaX * (vPixelOffset.y * m_dp.s[0]);
 	vCamDeltaZ += vCamDeltaY * -(vPixelOffset.y * m_dp.s[1]);
 
@@ -0,0 +1,147 @@
+//
+//  Sampler.cpp
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#include "Sampler.h"
+
+using namespace mr;
+
+// ------------------------------------------------------------------------ //
+
+static inline float ToFloat(uint32 value)
+{
+	return (value >> 8) * (1.f / 16777216.f);
+}
+
+static inline uint32 ReverseBits(uint32 x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Laine-Karras permutation of the reversed bits: a bit is flipped by the bits above it only, that is Owen scrambling
+static inline uint32 NestedUniformScramble(uint32 x, uint32 seed)
+{
+	x = ReverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47c;
+	x ^= x * 0xb82f1e52;
+	x ^= x * 0xc7afe638;
+	x ^= x * 0x8d22f6e6;
+	return ReverseBits(x);
+}
+
+// Kensler's permutation of the values 0..count-1 without a table
+static uint32 Permute(uint32 i, uint32 count, uint32 seed)
+{
+	uint32 mask = count - 1;
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+
+	do
+	{
+		i ^= seed; i *= 0xe170893d;
+		i ^= seed >> 16;
+		i ^= (i & mask) >> 4;
+		i ^= seed >> 8; i *= 0x0929eb3f;
+		i ^= seed >> 23;
+		i ^= (i & mask) >> 1; i *= 1 | seed >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & mask) >> 11; i *= 0x74dcb303;
+		i ^= (i & mask) >> 2; i *= 0x9e501cc3;
+		i ^= (i & mask) >> 2; i *= 0xc860a3df;
+		i &= mask;
+		i ^= i >> 5;
+	} while (i >= count);
+
+	return (i + seed) % count;
+}
+
+uint32 ISampler::Hash(uint32 a, uint32 b)
+{
+	uint32 h = a ^ (b + 0x9e3779b9 + (a << 6) + (a >> 2));
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= 0x846ca68b;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32 ISampler::PixelSeed(int x, int y)
+{
+	return Hash(static_cast<uint32>(x), static_cast<uint32>(y));
+}
+
+// ------------------------------------------------------------------------ //
+
+Vec2 RandomSampler::Sample2D(uint32 seed, uint32 dim, uint32 nSample) const
+{
+	Random rnd((static_cast<uint64>(seed) << 32) | dim, nSample);
+	const float x = rnd.Float();
+	return Vec2(x, rnd.Float());
+}
+
+// ------------------------------------------------------------------------ //
+
+StratifiedSampler::StratifiedSampler(int numSamples)
+{
+	m_gridSize = 1;
+	while (m_gridSize * m_gridSize < static_cast<uint32>(numSamples))
+		m_gridSize++;
+	m_numSamples = m_gridSize * m_gridSize;
+}
+
+Vec2 StratifiedSampler::Sample2D(uint32 seed, uint32 dim, uint32 nSample) const
+{
+	const uint32 round = nSample / m_numSamples;
+	const uint32 dimSeed = Hash(Hash(seed, dim), round);
+	const uint32 cell = Permute(nSample % m_numSamples, m_numSamples, dimSeed);
+
+	const uint32 jitter = Hash(dimSeed, nSample);
+	const Vec2 j(ToFloat(jitter), ToFloat(Hash(jitter, dimSeed)));
+	return Vec2(fminf(((cell % m_gridSize) + j.x) / m_gridSize, 1.f - FLT_EPSILON * 0.5f),
+				fminf(((cell / m_gridSize) + j.y) / m_gridSize, 1.f - FLT_EPSILON * 0.5f));
+}
+
+// ------------------------------------------------------------------------ //
+
+Vec2 SobolSampler::Sample2D(uint32 seed, uint32 dim, uint32 nSample) const
+{
+	const uint32 dimSeed = Hash(seed, dim);
+	const uint32 index = NestedUniformScramble(nSample, dimSeed);
+
+	// the first dimension is the van der Corput sequence, the direction numbers of the second one are v[i] = v[i - 1] ^ (v[i - 1] >> 1)
+	uint32 x = ReverseBits(index);
+	uint32 y = 0;
+	for (uint32 i = index, v = 0x80000000; i != 0; i >>= 1, v ^= v >> 1)
+	{
+		if (i & 1)
+			y ^= v;
+	}
+
+	const uint32 xSeed = Hash(dimSeed, 1);
+	const uint32 ySeed = Hash(dimSeed, 2);
+	if (m_scrambling == SCRAMBLE_OWEN)
+	{
+		x = NestedUniformScramble(x, xSeed);
+		y = NestedUniformScramble(y, ySeed);
+	}
+	else
+	{
+		x ^= xSeed;
+		y ^= ySeed;
+	}
+
+	return Vec2(ToFloat(x), ToFloat(y));
+}
@@ -0,0 +1,84 @@
+//
+//  Sampler.h
+//  MiRay/rt
+//
+//  Created by agent on 17.10.26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+#pragma once
+
+namespace mr
+{
+
+// Sample values of the pixels. A sample of a pixel takes its dimensions one after another, the pixel jitter first,
+// then the lens, then every AO direction, light sample and rough reflection in the order the tracer asks for them.
+// The samplers keep no state, one is shared by all render threads.
+class ISampler
+{
+public:
+	virtual ~ISampler() {}
+
+	// values in [0, 1) of the 2D dimension dim of the sample nSample, seed tells the pixels apart
+	virtual Vec2 Sample2D(uint32 seed, uint32 dim, uint32 nSample) const = 0;
+
+	static uint32 PixelSeed(int x, int y);
+	static uint32 Hash(uint32 a, uint32 b);
+};
+
+// the dimensions of one sample of a pixel
+class PixelSampler
+{
+	const ISampler &	m_sampler;
+	uint32	m_seed;
+	uint32	m_nSample;
+	uint32	m_dim;
+
+public:
+	PixelSampler(const ISampler & sampler, uint32 seed, uint32 nSample, uint32 firstDim = 0)
+		: m_sampler(sampler), m_seed(seed), m_nSample(nSample), m_dim(firstDim) {}
+
+	Vec2 Next2D() { return m_sampler.Sample2D(m_seed, m_dim++, m_nSample); }
+	float Next1D() { return Next2D().x; }
+};
+
+// independent values of the PCG generator, seeded by the pixel, the dimension and the sample
+class RandomSampler : public ISampler
+{
+public:
+	Vec2 Sample2D(uint32 seed, uint32 dim, uint32 nSample) const;
+};
+
+// Jittered grid of numSamples cells for every dimension, a pixel visits the cells in its own order.
+// The next numSamples samples go through the cells again in another order.
+class StratifiedSampler : public ISampler
+{
+	uint32	m_numSamples;
+	uint32	m_gridSize;
+
+public:
+	StratifiedSampler(int numSamples);
+
+	Vec2 Sample2D(uint32 seed, uint32 dim, uint32 nSample) const;
+};
+
+// Two dimensional Sobol sequence padded to every dimension: the sample index is shuffled by the pixel and the dimension,
+// so the dimensions don't correlate, and the values are scrambled for the pixels to get different points.
+class SobolSampler : public ISampler
+{
+public:
+	enum eScrambling
+	{
+		SCRAMBLE_XOR, // random digital shift
+		SCRAMBLE_OWEN, // nested uniform scrambling, keeps the stratification of the sequence for every power of two samples
+	};
+
+private:
+	eScrambling	m_scrambling;
+
+public:
+	SobolSampler(eScrambling scrambling) : m_scrambling(scrambling) {}
+
+	Vec2 Sample2D(uint32 seed, uint32 dim, uint32 nSample) const;
+};
+
+}
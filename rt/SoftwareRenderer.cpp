@@ -10,6 +10,8 @@
 #include "Material.h"
 #include "Light.h"
 #include "Image.h"
+#include "../common/threadpool.h"
+#include "../common/timer.h"
 
 using namespace mr;
 
@@ -20,23 +22,42 @@ enum
 	BUMP_BINARY_SEARCH_STEPS = 5,
 	LIGHTING_BUMP_LINEAR_SEARCH_STEPS = 24,
 	BUMP_AMBIENT_OCCLUSION_LINEAR_SEARCH_STEPS = 16,
+	PACKET_SIZE = 4, // side of the pixel squares traced as one packet of camera rays
+	MAX_TILE_SIZE = 16,
+	MIN_TILES_PER_THREAD = 8, // smaller frames are cut into smaller tiles
+	SPLIT_TILE_COST = 4, // tiles this many times costlier than the average are split
+	CAMERA_SAMPLE_DIMENSIONS = 2, // the pixel jitter and the lens offset, the tracer takes the dimensions after them
+	LIGHT_SAMPLES_SEED = 0x6c1a7e5d, // sets the sampler seeds of the light samples apart from the pixel ones
 };
 
 // ------------------------------------------------------------------------ //
 
 SoftwareRenderer::SoftwareRenderer(BVH & scene)
 	: m_scene(scene)
-	, m_pImage(NULL)
 	, m_bgColor(ColorF::Null)
 	, m_envColor(1.f)
 	, m_pEnvironmentMap(NULL)
 	, m_showFloor(false)
-	, m_floorIOR(1.f)
 	, m_floorShadow(0.3f)
+	, m_floorIOR(1.f)
 	, m_ambientOcclusion(1.f)
 	, m_focalDistance(0.f)
 	, m_dofBlur(0.f)
 	, m_numAmbientOcclusionSamples(1)
+	, m_bSortAmbientRays(false)
+	, m_pSampler(&m_randomSampler)
+	, m_pImage(NULL)
+	, m_tileSize(0)
+	, m_numTilesX(0)
+	, m_numTilesY(0)
+	, m_nThreadCounter(0)
+	, m_bContinuous(false)
+	, m_nSampleCounter(0)
+	, m_numBusyAreas(0)
+	, m_numStartingThreads(0)
+	, m_numRenderingThreads(0)
+	, m_bStopThreads(false)
+	, m_bInterrupted(false)
 {
 }
 
@@ -44,6 +65,7 @@ SoftwareRenderer::~SoftwareRenderer()
 {
 	Interrupt();
 	Join();
+	StopThreads();
 }
 
 // ------------------------------------------------------------------------ //
@@ -69,6 +91,11 @@ void SoftwareRenderer::SetAmbientOcclusion(float f, size_t numSamples)
 	m_numAmbientOcclusionSamples = (int)numSamples;
 }
 
+void SoftwareRenderer::SetAmbientOcclusionRaysSorting(bool b)
+{
+	m_bSortAmbientRays = b;
+}
+
 void SoftwareRenderer::SetFocalDistance(float dist)
 {
 	m_focalDistance = dist;
@@ -86,16 +113,131 @@ void SoftwareRenderer::SetLights(size_t num, ILight ** ppLights)
 		m_lights[i] = ppLights[i];
 }
 
+void SoftwareRenderer::SetSampler(const ISampler * pSampler)
+{
+	m_pSampler = pSampler ? pSampler : &m_randomSampler;
+}
+
+// ------------------------------------------------------------------------ //
+
+void SoftwareRenderer::StartThreads(int numThreads)
+{
+	m_pAreaQueues.reset(new AreaQueue[numThreads]);
+	for (int i = 0; i < numThreads; i++)
+		m_pAreaQueues[i].begin = m_pAreaQueues[i].end = 0;
+
+	m_nThreadCounter = 0;
+	for (int i = 0; i < numThreads; i++)
+		m_renderThreads.push_back(new Thread(&ThreadFunc, this));
+}
+
+void SoftwareRenderer::StopThreads()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadsMutex);
+		m_bStopThreads = true;
+		m_frameStarted.notify_all();
+	}
+
+	for (size_t i = 0; i < m_renderThreads.size(); i++)
+	{
+		m_renderThreads[i]->join();
+		delete m_renderThreads[i];
+	}
+
+	m_renderThreads.clear();
+	m_bStopThreads = false;
+}
+
 // ------------------------------------------------------------------------ //
 
 void SoftwareRenderer::Render(IImage & image, const RectI * pViewportRect,
-							  const Matrix & matCamera, const Matrix & matViewProj, const Vec2 & vPixelOffset,
+							  const Matrix & matCamera, const Matrix & matViewProj,
 							  int numThreads, int nFrameNumber)
 {
+	const bool bAreaCostsMeasured = !m_bInterrupted && !m_bContinuous;
+	SetupFrame(image, pViewportRect, matCamera, matViewProj, numThreads);
+	SetupSample(m_frameSample, nFrameNumber);
+	CreateAreas(bAreaCostsMeasured);
+	m_bContinuous = false;
+	StartThreadsFrame();
+}
+
+void SoftwareRenderer::RenderContinuous(IImage & image, const RectI * pViewportRect, const Matrix & matCamera, const Matrix & matViewProj, int numThreads)
+{
+	SetupFrame(image, pViewportRect, matCamera, matViewProj, numThreads);
+	CreateAreas(false); // no area waits for another, so the costly ones don't need to be split
+
+	m_pAreaSamples.reset(new AreaSamples[m_areas.size()]);
+	for (size_t i = 0; i < m_areas.size(); i++)
+	{
+		m_pAreaSamples[i].busy = false;
+		m_pAreaSamples[i].count = 0;
+	}
+
+	m_nSampleCounter = 0;
+	m_numBusyAreas = 0;
+	m_bContinuous = true;
+	StartThreadsFrame();
+}
+
+int SoftwareRenderer::NumContinuousSamples() const
+{
+	if (!m_bContinuous || m_areas.empty())
+		return 0;
+
+	int count = m_pAreaSamples[0].count;
+	for (size_t i = 1; i < m_areas.size(); i++)
+		count = std::min<int>(count, m_pAreaSamples[i].count);
+	return count;
+}
+
+// Every area is taken over like a render thread takes it, so no thread writes it while it's copied.
+void SoftwareRenderer::CopyContinuousImage(IImage & dest, int pixelSize)
+{
+	if (!m_bContinuous || m_areas.empty())
+		return;
+
+	const size_t pitch = m_pImage->Width() * pixelSize;
+	const byte * pSrc = reinterpret_cast<const byte *>(m_pImage->Data());
+	byte * pDest = reinterpret_cast<byte *>(dest.Data());
+	for (size_t area = 0; area < m_areas.size(); area++)
+	{
+		AreaSamples & samples = m_pAreaSamples[area];
+		{// the area being sampled is released in a few milliseconds
+			std::unique_lock<std::mutex> lock(m_samplesMutex);
+			while (samples.busy.exchange(true))
+				m_areaReleased.wait(lock);
+			m_numBusyAreas++;
+		}
+
+		const RectI & rc = m_areas[area].rc;
+		for (int y = rc.top; y < rc.bottom; y++)
+			memcpy(pDest + y * pitch + rc.left * pixelSize, pSrc + y * pitch + rc.left * pixelSize, rc.Width() * pixelSize);
+
+		samples.busy = false;
+		std::lock_guard<std::mutex> lock(m_samplesMutex);
+		m_numBusyAreas--;
+		m_areaReleased.notify_all();
+	}
+}
+
+void SoftwareRenderer::SetupFrame(IImage & image, const RectI * pViewportRect, const Matrix & matCamera, const Matrix & matViewProj, int numThreads)
+{
+	Join();
+	if (numThreads <= 0)
+		numThreads = ThreadPool::NumCPU();
+
+	if (static_cast<int>(m_renderThreads.size()) != numThreads)
+	{
+		StopThreads();
+		StartThreads(numThreads);
+	}
+
+	m_bInterrupted = false;
 	m_pImage = &image;
 	m_rcRenderArea = pViewportRect ? *pViewportRect : RectI(0, 0, image.Width(), image.Height());
 	m_vEyePos = matCamera.Pos();
-	m_fFrameBlend = 1.f / (nFrameNumber + 1);
 
 //	m_fRayLength = m_scene.BoundingBox().Size().Length();
 	m_fDistEpsilon = m_fRayLength * 0.0001f;
@@ -115,90 +257,280 @@ void SoftwareRenderer::Render(IImage & image, const RectI * pViewportRect,
 	m_vCamDelta[1] = Vec3(p.x, p.y, p.z) / p.w - m_vCamDelta[2];
 
 	m_fRayLength = (m_vCamDelta[2] - m_vEyePos).Length();
-
-	m_vCamDelta[2] += m_vCamDelta[0] * (vPixelOffset.y * m_dp.x);
-	m_vCamDelta[2] += m_vCamDelta[1] * -(vPixelOffset.y * m_dp.y);
-
 	m_dofLC = Vec2(m_focalDistance / m_fRayLength, m_fRayLength / (m_fRayLength - m_focalDistance));
-	m_dofDP = nFrameNumber > 0 ? m_dp * Vec2Rand() * m_dofBlur : Vec2::Null;
+}
 
-	m_delta = Vec2I(16, 16);
-	m_nAreaCounter = 0;
-	m_numAreasX = (m_rcRenderArea.Width() + m_delta.x - 1) / m_delta.x;
-	int numAreasY = (m_rcRenderArea.Height() + m_delta.y - 1) / m_delta.y;
-	m_numAreas = m_numAreasX * numAreasY;
-	m_random = Vec2(frand(), frand());
-	m_matRandom.RotationAxis(Vec3::Normalize(Vec3Rand()), acosf(frand()));
+void SoftwareRenderer::SetupSample(Sample & sample, int nSampleNumber) const
+{
+	sample.fBlend = 1.f / (nSampleNumber + 1);
+	sample.nNumber = nSampleNumber;
+}
 
-//	numThreads = 1;
-	for (int i = 0; i < numThreads; i++)
-		m_renderThreads.push_back(new Thread(&ThreadFunc, this));
+void SoftwareRenderer::StartThreadsFrame()
+{
+	std::lock_guard<std::mutex> lock(m_threadsMutex);
+	m_numStartingThreads = static_cast<int>(m_renderThreads.size());
+	m_numRenderingThreads = static_cast<int>(m_renderThreads.size());
+	m_frameStarted.notify_all();
 }
 
 void SoftwareRenderer::Join()
 {
-	for (size_t i = 0; i < m_renderThreads.size(); i++)
-	{
-		m_renderThreads[i]->join();
-		delete m_renderThreads[i];
-	}
-
-	m_renderThreads.clear();
+	std::unique_lock<std::mutex> lock(m_threadsMutex);
+	while (m_numRenderingThreads > 0)
+		m_frameDone.wait(lock);
 }
 
 void SoftwareRenderer::Interrupt()
 {
-	m_nAreaCounter = m_numAreas;
+	m_bInterrupted = true;
+
+	std::lock_guard<std::mutex> lock(m_samplesMutex);
+	m_areaReleased.notify_all();
 }
 
 // ------------------------------------------------------------------------ //
 
-bool SoftwareRenderer::GetNextArea(RectI & rc)
+void SoftwareRenderer::CreateAreas(bool bSplitCostlyTiles)
 {
-	int pos = m_nAreaCounter++;
-	if (pos >= m_numAreas)
+	const int numThreads = static_cast<int>(m_renderThreads.size());
+	const int width = m_rcRenderArea.Width();
+	const int height = m_rcRenderArea.Height();
+
+	// the biggest tiles still giving every thread enough of them to share the work
+	int tileSize = MAX_TILE_SIZE;
+	while (tileSize > PACKET_SIZE && ((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize) < numThreads * MIN_TILES_PER_THREAD)
+		tileSize /= 2;
+
+	const int numTilesX = (width + tileSize - 1) / tileSize;
+	const int numTilesY = (height + tileSize - 1) / tileSize;
+	if (tileSize != m_tileSize || numTilesX != m_numTilesX || numTilesY != m_numTilesY)
+	{// the neighbour tiles of the curve are neighbours on the screen, the areas of a thread see the same part of the scene
+		m_tileSize = tileSize;
+		m_numTilesX = numTilesX;
+		m_numTilesY = numTilesY;
+
+		int order = 0;
+		while ((1 << order) < std::max(numTilesX, numTilesY))
+			order++;
+
+		std::vector<std::pair<uint32, int> > tiles(numTilesX * numTilesY);
+		for (int i = 0; i < numTilesX * numTilesY; i++)
+			tiles[i] = std::make_pair(HilbertIndex(i % numTilesX, i / numTilesX, order), i);
+		std::sort(tiles.begin(), tiles.end());
+
+		m_tileOrder.resize(tiles.size());
+		for (size_t i = 0; i < tiles.size(); i++)
+			m_tileOrder[i] = tiles[i].second;
+
+		m_areas.clear();
+		m_areaCosts.clear();
+	}
+
+	// the progressive frames render the same view, the tiles costly in the last one are split for the other threads to take
+	std::vector<float> tileCosts;
+	float fSplitCost = FLT_MAX;
+	if (bSplitCostlyTiles && !m_areas.empty() && tileSize >= PACKET_SIZE * 2)
+	{
+		tileCosts.resize(m_tileOrder.size(), 0.f);
+		float fTotalCost = 0.f;
+		for (size_t i = 0; i < m_areas.size(); i++)
+		{
+			tileCosts[m_areas[i].tile] += m_areaCosts[i];
+			fTotalCost += m_areaCosts[i];
+		}
+		fSplitCost = fTotalCost * SPLIT_TILE_COST / tileCosts.size();
+	}
+
+	m_areas.clear();
+	for (size_t i = 0; i < m_tileOrder.size(); i++)
+	{
+		Area area;
+		area.tile = m_tileOrder[i];
+		area.rc.left = m_rcRenderArea.left + tileSize * (area.tile % numTilesX);
+		area.rc.top = m_rcRenderArea.top + tileSize * (area.tile / numTilesX);
+		area.rc.right = std::min(area.rc.left + tileSize, m_rcRenderArea.right);
+		area.rc.bottom = std::min(area.rc.top + tileSize, m_rcRenderArea.bottom);
+		if (tileCosts.empty() || tileCosts[area.tile] <= fSplitCost)
+		{
+			m_areas.push_back(area);
+			continue;
+		}
+
+		const RectI rcTile = area.rc;
+		const int halfSize = tileSize / 2;
+		for (int j = 0; j < 4; j++)
+		{
+			area.rc.left = rcTile.left + (j & 1) * halfSize;
+			area.rc.top = rcTile.top + (j >> 1) * halfSize;
+			area.rc.right = std::min(area.rc.left + halfSize, rcTile.right);
+			area.rc.bottom = std::min(area.rc.top + halfSize, rcTile.bottom);
+			if (area.rc.left < area.rc.right && area.rc.top < area.rc.bottom)
+				m_areas.push_back(area);
+		}
+	}
+
+	m_areaCosts.assign(m_areas.size(), 0.f);
+
+	const int numAreas = static_cast<int>(m_areas.size());
+	for (int i = 0; i < numThreads; i++)
+	{
+		m_pAreaQueues[i].begin = numAreas * i / numThreads;
+		m_pAreaQueues[i].end = numAreas * (i + 1) / numThreads;
+	}
+}
+
+bool SoftwareRenderer::GetNextArea(int queue, int & area)
+{
+	if (m_bInterrupted)
 		return false;
 
-	rc.left = m_rcRenderArea.left + m_delta.x * (pos % m_numAreasX);
-	rc.top = m_rcRenderArea.top + m_delta.y * (pos / m_numAreasX);
-	rc.right = std::min(rc.left + m_delta.x, m_rcRenderArea.right);
-	rc.bottom = std::min(rc.top + m_delta.y, m_rcRenderArea.bottom);
-	return true;
+	AreaQueue & own = m_pAreaQueues[queue];
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (own.begin < own.end)
+		{
+			area = own.begin++;
+			return true;
+		}
+	}
+
+	const int numQueues = static_cast<int>(m_renderThreads.size());
+	for (;;)
+	{
+		int victim = -1;
+		int maxCount = 0;
+		for (int i = 0; i < numQueues; i++)
+		{
+			const int count = m_pAreaQueues[i].end - m_pAreaQueues[i].begin;
+			if (maxCount < count)
+			{
+				maxCount = count;
+				victim = i;
+			}
+		}
+
+		if (victim < 0)
+			return false;
+
+		int begin, end;
+		{
+			AreaQueue & q = m_pAreaQueues[victim];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			const int count = q.end - q.begin;
+			if (count <= 0)
+				continue; // taken by the owner or another thread meanwhile
+
+			end = q.end;
+			begin = end - (count + 1) / 2;
+			q.end = begin;
+		}
+
+		area = begin;
+		if (begin + 1 < end)
+		{
+			std::lock_guard<std::mutex> lock(own.mutex);
+			own.begin = begin + 1;
+			own.end = end;
+		}
+		return true;
+	}
 }
 
-ColorF SoftwareRenderer::RenderPixel(const Vec2 &p) const
+void SoftwareRenderer::GetCameraRay(const Vec2 & p, const Vec2 & dofDP, Vec3 & vStart, Vec3 & vDest) const
 {
-	Vec3 vStart = m_vEyePos;
-	Vec3 vDest = m_vCamDelta[2] + m_vCamDelta[0] * p.x - m_vCamDelta[1] * p.y;
+	vStart = m_vEyePos;
+	vDest = m_vCamDelta[2] + m_vCamDelta[0] * p.x - m_vCamDelta[1] * p.y;
 	if (m_dofBlur > 0.f)
 	{
 		Vec3 pos = Vec3::Lerp(m_vEyePos, vDest, m_dofLC.x);
-		Vec2 bp = p + m_dofDP;
+		Vec2 bp = p + dofDP;
 		vDest = m_vCamDelta[2] + m_vCamDelta[0] * bp.x - m_vCamDelta[1] * bp.y;
 		vStart = Vec3::Lerp(vDest, pos, m_dofLC.y);
 	}
-	MaterialStack ms;
-	Result res = TraceRay(vStart, vDest, 0, NULL, ms);
-//	printf("\n");
-	return ColorF(res.color.x, res.color.y, res.color.z, res.opacity.x);
 }
 
-void SoftwareRenderer::RenderArea(const RectI & rc) const
+// Camera rays of PACKET_SIZE x PACKET_SIZE pixels are traced to their first hits at once, the hits are shaded per pixel.
+// Shadow and ambient occlusion rays of the hits are collected for the whole area and traced after all of its pixels.
+// An interrupted area is left unfinished, the frame is dropped anyway.
+void SoftwareRenderer::RenderArea(const RectI & rc, const Sample & sample, std::vector<ColorF> & colors, LightingBatch & batch) const
 {
-	Vec2 p;
+	Vec3 vStart[CollisionPacket::MAX_RAYS];
+	Vec3 vDest[CollisionPacket::MAX_RAYS];
+	Vec3 vClippedDest[CollisionPacket::MAX_RAYS];
+	TraceResult results[CollisionPacket::MAX_RAYS];
+
+	const int width = rc.Width();
+	colors.resize(width * rc.Height());
+	// the light samples are chosen by the MAX_TILE_SIZE cell, not by the area, the areas differ with the thread count and the split tiles
+	const uint32 lightSeed = ISampler::PixelSeed((rc.left - m_rcRenderArea.left) / MAX_TILE_SIZE, (rc.top - m_rcRenderArea.top) / MAX_TILE_SIZE);
+	PixelSampler lightSampler(*m_pSampler, lightSeed ^ LIGHT_SAMPLES_SEED, sample.nNumber);
+	batch.lightSamples.resize(m_lights.size());
+	for (size_t i = 0; i < batch.lightSamples.size(); i++)
+		batch.lightSamples[i] = UniformSphere(lightSampler.Next2D());
+	batch.shadowRays.clear();
+	batch.ambientRays.clear();
+	batch.shadowRays.reserve(colors.size() * m_lights.size());
+
+	for (int py = rc.top; py < rc.bottom; py += PACKET_SIZE)
+	{
+		const int pyEnd = std::min(py + PACKET_SIZE, rc.bottom);
+		for (int px = rc.left; px < rc.right; px += PACKET_SIZE)
+		{
+			if (m_bInterrupted)
+				return;
+
+			const int pxEnd = std::min(px + PACKET_SIZE, rc.right);
+
+			int numRays = 0;
+			for (int y = py; y < pyEnd; y++)
+			{
+				for (int x = px; x < pxEnd; x++, numRays++)
+				{
+					// the first sample goes through the pixel center
+					PixelSampler cameraSampler(*m_pSampler, ISampler::PixelSeed(x, y), sample.nNumber);
+					const Vec2 jitter = cameraSampler.Next2D();
+					const Vec2 lens = cameraSampler.Next2D();
+					const Vec2 offset = sample.nNumber > 0 ? jitter : Vec2(0.5f, 0.5f);
+					const Vec2 dofDP = sample.nNumber > 0 ? m_dp * UniformDisk(lens) * m_dofBlur : Vec2::Null;
+					GetCameraRay(Vec2((x + offset.x) * m_dp.x - 1.f, (y + offset.y) * m_dp.y - 1.f), dofDP, vStart[numRays], vDest[numRays]);
+					vClippedDest[numRays] = ClipByFloor(vStart[numRays], vDest[numRays]);
+					results[numRays] = TraceResult();
+				}
+			}
+
+			// with depth of field every ray starts at its own point of the lens, the packet traversal orders the nodes per ray
+			m_scene.TracePacket(vStart, vClippedDest, results, numRays);
+
+			numRays = 0;
+			for (int y = py; y < pyEnd; y++)
+			{
+				for (int x = px; x < pxEnd; x++, numRays++)
+				{
+					MaterialStack ms;
+					PixelSampler sampler(*m_pSampler, ISampler::PixelSeed(x, y), sample.nNumber, CAMERA_SAMPLE_DIMENSIONS);
+					batch.pixel = (y - rc.top) * width + (x - rc.left);
+					Result res = TraceRay(vStart[numRays], vDest[numRays], 0, NULL, NULL, ms, sampler, &results[numRays], &batch);
+					colors[batch.pixel] = ColorF(res.color.x, res.color.y, res.color.z, res.opacity.x);
+				}
+			}
+		}
+	}
+
+	TraceShadowRays(batch, colors.data());
+	TraceAmbientOcclusionRays(batch, colors.data());
+	if (m_bInterrupted)
+		return;
+
 	for (int y = rc.top; y < rc.bottom; y++)
 	{
-		p.y = y * m_dp.y - 1.f;
-		
 		for (int x = rc.left; x < rc.right; x++)
 		{
-			p.x = x * m_dp.x - 1.f;
-
-			ColorF res = RenderPixel(p);
-			if (m_fFrameBlend < 1.f)
+			const ColorF & res = colors[(y - rc.top) * width + (x - rc.left)];
+			if (sample.fBlend < 1.f)
 			{
 				ColorF src = m_pImage->GetPixel(x, y);
-				m_pImage->SetPixel(x, y, ColorF::Lerp(src, res, m_fFrameBlend));
+				m_pImage->SetPixel(x, y, ColorF::Lerp(src, res, sample.fBlend));
 			}
 			else
 				m_pImage->SetPixel(x, y, res);
@@ -206,19 +538,178 @@ void SoftwareRenderer::RenderArea(const RectI & rc) const
 	}
 }
 
+// shadow rays of every light are traced in packets, the lit pixels get their light
+void SoftwareRenderer::TraceShadowRays(LightingBatch & batch, ColorF * pColors) const
+{
+	Vec3 vFrom[CollisionPacket::MAX_RAYS];
+	Vec3 vTo[CollisionPacket::MAX_RAYS];
+	const ShadowRay * pRays[CollisionPacket::MAX_RAYS];
+
+	for (int light = 0; light < (int)m_lights.size(); light++)
+	{
+		int numRays = 0;
+		for (size_t i = 0; i <= batch.shadowRays.size(); i++)
+		{
+			if (i < batch.shadowRays.size() && batch.shadowRays[i].light == light)
+			{
+				pRays[numRays] = &batch.shadowRays[i];
+				vFrom[numRays] = pRays[numRays]->from;
+				vTo[numRays] = pRays[numRays]->to;
+				if (++numRays < CollisionPacket::MAX_RAYS)
+					continue;
+			}
+
+			if (numRays == 0)
+				continue;
+
+			if (m_bInterrupted)
+				return;
+
+			const uint32 occluded = m_scene.OccludedPacket(vFrom, vTo, numRays);
+			for (int j = 0; j < numRays; j++)
+			{
+				if (occluded & (1 << j))
+					continue;
+
+				ColorF & color = pColors[pRays[j]->pixel];
+				color.r += pRays[j]->color.x;
+				color.g += pRays[j]->color.y;
+				color.b += pRays[j]->color.z;
+			}
+			numRays = 0;
+		}
+	}
+}
+
+// Ambient occlusion rays go in random directions. Sorted by the direction octant and by the Morton order of the origins
+// in the area, the neighbour rays of the stream walk mostly the same nodes. The keys are coarse enough for a counting sort.
+void SoftwareRenderer::TraceAmbientOcclusionRays(LightingBatch & batch, ColorF * pColors) const
+{
+	const std::vector<ShadowRay> & rays = batch.ambientRays;
+	if (rays.empty())
+		return;
+
+	std::vector<uint32> order(rays.size());
+	if (m_bSortAmbientRays)
+	{
+		enum { MORTON_BITS = 9, NUM_KEYS = 8 << MORTON_BITS };
+
+		BBox bbox;
+		bbox.ClearBounds();
+		for (size_t i = 0; i < rays.size(); i++)
+			bbox.AddToBounds(rays[i].from);
+
+		std::vector<uint32> keys(rays.size());
+		std::vector<uint32> offsets(NUM_KEYS + 1, 0);
+		for (size_t i = 0; i < rays.size(); i++)
+		{
+			const Vec3 dir = rays[i].to - rays[i].from;
+			const uint32 octant = (dir.x < 0.f ? 1 : 0) | (dir.y < 0.f ? 2 : 0) | (dir.z < 0.f ? 4 : 0);
+			keys[i] = (octant << MORTON_BITS) | (MortonCode(rays[i].from, bbox) >> (30 - MORTON_BITS));
+			offsets[keys[i] + 1]++;
+		}
+
+		for (int i = 0; i < NUM_KEYS; i++)
+			offsets[i + 1] += offsets[i];
+
+		for (size_t i = 0; i < rays.size(); i++)
+			order[offsets[keys[i]]++] = static_cast<uint32>(i);
+	}
+	else
+	{
+		for (size_t i = 0; i < rays.size(); i++)
+			order[i] = static_cast<uint32>(i);
+	}
+
+	// the rays are too incoherent for packets, they are traced one by one
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		if ((i & 63) == 0 && m_bInterrupted)
+			return;
+
+		const ShadowRay & ray = rays[order[i]];
+		if (m_scene.Occluded(ray.from, ray.to))
+			continue;
+
+		ColorF & color = pColors[ray.pixel];
+		color.r += ray.color.x;
+		color.g += ray.color.y;
+		color.b += ray.color.z;
+	}
+}
+
 void SoftwareRenderer::ThreadFunc(void * pRenderer)
 {
-//	printf("start %p\n", this);
 	SoftwareRenderer * pThis = reinterpret_cast<SoftwareRenderer *>(pRenderer);
+	const int queue = pThis->m_nThreadCounter++;
+
+	std::vector<ColorF> colors;
+	LightingBatch batch;
 
-	RectI rc;
-	while (pThis->GetNextArea(rc))
+	std::unique_lock<std::mutex> lock(pThis->m_threadsMutex);
+	while (!pThis->m_bStopThreads)
 	{
-//		printf("%p: (%d, %d)\n", this, rc.left, rc.top);
-		pThis->RenderArea(rc);
+		if (pThis->m_numStartingThreads == 0)
+		{
+			pThis->m_frameStarted.wait(lock);
+			continue;
+		}
+
+		pThis->m_numStartingThreads--;
+		lock.unlock();
+
+		int area;
+		if (pThis->m_bContinuous)
+			pThis->RenderSamples(colors, batch);
+		else while (pThis->GetNextArea(queue, area))
+		{
+			const double tm = Timer::GetSeconds();
+			pThis->RenderArea(pThis->m_areas[area].rc, pThis->m_frameSample, colors, batch);
+			pThis->m_areaCosts[area] = static_cast<float>(Timer::GetSeconds() - tm);
+		}
+
+		lock.lock();
+		if (--pThis->m_numRenderingThreads == 0)
+			pThis->m_frameDone.notify_all();
 	}
+}
 
-//	printf("end %p\n", this);
+// The sample of an area is its own pass over it, the first one goes through the pixel centers.
+void SoftwareRenderer::RenderSamples(std::vector<ColorF> & colors, LightingBatch & batch)
+{
+	const size_t numAreas = m_areas.size();
+	if (numAreas == 0)
+		return;
+
+	while (!m_bInterrupted)
+	{
+		const size_t area = m_nSampleCounter++ % numAreas;
+		AreaSamples & samples = m_pAreaSamples[area];
+		if (samples.busy.exchange(true))
+		{// another thread is still on its previous sample
+			if (m_numBusyAreas >= numAreas)
+			{// more threads than areas, sleep until one is released instead of spinning over them
+				std::unique_lock<std::mutex> lock(m_samplesMutex);
+				while (!m_bInterrupted && m_numBusyAreas >= numAreas)
+					m_areaReleased.wait(lock);
+			}
+			continue;
+		}
+		m_numBusyAreas++;
+
+		const int nSample = samples.count;
+		Sample sample;
+		SetupSample(sample, nSample);
+		RenderArea(m_areas[area].rc, sample, colors, batch);
+
+		if (!m_bInterrupted) // an interrupted area isn't blended in
+			samples.count = nSample + 1;
+		samples.busy = false;
+
+		std::lock_guard<std::mutex> lock(m_samplesMutex);
+		m_numBusyAreas--;
+		m_areaReleased.notify_all(); // CopyContinuousImage may wait for this very area
+	}
 }
 
 // ------------------------------------------------------------------------ //
@@ -238,17 +729,15 @@ Vec3 SoftwareRenderer::EnvironmentColor(const Vec3 & vDir) const
 //	return m_pEnvironmentMap->GetPixelColorUV(vDir.x * d + 0.5f, vDir.z * -d + 0.5f) * m_envColor;
 }
 
-Vec3 SoftwareRenderer::RandomDirection(const Vec3 & normal) const
+// uniform direction of the hemisphere around the normal for the sample values u in [0, 1)
+Vec3 SoftwareRenderer::RandomDirection(const Vec3 & normal, const Vec2 & u) const
 {
 	Vec3 axis1 = normal.GetPerpendicular();
 	Vec3 axis2 = Vec3::Cross(normal, axis1);
-	//	float cosA = m_random.x;
-	float cosA = frand();
+	float cosA = u.x;
 	float sinA = sqrtf(1.f - cosA * cosA);
-	//	float B = m_random.y * M_2PIf;
-	float B = rand() * (M_2PIf / RAND_MAX);
+	float B = u.y * M_2PIf;
 	return axis1 * (sinA * cosf(B)) + axis2 * (sinA * sinf(B)) + normal * cosA;
-	//	return normal.TransformedNormal(m_matRandom);
 }
 
 // ------------------------------------------------------------------------ //
@@ -325,15 +814,19 @@ Vec2 TraceBumpMap(Vec2 & tc, const Vec3 & dir,
 // ------------------------------------------------------------------------ //
 
 inline void SoftwareRenderer::AddAmbientOcclusion(Vec3 & color, const Vec3 & P, const Vec3 & N, const Vec3 & TN, int numSamples, const TraceResult & tr,
-												  const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ) const
+												  const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ, LightingBatch * pBatch, PixelSampler & sampler) const
 {
 	Vec3 ambientOcclusion = Vec3::Null;
 	for (int i = 0; i < numSamples; i++)
 	{// ambient occlusion
-		Vec3 vRandDir;
-		do {
-			vRandDir = RandomDirection(N);
-		} while (Vec3::Dot(vRandDir, TN) <= 0.f);
+		// one 2D sample per direction keeps the dimensions of the samples after it the same in every pixel sample,
+		// so a direction under the geometric normal is mirrored above it instead of drawn again
+		Vec3 vRandDir = RandomDirection(N, sampler.Next2D());
+		const float fGeomDot = Vec3::Dot(vRandDir, TN);
+		if (fGeomDot == 0.f)
+			continue;
+		if (fGeomDot < 0.f)
+			vRandDir -= TN * (2.f * fGeomDot);
 
 		if (m_showFloor && vRandDir.z < 0.f)
 			continue;
@@ -349,8 +842,19 @@ inline void SoftwareRenderer::AddAmbientOcclusion(Vec3 & color, const Vec3 & P,
 				continue;
 		}
 		
-		TraceResult otl;
-		if (!m_scene.TraceRay(P, P + vRandDir * m_fRayLength, otl))
+		if (pBatch)
+		{// traced later with the rays of the whole area
+			ShadowRay ray;
+			ray.from = P;
+			ray.to = P + vRandDir * m_fRayLength;
+			ray.color = EnvironmentColor(vRandDir) * (m_ambientOcclusion / numSamples);
+			ray.light = -1;
+			ray.pixel = pBatch->pixel;
+			pBatch->ambientRays.push_back(ray);
+			continue;
+		}
+
+		if (!m_scene.Occluded(P, P + vRandDir * m_fRayLength))
 			ambientOcclusion += EnvironmentColor(vRandDir);
 	}
 
@@ -360,12 +864,13 @@ inline void SoftwareRenderer::AddAmbientOcclusion(Vec3 & color, const Vec3 & P,
 }
 
 inline void SoftwareRenderer::AddLighting(Vec3 & color, const Vec3 & P, const Vec3 & N, const TraceResult & tr,
-										  const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ) const
+										  const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ, LightingBatch * pBatch, PixelSampler & sampler) const
 {
 	for (std::vector<ILight *>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++it)
 	{// lighting
 		const ILight * pLight = *it;
-		Vec3 lightPos = pLight->Position(P);
+		const int light = static_cast<int>(it - m_lights.begin());
+		Vec3 lightPos = pLight->Position(P, pBatch ? pBatch->lightSamples[light] : UniformSphere(sampler.Next2D()));
 		Vec3 lightDir = lightPos - P;
 		float l2 = lightDir.LengthSquared();
 		if (l2 == 0.f)
@@ -390,8 +895,19 @@ inline void SoftwareRenderer::AddLighting(Vec3 & color, const Vec3 & P, const Ve
 				continue;
 		}
 
-		TraceResult ltr;
-		if (m_scene.TraceRay(P, lightPos, ltr))
+		if (pBatch)
+		{// traced later with the shadow rays of the other pixels
+			ShadowRay ray;
+			ray.from = P;
+			ray.to = lightPos;
+			ray.color = vLightIntensity * (dp / sqrtf(l2));
+			ray.light = light;
+			ray.pixel = pBatch->pixel;
+			pBatch->shadowRays.push_back(ray);
+			continue;
+		}
+
+		if (m_scene.Occluded(P, lightPos))
 			continue;
 
 		// diffuse
@@ -403,7 +919,7 @@ inline void SoftwareRenderer::AddLighting(Vec3 & color, const Vec3 & P, const Ve
 	}
 }
 
-inline Vec3 SoftwareRenderer::CalcFloorIllumination(const Vec3 & P) const
+inline Vec3 SoftwareRenderer::CalcFloorIllumination(const Vec3 & P, PixelSampler & sampler) const
 {
 	Vec3 l = Vec3(1.f);
 
@@ -412,10 +928,9 @@ inline Vec3 SoftwareRenderer::CalcFloorIllumination(const Vec3 & P) const
 		int n = 0;
 		for (int i = 0; i < m_numAmbientOcclusionSamples; i++)
 		{// ambient occlusion
-			Vec3 vRandDir = RandomDirection(Vec3::Z);
+			Vec3 vRandDir = RandomDirection(Vec3::Z, sampler.Next2D());
 			
-			TraceResult otl;
-			if (!m_scene.TraceRay(P, P + vRandDir * m_fRayLength, otl))
+			if (!m_scene.Occluded(P, P + vRandDir * m_fRayLength))
 				n++;
 		}
 
@@ -425,7 +940,7 @@ inline Vec3 SoftwareRenderer::CalcFloorIllumination(const Vec3 & P) const
 	for (std::vector<ILight *>::const_iterator it = m_lights.begin(); it != m_lights.end(); ++it)
 	{// lighting
 		const ILight * pLight = *it;
-		Vec3 lightPos = pLight->Position(P);
+		Vec3 lightPos = pLight->Position(P, UniformSphere(sampler.Next2D()));
 		Vec3 lightDir = lightPos - P;
 		float l2 = lightDir.LengthSquared();
 		if (l2 == 0.f)
@@ -439,8 +954,7 @@ inline Vec3 SoftwareRenderer::CalcFloorIllumination(const Vec3 & P) const
 		if (vLightIntensity == Vec3::Null)
 			continue;
 				
-		TraceResult ltr;
-		if (m_scene.TraceRay(P, lightPos, ltr))
+		if (m_scene.Occluded(P, lightPos))
 			continue;
 		
 		// diffuse
@@ -462,36 +976,48 @@ inline void FixNormal(Vec3 &normal, const Vec3 &triangleNormal)
 
 // ------------------------------------------------------------------------ //
 
-SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3 & v2, int nTraceDepth, const CollisionTriangle * pPrevTriangle, MaterialStack & ms) const
+inline Vec3 SoftwareRenderer::ClipByFloor(const Vec3 & v1, const Vec3 & v2) const
+{
+	if (m_showFloor && v2.z < 0.f)// && nTraceDepth == 0)
+		return Vec3::Lerp(v1, v2, v1.z / (v1.z - v2.z));
+
+	return v2;
+}
+
+SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3 & v2, int nTraceDepth, const CollisionTriangle * pPrevTriangle, CollisionVolume * pPrevVolume, MaterialStack & ms,
+													PixelSampler & sampler, const TraceResult * pFirstHit, LightingBatch * pBatch) const
 {
 	TraceResult tr;
-	tr.pTriangle = pPrevTriangle;
+	if (pFirstHit)
+		tr = *pFirstHit;
+	else
+	{
+		tr.pTriangle = pPrevTriangle;
+		tr.pVolume = pPrevVolume;
+	}
 	tr.pTC = &ms;
 
 	int nMaterialIndex;
-	Vec3 vOrigin = v1, vDest = v2;
-	if (m_showFloor)// && nTraceDepth == 0)
-	{// floor clipping
-		if (vDest.z < 0.f)
-			vDest = Vec3::Lerp(vOrigin, vDest, vOrigin.z / (vOrigin.z - vDest.z));
-	}
+	Vec3 vOrigin = v1, vDest = ClipByFloor(v1, v2);
 
 	Vec3 I = v2 - v1;
 	while (true)
 	{
-		if (!m_scene.TraceRay(vOrigin, vDest, tr))
+		const bool bHit = pFirstHit ? tr.pTriangle != pPrevTriangle : m_scene.TraceRay(vOrigin, vDest, tr);
+		pFirstHit = NULL;
+		if (!bHit)
 		{
 			Vec3 envColor = EnvironmentColor(I);
 			if (vDest.z != v2.z)
 			{// floor
 				if (m_floorShadow > 0.f)
-					envColor.Scale(Vec3::Lerp(Vec3(1.f), CalcFloorIllumination(vDest), m_floorShadow));
+					envColor.Scale(Vec3::Lerp(Vec3(1.f), CalcFloorIllumination(vDest, sampler), m_floorShadow));
 
 				float fresnel = m_floorIOR > 1.f ? FresnelReflection(Vec3::Normalize(I), Vec3::Z, 1.f, m_floorIOR) : 0.f;
 				if (fresnel <= 0.01f)
 					return Result(envColor, Vec3::Null, vDest);
 
-				Result res = TraceRay(vDest, vDest + Vec3(I.x, I.y, -I.z), nTraceDepth + 1, NULL, ms);
+				Result res = TraceRay(vDest, vDest + Vec3(I.x, I.y, -I.z), nTraceDepth + 1, NULL, NULL, ms, sampler);
 				res.color = Vec3::Lerp(envColor, res.color, fresnel);
 				return res;
 			}
@@ -608,13 +1134,13 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 		else
 		{
 			float reflectionRoughness = pMaterial->ReflectionRoughness(mc);
-			Vec3 RN = reflectionRoughness > 0.f ? Vec3::Normalize(N + Vec3Rand() * (reflectionRoughness * 0.25f)) : N;
+			Vec3 RN = reflectionRoughness > 0.f ? Vec3::Normalize(N + UniformSphere(sampler.Next2D()) * (cbrtf(sampler.Next1D()) * reflectionRoughness * 0.25f)) : N;
 			R = Vec3::Reflect(I, RN);
 			float dp = Vec3::Dot(R, TN);
 			if (dp < 0.f) R -= TN * dp;
 			Vec3 v1R = tr.pos + TN * m_fDistEpsilon;
 			MaterialStack msR(ms);
-			cR = TraceRay(v1R, v1R + R * m_fRayLength, nTraceDepth, tr.pTriangle, msR);
+			cR = TraceRay(v1R, v1R + R * m_fRayLength, nTraceDepth, tr.pTriangle, tr.pVolume, msR, sampler);
 			cR.color.Scale(pMaterial->ReflectionTint(mc));
 
 			if (tr.backface)
@@ -649,7 +1175,7 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 		else
 		{
 			float refractionRoughness = pMaterial->RefractionRoughness(mc);
-			Vec3 RN = refractionRoughness > 0.f ? Vec3::Normalize(N + Vec3Rand() * (refractionRoughness * 0.25f)) : N;
+			Vec3 RN = refractionRoughness > 0.f ? Vec3::Normalize(N + UniformSphere(sampler.Next2D()) * (cbrtf(sampler.Next1D()) * refractionRoughness * 0.25f)) : N;
 			float eta = tr.backface ? ior.x : 1.f / ior.x;
 //			float eta;
 //			printf("%c %g ", tr.backface ? '<' : '>', ior.x);
@@ -686,7 +1212,7 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 					ms.Add(pMaterial);
 
 				Vec3 v1T = tr.pos - TN * m_fDistEpsilon;
-				cT = TraceRay(v1T, v1T + T * m_fRayLength, nTraceDepth, tr.pTriangle, ms);
+				cT = TraceRay(v1T, v1T + T * m_fRayLength, nTraceDepth, tr.pTriangle, tr.pVolume, ms, sampler);
 				if (!tr.backface)
 				{
 					// absorption (Beer–Lambert law)
@@ -705,6 +1231,9 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 
 	Vec3 P = tr.pos + triangleNormal * m_fDistEpsilon;
 	Result res(Vec3::Null, opacity, tr.pos);
+	const size_t firstShadowRay = pBatch ? pBatch->shadowRays.size() : 0;
+	const size_t firstAmbientRay = pBatch ? pBatch->ambientRays.size() : 0;
+	Vec3 lightingWeight(1.f); // the same factors the lighting in res.color gets below, for the batched one
 
 	if (opacity.x > 0.f || opacity.y > 0.f || opacity.z > 0.f)
 	{
@@ -714,12 +1243,13 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 		{
 			float maxOpacity = fmaxf(fmaxf(opacity.x, opacity.y), opacity.z);
 			int numSamples = std::max<int>((int)(maxOpacity * m_ambientOcclusion * m_numAmbientOcclusionSamples), 1);
-			AddAmbientOcclusion(res.color, P, normal, triangleNormal, numSamples, tr, pMaterial, mc, bumpRes.x);
+			AddAmbientOcclusion(res.color, P, normal, triangleNormal, numSamples, tr, pMaterial, mc, bumpRes.x, pBatch, sampler);
 		}
 
-		AddLighting(res.color, P, normal, tr, pMaterial, mc, bumpRes.x);
+		AddLighting(res.color, P, normal, tr, pMaterial, mc, bumpRes.x, pBatch, sampler);
 
-		res.color.Scale(pMaterial->Diffuse(mc));
+		lightingWeight = pMaterial->Diffuse(mc);
+		res.color.Scale(lightingWeight);
 	}
 
 	if (bTransmission)
@@ -727,14 +1257,21 @@ SoftwareRenderer::Result SoftwareRenderer::TraceRay(const Vec3 & v1, const Vec3
 		res.color = Vec3::Lerp3(cT.color, res.color, opacity);
 		cT.opacity.Scale(Vec3(1.f) - res.opacity);
 		res.opacity += cT.opacity;
+		lightingWeight.Scale(opacity);
 	}
 
 	if (bReflection)
 	{
 		res.color = Vec3::Lerp3(res.color, cR.color, kR);
 		res.opacity = Vec3::Lerp3(res.opacity, cR.opacity, kR);
+		lightingWeight.Scale(Vec3(1.f) - kR);
 	}
 
+	for (size_t i = firstShadowRay; pBatch && i < pBatch->shadowRays.size(); i++)
+		pBatch->shadowRays[i].color.Scale(lightingWeight);
+	for (size_t i = firstAmbientRay; pBatch && i < pBatch->ambientRays.size(); i++)
+		pBatch->ambientRays[i].color.Scale(lightingWeight);
+
 	res.color += pMaterial->Emissive(mc);
 
 	return res;
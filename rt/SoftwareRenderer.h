@@ -7,8 +7,11 @@
 //
 #pragma once
 
+#include "Sampler.h"
 #include "../common/thread.h"
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 namespace mr
 {
@@ -31,24 +34,65 @@ class SoftwareRenderer
 	float	m_focalDistance;
 	float	m_dofBlur;
 	int		m_numAmbientOcclusionSamples;
+	bool	m_bSortAmbientRays;
 	std::vector<ILight *>	m_lights;
+	RandomSampler	m_randomSampler;
+	const ISampler *m_pSampler;
 
 	IImage *m_pImage;
 	RectI	m_rcRenderArea;
 	Vec3	m_vEyePos;
-	float	m_fFrameBlend;
 	Vec3	m_vCamDelta[3];
 	Vec2	m_dp;
 	Vec2	m_dofLC;
-	Vec2	m_dofDP;
 
-	std::atomic<int>	m_nAreaCounter;
-	int		m_numAreasX;
-	int		m_numAreas;
-	typedef TVec2<int>	Vec2I;
-	Vec2I	m_delta;
-	Vec2	m_random;
-	Matrix	m_matRandom;
+	// one sample of an area, the whole frame has one unless the areas are sampled continuously;
+	// the pixel jitter and the lens offset are sampled per pixel
+	struct Sample
+	{
+		float	fBlend;
+		int		nNumber; // the sample of the pixels the sampler gives
+	};
+
+	Sample	m_frameSample;
+
+	// The frame is cut into tiles ordered along a Hilbert curve, the tiles costly in the last frame are split in quarters.
+	// Every thread renders its own run of the areas and steals the back half of the longest other run when it's out of them.
+	struct Area
+	{
+		RectI	rc;
+		int		tile;
+	};
+
+	struct AreaQueue
+	{
+		std::mutex			mutex;
+		std::atomic<int>	begin; // changed under the mutex, read without it to choose the queue to steal from
+		std::atomic<int>	end;
+	};
+
+	int		m_tileSize;
+	int		m_numTilesX;
+	int		m_numTilesY;
+	std::vector<int>	m_tileOrder;
+	std::vector<Area>	m_areas;
+	std::vector<float>	m_areaCosts; // seconds, written by the thread rendering the area
+	std::unique_ptr<AreaQueue[]>	m_pAreaQueues; // one per render thread
+	std::atomic<int>	m_nThreadCounter;
+
+	// continuous sampling: the threads take the areas round and round, an area being sampled is skipped
+	struct AreaSamples
+	{
+		std::atomic<bool>	busy;
+		std::atomic<int>	count;
+	};
+
+	bool	m_bContinuous;
+	std::unique_ptr<AreaSamples[]>	m_pAreaSamples;
+	std::atomic<size_t>	m_nSampleCounter;
+	std::atomic<size_t>	m_numBusyAreas; // released under m_samplesMutex
+	std::mutex				m_samplesMutex;
+	std::condition_variable	m_areaReleased; // for the threads finding every area busy and for CopyContinuousImage
 
 	float	m_fDistEpsilon;
 	float	m_fRayLength;
@@ -70,10 +114,23 @@ class SoftwareRenderer
 		bool CheckTriangle(const CollisionTriangle *pTriangle, bool backface) const;
 	};
 
-	std::vector<Thread *> m_renderThreads;
-
-	bool GetNextArea(RectI & rc);
-	void RenderArea(const RectI & rc) const;
+	// the render threads live as long as the renderer and wait for the frames between them
+	std::vector<Thread *>	m_renderThreads;
+	std::mutex				m_threadsMutex;
+	std::condition_variable	m_frameStarted;
+	std::condition_variable	m_frameDone;
+	int						m_numStartingThreads; // the threads to wake up for the frame
+	int						m_numRenderingThreads; // the threads not done with the frame yet
+	bool					m_bStopThreads;
+	std::atomic<bool>		m_bInterrupted; // checked inside the areas too
+
+	void StartThreads(int numThreads);
+	void StopThreads();
+	void SetupFrame(IImage & image, const RectI * pViewportRect, const Matrix & matCamera, const Matrix & matViewProj, int numThreads);
+	void SetupSample(Sample & sample, int nSampleNumber) const;
+	void StartThreadsFrame();
+	void CreateAreas(bool bSplitCostlyTiles);
+	bool GetNextArea(int queue, int & area);
 
 	struct Result
 	{
@@ -84,16 +141,45 @@ class SoftwareRenderer
 		Result(const ColorF & c, const Vec3 & p) : color(c.r, c.g, c.b), opacity(c.a), pos(p) {}
 	};
 
-	Vec3 RandomDirection(const Vec3 & normal) const;
+	// Shadow and ambient occlusion rays of the camera hits of an area are collected while its pixels are shaded and traced afterwards.
+	// All shadow rays of a light go to one shared sample of it, so they converge and stay coherent.
+	struct ShadowRay
+	{
+		Vec3	from;
+		Vec3	to;
+		Vec3	color; // added to the pixel if nothing occludes the light or the environment
+		int		light; // -1 for ambient occlusion
+		int		pixel;
+	};
+
+	struct LightingBatch
+	{
+		std::vector<Vec3>		lightSamples; // random unit vector of every light for ILight::Position
+		std::vector<ShadowRay>	shadowRays;
+		std::vector<ShadowRay>	ambientRays;
+		int		pixel;
+	};
+
+	// colors and batch are the buffers of the calling thread, they are reused for all areas it renders
+	void RenderArea(const RectI & rc, const Sample & sample, std::vector<ColorF> & colors, LightingBatch & batch) const;
+	void RenderSamples(std::vector<ColorF> & colors, LightingBatch & batch);
+
+	Vec3 RandomDirection(const Vec3 & normal, const Vec2 & u) const;
 	Vec3 EnvironmentColor(const Vec3 & v) const;
-	Result TraceRay(const Vec3 & v1, const Vec3 & v2, int nTraceDepth, const CollisionTriangle * pPrevTriangle, MaterialStack & ms) const;
-	ColorF RenderPixel(const Vec2 & p) const;
+	// pFirstHit is the result of the first segment if it was already traced in a packet, the floor clipped one;
+	// lighting of the hit goes to pBatch instead of tracing its shadow rays; sampler gives the dimensions of the pixel sample
+	Result TraceRay(const Vec3 & v1, const Vec3 & v2, int nTraceDepth, const CollisionTriangle * pPrevTriangle, CollisionVolume * pPrevVolume, MaterialStack & ms,
+					PixelSampler & sampler, const TraceResult * pFirstHit = NULL, LightingBatch * pBatch = NULL) const;
+	void TraceShadowRays(LightingBatch & batch, ColorF * pColors) const;
+	void TraceAmbientOcclusionRays(LightingBatch & batch, ColorF * pColors) const;
+	Vec3 ClipByFloor(const Vec3 & v1, const Vec3 & v2) const;
+	void GetCameraRay(const Vec2 & p, const Vec2 & dofDP, Vec3 & vStart, Vec3 & vDest) const;
 
 	inline void AddAmbientOcclusion(Vec3 & color, const Vec3 & P, const Vec3 & N, const Vec3 & TN, int numSamples, const TraceResult & tr,
-									const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ) const;
+									const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ, LightingBatch * pBatch, PixelSampler & sampler) const;
 	inline void AddLighting(Vec3 & color, const Vec3 & P, const Vec3 & N, const TraceResult & tr,
-							const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ) const;
-	inline Vec3 CalcFloorIllumination(const Vec3 & P) const;
+							const IMaterialLayer * pMaterial, const MaterialContext & mc, float bumpZ, LightingBatch * pBatch, PixelSampler & sampler) const;
+	inline Vec3 CalcFloorIllumination(const Vec3 & P, PixelSampler & sampler) const;
 
 	static void ThreadFunc(void * pRenderer);
 
@@ -112,16 +198,25 @@ public:
 	void SetFloorIOR(float ior) { m_floorIOR = ior; }
 	void SetFloorShadow(float f) { m_floorShadow = f; }
 	void SetAmbientOcclusion(float f, size_t numSamples);
+	void SetAmbientOcclusionRaysSorting(bool b); // traces the ambient occlusion rays of an area in the direction and origin order
 	void SetDepthOfField(float blur);
 	void SetFocalDistance(float dist);
 	void SetLights(size_t num, ILight ** ppLights);
+	void SetSampler(const ISampler * pSampler); // NULL - independent random values; the sampler should live until the frame is done
+
+	// the frame nFrameNumber is the sample of the pixels, the frame 0 goes through their centers
+	void Render(IImage & image, const RectI * pViewportRect, const Matrix & matCamera, const Matrix & matViewProj,
+				int numThreads, int nFrameNumber); // numThreads 0 - one thread per CPU core
 
-	void Render(IImage & image, const RectI * pViewportRect,
-				const Matrix & matCamera, const Matrix & matViewProj, const Vec2 & vPixelOffset,
-				int numThreads, int nFrameNumber);
+	// Samples the areas one after another until Interrupt, every area blends its own samples in without waiting for the others.
+	// The image has the areas with different sample counts meanwhile.
+	void RenderContinuous(IImage & image, const RectI * pViewportRect, const Matrix & matCamera, const Matrix & matViewProj, int numThreads);
+	int NumContinuousSamples() const; // the samples every area has got
+	// copies the continuously sampled image to dest of the same width area by area, each one waits for the thread sampling it
+	void CopyContinuousImage(IImage & dest, int pixelSize);
 
-	void Join();
-	void Interrupt();
+	void Join(); // waits for the frame, the threads stay for the next one
+	void Interrupt(); // the areas being rendered are dropped too, the frame is incomplete
 };
 
 }
@@ -11,7 +11,8 @@ typedef struct
 	float3	center;
 	float3	extents;
 	float4	plane;
-	uint	childs[2];
+	uint	parent;
+	uint	secondChild; // 0 for leaves, the first child is the next node
 	uint	beginTriangle;
 	uint	endTriangle;
 } Node;
@@ -85,6 +86,35 @@ inline bool TraceRay(float3 rayOrigin, float3 rayDirection, const __global float
 
 // ------------------------------------------------------------------------ //
 
+// returns true if nothing can be closer than the hit found in the leaf
+inline bool TraceLeaf(const __global Node * node, const __global Triangle * triangles, const __global uint * nodeTriangles,
+					  float3 rayOrigin, float3 rayDirection, float3 * res, uint * cti)
+{
+	for (uint ti = node->beginTriangle; ti < node->endTriangle; ti++)
+	{
+		uint i = nodeTriangles[ti];
+		if (TraceRay(rayOrigin, rayDirection, triangles[i].pos, res))
+			*cti = i;
+	}
+
+	if ((*res).z < 1.0f && node->plane.x != 0.0f) // children of refitted trees overlap
+	{
+		float3 rayEnd = mad(rayDirection, (*res).z, rayOrigin);
+		return all(isgreaterequal(rayEnd, node->center - node->extents)) && all(islessequal(rayEnd, node->center + node->extents));
+	}
+
+	return false;
+}
+
+// the child the ray origin is in front of
+inline uint NearChild(const __global Node * nodes, uint index, float3 rayOrigin)
+{
+	const __global Node * node = nodes + index;
+	return isless(dot(rayOrigin, node->plane.xyz), node->plane.w) ? index + 1 : node->secondChild;
+}
+
+// ------------------------------------------------------------------------ //
+
 __kernel void MainKernel(__global float4 * result,
 						 const __global Triangle * triangles,
 						 const __global Node * nodes,
@@ -122,43 +152,64 @@ __kernel void MainKernel(__global float4 * result,
 
 		float4 color = 0.0f;
 
+#ifdef STACKLESS_TRAVERSAL
+		// Front to back without a stack: after the near child of a node comes its far sibling, after the far one
+		// the walk goes up by the parent links until it comes out of a near child
+		uint nodeIndex = 0;
+		bool bDone = false;
+		while (!bDone)
+		{
+			const __global Node * node = nodes + nodeIndex;
+			if (TestRayBoxIntersection(rayCenter, rayExtents, rayHalfDir, node->center, node->extents))
+			{
+				if (node->secondChild != 0)
+				{
+					nodeIndex = NearChild(nodes, nodeIndex, rayOrigin);
+					continue;
+				}
+
+				if (TraceLeaf(node, triangles, nodeTriangles, rayOrigin, rayDirection, &res, &cti))
+					break;
+			}
+
+			bDone = true;
+			while (nodeIndex != 0)
+			{
+				uint parent = nodes[nodeIndex].parent;
+				uint nearChild = NearChild(nodes, parent, rayOrigin);
+				if (nodeIndex == nearChild)
+				{
+					nodeIndex = nearChild == parent + 1 ? nodes[parent].secondChild : parent + 1;
+					bDone = false;
+					break;
+				}
+				nodeIndex = parent;
+			}
+		}
+#else
 		uint stack[64];
 		uint stackPos = 0;
 		stack[stackPos++] = 0;
 		while (stackPos > 0)
 		{
-			const __global Node * node = nodes + stack[--stackPos];
+			uint index = stack[--stackPos];
+			const __global Node * node = nodes + index;
 			if (!TestRayBoxIntersection(rayCenter, rayExtents, rayHalfDir, node->center, node->extents))
 				continue;
 
 //			color.xyz += 0.01f;
 
-			if (node->childs[0] != 0)
-			{
-				uint ni = isless(dot(rayOrigin, node->plane.xyz), node->plane.w);
-				stack[stackPos++] = node->childs[ni];
-				stack[stackPos++] = node->childs[1 - ni];
-			}
-			else
+			if (node->secondChild != 0)
 			{
-				for (uint ti = node->beginTriangle; ti < node->endTriangle; ti++)
-				{
-					uint i = nodeTriangles[ti];
-					if (TraceRay(rayOrigin, rayDirection, triangles[i].pos, &res))
-					{
-						cti = i;
-					}
-				}
-
-				if (res.z < 1.0f)
-				{
-					float3 rayEnd = mad(rayDirection, res.z, rayOrigin);
-					if (all(isgreaterequal(rayEnd, node->center - node->extents)) && all(islessequal(rayEnd, node->center + node->extents)))
-						stackPos = 0; // break;
-				}
+				uint nearChild = NearChild(nodes, index, rayOrigin);
+				stack[stackPos++] = nearChild == index + 1 ? node->secondChild : index + 1;
+				stack[stackPos++] = nearChild;
 			}
+			else if (TraceLeaf(node, triangles, nodeTriangles, rayOrigin, rayDirection, &res, &cti))
+				break;
 		}
-//		const __global Node * node = nodes + nodes[0].childs[0];
+#endif
+//		const __global Node * node = nodes + 1;
 //		if (TestRayBoxIntersection(rayCenter, rayExtents, rayHalfDir, node->center, node->extents))
 //			color.xyz += 0.2f;
 
@@ -39,9 +39,9 @@ Vec3 OmniLight::Intensity(float squared_distance) const
 	return m_intensity / squared_distance;
 }
 
-Vec3 OmniLight::Position(const Vec3 & p) const
+Vec3 OmniLight::Position(const Vec3 & p, const Vec3 & sample) const
 {
-	Vec3 delta = Vec3::Normalize(Vec3Rand()) * m_radius;
+	Vec3 delta = sample * m_radius;
 	return Vec3::Dot(delta, p - m_origin) > 0.f ? m_origin + delta : m_origin - delta;
 }
 
@@ -24,7 +24,7 @@ public:
 	float Radius() const { return m_radius; }
 	const Vec3 & Intensity() const { return m_intensity; }
 	
-	Vec3 Position(const Vec3 & p) const;
+	Vec3 Position(const Vec3 & p, const Vec3 & sample) const;
 	Vec3 Intensity(float squared_distance) const; // diffuse
 	Vec3 Intensity(const Vec3 & rayPos, const Vec3 & rayDir) const; // specular
 	bool TraceRay(const Vec3 & vFrom, const Vec3 & vTo, TraceResult & tr) const;
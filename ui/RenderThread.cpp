@@ -11,12 +11,18 @@
 #endif
 
 #include "RenderThread.h"
+#include <chrono>
 
 #include "../rt/SoftwareRenderer.h"
 #include "../rt/OpenCLRenderer.h"
 
 using namespace mr;
 
+enum
+{
+	CONTINUOUS_UPDATE_INTERVAL = 33, // ms between the render map updates of the continuously sampled image
+};
+
 RenderThread::RenderThread()
 	: m_mode(0)
 	, m_pRenderer(NULL)
@@ -28,6 +34,8 @@ RenderThread::RenderThread()
 	, m_fFramesRenderTime(0.0)
 	, m_bStop(true)
 	, m_bIsRenderMapUpdated(false)
+	, m_bContinuousSampling(false)
+	, m_nContinuousSamples(-1)
 {
 }
 
@@ -82,7 +90,12 @@ void RenderThread::Start(int mode, Image & renderMap, Image & buffer, const Matr
 
 void RenderThread::Stop()
 {
-	m_bStop = true;
+	{
+		std::lock_guard<std::mutex> lock(m_stopMutex);
+		m_bStop = true;
+		m_stopCondition.notify_all();
+	}
+
 	if (m_pRenderer && m_nFrameCount > 0)
 		m_pRenderer->Interrupt();
 
@@ -96,18 +109,44 @@ void RenderThread::Stop()
 void RenderThread::ThreadFunc()
 {
 	m_nFrameCount = 0;
+	m_nContinuousSamples = -1;
 	m_fFramesRenderTime = 0.0;
 	while (!m_bStop)
 	{
 		int nScale = m_nFrameCount < 2 ? (2 << (1 - m_nFrameCount)) : 1;
 		RectI rcViewport(0, 0, m_pRenderMap->Width() / nScale, m_pRenderMap->Height() / nScale);
 		double tm1 = Timer::GetSeconds();
+		if (m_mode == 0 && m_bContinuousSampling && m_nFrameCount >= 2)
+		{// the full size image is sampled from now on without a join between the passes, the map shows it as it is
+			if (m_nContinuousSamples < 0)
+			{
+				m_pRenderer->ResetRayCounter();
+				m_pRenderer->RenderContinuous(*m_pBuffer, &rcViewport, m_matCamera, m_matViewProj, m_numCPU);
+				m_nContinuousSamples = 0;
+			}
+
+			std::unique_lock<std::mutex> lock(m_stopMutex);
+			m_stopCondition.wait_for(lock, std::chrono::milliseconds(CONTINUOUS_UPDATE_INTERVAL), [this]() { return m_bStop; });
+			lock.unlock();
+
+			m_fFramesRenderTime += Timer::GetSeconds() - tm1;
+			m_nContinuousSamples = m_pRenderer->NumContinuousSamples();
+			if (m_nContinuousSamples == 0 || m_bStop)
+				continue; // the preview is shown until every area has its first sample
+
+			// the render threads keep writing the buffer, the renderer copies it area by area holding each one as they do
+			m_mutex.lock();
+			m_pRenderer->CopyContinuousImage(*m_pRenderMap, m_pRenderMap->PixelSize());
+			m_rcRenderMap = rcViewport;
+			m_bIsRenderMapUpdated = true;
+			m_mutex.unlock();
+			continue;
+		}
+
 		if (m_mode == 0)
 		{
 			m_pRenderer->ResetRayCounter();
-			m_pRenderer->Render(*m_pBuffer, &rcViewport, m_matCamera, m_matViewProj,
-								m_nFrameCount > 2 ? Vec2(frand(), frand()) : Vec2(0.5f, 0.5f),
-								m_numCPU, std::max(m_nFrameCount - 2, 0));
+			m_pRenderer->Render(*m_pBuffer, &rcViewport, m_matCamera, m_matViewProj, m_numCPU, std::max(m_nFrameCount - 2, 0));
 			m_pRenderer->Join();
 		}
 		else if (m_mode == 1 && m_pOpenCLRenderer)
@@ -140,6 +179,12 @@ void RenderThread::ThreadFunc()
 		if (m_nFrameCount > 2)
 			m_fFramesRenderTime += tm2 - tm1;
 	}
+
+	if (m_nContinuousSamples >= 0)
+	{// Stop may have interrupted the renderer before the sampling started
+		m_pRenderer->Interrupt();
+		m_pRenderer->Join();
+	}
 }
 
 RectI RenderThread::LockRenderMap()
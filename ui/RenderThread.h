@@ -9,6 +9,8 @@
 
 #include "../common/mutex.h"
 #include "../common/thread.h"
+#include <condition_variable>
+#include <mutex>
 
 namespace mr
 {
@@ -31,8 +33,12 @@ class RenderThread
 	volatile bool	m_bIsRenderMapUpdated;
 	volatile int	m_nFrameCount;
 	volatile double	m_fFramesRenderTime;
+	bool	m_bContinuousSampling;
+	volatile int	m_nContinuousSamples; // -1 until the continuous sampling starts
 	Mutex	m_mutex;
 	std::unique_ptr<Thread>	m_thread;
+	std::mutex				m_stopMutex;
+	std::condition_variable	m_stopCondition; // wakes the thread waiting for the next update of the continuously sampled image
 
 public:
 	RenderThread();
@@ -45,9 +51,13 @@ public:
 	void Start(int mode, Image & renderMap, Image & buffer, const Matrix & matCamera, const Matrix & matViewProj);
 	void Stop();
 
+	// the software renderer samples the full size image areas without waiting for each other, see SoftwareRenderer::RenderContinuous
+	bool ContinuousSampling() const { return m_bContinuousSampling; }
+	void SetContinuousSampling(bool b) { m_bContinuousSampling = b; } // takes effect on the next start
+
 	void ThreadFunc();
 
-	int FramesCount() const { return m_nFrameCount - 2; }
+	int FramesCount() const { return m_nContinuousSamples >= 0 ? m_nContinuousSamples : m_nFrameCount - 2; }
 	double FramesRenderTime() const { return m_fFramesRenderTime; }
 	bool IsRenderMapUpdated() const { return m_bIsRenderMapUpdated; }
 	RectI LockRenderMap();
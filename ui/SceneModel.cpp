@@ -18,6 +18,7 @@ SceneModel::SceneModel(BVH &bvh)
 	: m_bvh(bvh)
 	, m_pModel(NULL)
 	, m_pVolume(NULL)
+	, m_cacheKey(0)
 {
 }
 
@@ -65,9 +66,40 @@ bool SceneModel::Init(const char *pFilename, const Matrix &mat, ModelManager *pM
 		for (auto itGeom = (*itMesh)->m_geometries.begin(); itGeom != (*itMesh)->m_geometries.end(); ++itGeom)
 			numTriangles += (*itGeom)->m_indices.size() / 3;
 	}
-	
-	m_pVolume = m_bvh.CreateVolume(numTriangles);
+
+	// every placement of the same model is an instance of one collision mesh
+	CollisionMeshPtr pMesh = m_bvh.SharedMesh(m_pModel->Name(), numTriangles);
+	const bool bInstance = !pMesh->Triangles().empty();
+
+	m_pVolume = m_bvh.CreateVolume(pMesh);
 	m_pVolume->SetTransformation(mat);
+
+	if (bInstance)
+	{
+		double tm4 = Timer::GetSeconds();
+		printf("Collision mesh instanced: %ld triangles, %f ms\n", pMesh->Triangles().size(), (tm4 - tm3) * 1000.0);
+		return true;
+	}
+
+	// the built mesh is cached next to the model file, the cache refers to the materials by their order in the geometries
+	std::vector<const IMaterial *> materials;
+	for (auto itMesh = m_pModel->Meshes().begin(); itMesh != m_pModel->Meshes().end(); ++itMesh)
+	{
+		for (auto itGeom = (*itMesh)->m_geometries.begin(); itGeom != (*itMesh)->m_geometries.end(); ++itGeom)
+			materials.push_back((*itGeom)->m_pMaterial.get());
+	}
+
+	const std::string strCacheFilename = m_pModel->Name() + ".collision";
+	const uint64 cacheKey = CollisionMesh::CacheKey(m_pModel->Name().c_str());
+	if (cacheKey && pMesh->LoadCache(strCacheFilename.c_str(), cacheKey, materials))
+	{
+		m_bvh.UpdateMeshVolumes(pMesh.get());
+
+		double tm4 = Timer::GetSeconds();
+		printf("Collision mesh loaded from cache: %ld triangles, %d nodes, %f ms\n", pMesh->Triangles().size(),
+			   static_cast<int>(pMesh->Tree().NumNodes()), (tm4 - tm3) * 1000.0);
+		return true;
+	}
 	
 	for (auto itMesh = m_pModel->Meshes().begin(); itMesh != m_pModel->Meshes().end(); ++itMesh)
 	{
@@ -94,13 +126,46 @@ bool SceneModel::Init(const char *pFilename, const Matrix &mat, ModelManager *pM
 //		m_pVolume->Build(30);
 	}
 	
-	m_pVolume->Build(30);
+	m_pVolume->BuildAsync(); // renders the coarse tree until the high quality one is built
 
 	double tm4 = Timer::GetSeconds();
-	printf("Collision scene creating time: %ld triangles, %d nodes, %d, %f ms\n", m_pVolume->Triangles().size(),
-		   static_cast<int>(m_pVolume->Root()->GetNodeCount()),
-		   static_cast<int>(m_pVolume->Root()->GetChildrenDepth()),
+	printf("Collision scene coarse creating time: %ld triangles, %d nodes, %d, SAH %g, %f ms\n",
+		   m_pVolume->Triangles().size(),
+		   static_cast<int>(m_pVolume->Tree().NumNodes()),
+		   static_cast<int>(m_pVolume->Tree().GetDepth()),
+		   m_pVolume->Tree().GetSAHCost(),
 		   (tm4 - tm3) * 1000.0);
+
+	if (cacheKey) // saved when the high quality tree is built
+	{
+		m_strCacheFilename = strCacheFilename;
+		m_cacheKey = cacheKey;
+		m_cacheMaterials.swap(materials);
+	}
+	return true;
+}
+
+// ------------------------------------------------------------------------ //
+
+bool SceneModel::IsBuildFinished() const
+{
+	return m_pVolume && m_pVolume->Mesh()->IsBuildFinished();
+}
+
+bool SceneModel::FinishBuild()
+{
+	if (!IsBuildFinished())
+		return false;
+
+	const CollisionMeshPtr & pMesh = m_pVolume->Mesh();
+	pMesh->FinishBuild();
+	m_bvh.UpdateMeshVolumes(pMesh.get()); // updates the instances too
+
+	printf("Collision mesh build finished: %ld triangles, %d nodes, %d, SAH %g\n", pMesh->Triangles().size(),
+		   static_cast<int>(pMesh->Tree().NumNodes()), static_cast<int>(pMesh->Tree().GetDepth()), pMesh->Tree().GetSAHCost());
+
+	if (m_cacheKey)
+		pMesh->SaveCache(m_strCacheFilename.c_str(), m_cacheKey, m_cacheMaterials);
 	return true;
 }
 
@@ -56,6 +56,11 @@ class SceneModel : public ITransformable
 	typedef std::vector<RenderMesh *>	RenderMeshArray;
 	RenderMeshArray	m_meshes;
 
+	// the cache of a mesh built in background is saved when the build is finished
+	std::string						m_strCacheFilename;
+	uint64							m_cacheKey;
+	std::vector<const IMaterial *>	m_cacheMaterials;
+
 public:
 	SceneModel(BVH &bvh);
 	~SceneModel();
@@ -71,6 +76,10 @@ public:
 
 	CollisionVolume * GetVolume() const { return m_pVolume; }
 
+	// the collision mesh not found in the cache is rendered with a coarse tree until its full build is finished
+	bool IsBuildFinished() const;
+	bool FinishBuild(); // replaces the coarse tree with the finished one, rendering must be stopped
+
 	void Draw();
 	void DrawWireframe();
 	void DrawNormals(float l);
@@ -7,7 +7,7 @@
 //
 
 #include "SceneUtils.h"
-#include "../rt/CollisionNode.h"
+#include "../rt/CollisionTree.h"
 #ifdef _WIN32
 #define	sscanf		sscanf_s
 #endif // _WIN32
@@ -399,11 +399,13 @@ void DrawCircle(const Vec3 & p, const Vec3 & normal, float r1, float r2, const C
 	}
 }
 
-void DrawCollisionNode(const CollisionNode * pCN, byte level)
+void DrawCollisionNode(const CollisionTree & tree, uint32 index, byte level)
 {
-	if (!pCN)
+	if (index >= tree.NumNodes())
 		return;
 
+	const CollisionTree::Node * pCN = tree.Nodes() + index;
+
 	static Color colors[] = {Color(255, 0, 0), Color(0, 255, 0), Color(0, 0, 255), Color(255, 255, 0), Color(255, 0, 255), Color(0, 255, 255), Color(255, 128, 0)};
 	DrawWireframeBox(pCN->BoundingBox(), colors[level % 7]);
 
@@ -443,8 +445,11 @@ void DrawCollisionNode(const CollisionNode * pCN, byte level)
 //		glPolygonMode(GL_FRONT, GL_FILL);
 //	}
 
-	DrawCollisionNode(pCN->Child(0), level + 1);
-	DrawCollisionNode(pCN->Child(1), level + 1);
+	if (!pCN->IsLeaf())
+	{
+		DrawCollisionNode(tree, index + 1, level + 1);
+		DrawCollisionNode(tree, pCN->SecondChild(), level + 1);
+	}
 }
 
 // ------------------------------------------------------------------------ //
@@ -19,7 +19,7 @@ void DrawCone(const Vec3 & p1, const Vec3 & p2, float radius, const Color & c, i
 void DrawArrow(const Vec3 & pos, const Vec3 & dir, const Color & c, float l);
 void DrawCircle(const Vec3 & p, const Vec3 & normal, float r1, float r2, const Color & c1, const Color & c2, float borderLineWidth);
 void DrawGizmo(const Matrix & mat, const BBox & bbox);
-void DrawCollisionNode(const class CollisionNode * pCN, byte level);
+void DrawCollisionNode(const class CollisionTree & tree, uint32 index, byte level);
 
 bool GetRayAxisIntersectionDelta(const Vec3 & rayStart, const Vec3 & rayDir, const Vec3 & axisPos, const Vec3 & axisDir, float l, float t, Vec3 & delta);
 bool GetRayPlaneIntersectionDelta(const Vec3 & rayStart, const Vec3 & rayEnd, const Vec3 & axisPos, const Vec3 & axisDir, Vec3 & delta);
@@ -27,6 +27,18 @@ const float GIZMO_CIRCLE_RADIUS = 200.f;
 const float GIZMO_CIRCLE_THICKNESS = 20.f;
 const float GIZMO_BOX_SIZE = 30.f;
 const float GIZMO_MIN_SCALE = 0.1f;
+const int STRATIFIED_SAMPLER_CELLS = 64; // the samples after them go through the cells again
+
+static ISampler * CreateSampler(SceneView::eSampler sampler)
+{
+	switch (sampler)
+	{
+	case SceneView::SAMPLER_STRATIFIED: return new StratifiedSampler(STRATIFIED_SAMPLER_CELLS);
+	case SceneView::SAMPLER_SOBOL: return new SobolSampler(SobolSampler::SCRAMBLE_XOR);
+	case SceneView::SAMPLER_OWEN_SOBOL: return new SobolSampler(SobolSampler::SCRAMBLE_OWEN);
+	default: return new RandomSampler();
+	}
+}
 
 // ------------------------------------------------------------------------ //
 
@@ -52,11 +64,13 @@ SceneView::SceneView(const char * pResourcesPath)
 	, m_showWireframe(false)
 	, m_showNormals(false)
 	, m_showBVH(false)
+	, m_bSortAmbientRays(false)
 	, m_bShouldRedraw(false)
 	, m_width(0), m_height(0)
 	, m_texture(0)
 	, m_nFrameCount(0)
 	, m_renderMode(RM_SOFTWARE)
+	, m_sampler(SAMPLER_OWEN_SOBOL)
 	, m_pBVH(new BVH())
 	, m_pImageManager(new ImageManager())
 	, m_pModelManager(NULL)
@@ -81,6 +95,7 @@ SceneView::SceneView(const char * pResourcesPath)
 {
 	m_pModelManager.reset(new ModelManager(m_pImageManager.get()));
 	m_pRenderThread->SetRenderer(new SoftwareRenderer(*m_pBVH));
+	m_pSampler.reset(CreateSampler(m_sampler));
 
 	ResetCamera();
 }
@@ -159,6 +174,44 @@ void SceneView::SetShowFloor(bool b)
 	ResumeRenderThread();
 }
 
+bool SceneView::ContinuousSampling() const
+{
+	return m_pRenderThread->ContinuousSampling();
+}
+
+void SceneView::SetContinuousSampling(bool b)
+{
+	StopRenderThread();
+	m_pRenderThread->SetContinuousSampling(b);
+	ResumeRenderThread();
+}
+
+void SceneView::SetSampler(eSampler sampler)
+{
+	StopRenderThread();
+	m_sampler = sampler;
+	m_pSampler.reset(CreateSampler(sampler));
+	ResumeRenderThread();
+}
+
+void SceneView::SetAmbientOcclusionRaysSorting(bool b)
+{
+	StopRenderThread();
+	m_bSortAmbientRays = b;
+	ResumeRenderThread();
+}
+
+void SceneView::SetStacklessTraversal(bool b)
+{
+	StopRenderThread();
+	m_pBVH->SetStacklessTraversal(b);
+
+	// the kernel is built with the traversal chosen
+	m_pRenderThread->SetOpenCLRenderer(new OpenCLRenderer(*m_pBVH, (m_resourcesPath + "/kernel.cl").c_str(), "MainKernel"));
+
+	ResumeRenderThread();
+}
+
 void SceneView::ResetScene()
 {
 	StopRenderThread();
@@ -314,6 +367,26 @@ void SceneView::AppendModel(const char * pFilename)
 	}
 }
 
+void SceneView::FinishModelBuilds()
+{
+	bool bFinished = false;
+	for (auto it = m_models.begin(); it != m_models.end() && !bFinished; ++it)
+		bFinished = (*it)->IsBuildFinished();
+
+	if (!bFinished)
+		return;
+
+	StopRenderThread();
+
+	for (auto it = m_models.begin(); it != m_models.end(); ++it)
+		(*it)->FinishBuild();
+
+	// the OpenCL renderer holds a copy of the nodes
+	m_pRenderThread->SetOpenCLRenderer(new OpenCLRenderer(*m_pBVH, (m_resourcesPath + "/kernel.cl").c_str(), "MainKernel"));
+
+	ResumeRenderThread();
+}
+
 void SceneView::DeleteObject(ITransformable *pObject)
 {
 	StopRenderThread();
@@ -948,6 +1021,12 @@ bool SceneView::ShouldRedraw() const
 	if (m_bShouldRedraw)
 		return true;
 
+	for (auto it = m_models.begin(); it != m_models.end(); ++it)
+	{
+		if ((*it)->IsBuildFinished())
+			return true;
+	}
+
 	return (m_renderMode != RM_OPENGL) ? (m_pRenderMap && m_pRenderThread->IsRenderMapUpdated()) : false;
 }
 
@@ -961,6 +1040,8 @@ void SceneView::Set3DMode()
 
 void SceneView::Draw()
 {
+	FinishModelBuilds();
+
 	m_bShouldRedraw = false;
     glViewport(0, 0, (int)m_fWidth, (int)m_fHeight);
 	glClearColor(m_bgColor.r, m_bgColor.g, m_bgColor.b, m_bgColor.a);
@@ -997,7 +1078,7 @@ void SceneView::Draw()
 				(*it)->DrawNormals(m_fNearZ);
 
 			if (m_showBVH)
-				DrawCollisionNode(pVolume->Root(), 0);
+				DrawCollisionNode(pVolume->Tree(), 0, 0);
 
 			glPopMatrix();
 		}
@@ -1149,6 +1230,8 @@ void SceneView::ResumeRenderThread()
 			pRenderer->SetFocalDistance(m_fFocalDistance);
 			pRenderer->SetDepthOfField(m_fDepthOfField);
 			pRenderer->SetLights(m_lights.size(), (ILight **)m_lights.data());
+			pRenderer->SetSampler(m_pSampler.get());
+			pRenderer->SetAmbientOcclusionRaysSorting(m_bSortAmbientRays);
 		}
 
 		m_pRenderThread->Start(m_renderMode == RM_SOFTWARE ? 0 : 1,
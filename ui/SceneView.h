@@ -17,7 +17,7 @@ class RenderThread;
 
 class BVH;
 class CollisionVolume;
-class CollisionNode;
+class CollisionTree;
 class CollisionTriangle;
 struct TraceResult;
 
@@ -26,6 +26,7 @@ class IMaterial;
 class ISceneLight;
 
 class SceneModel;
+class ISampler;
 
 enum eMouseButton
 {
@@ -53,6 +54,14 @@ public:
 		RM_OPENCL,
 	};
 
+	enum eSampler
+	{
+		SAMPLER_RANDOM,
+		SAMPLER_STRATIFIED,
+		SAMPLER_SOBOL, // Sobol sequence with a random digital shift
+		SAMPLER_OWEN_SOBOL, // Owen scrambled Sobol sequence
+	};
+
 private:
 	const std::string	m_resourcesPath;
 	float	m_fWidth, m_fHeight;
@@ -72,11 +81,14 @@ private:
 	bool	m_showWireframe;
 	bool	m_showNormals;
 	bool	m_showBVH;
+	bool	m_bSortAmbientRays;
 	bool	m_bShouldRedraw;
 	GLint	m_width, m_height;
 	GLuint	m_texture;
 	int		m_nFrameCount;
 	eRenderMode		m_renderMode;
+	eSampler		m_sampler;
+	std::unique_ptr<ISampler>		m_pSampler;
 	std::unique_ptr<BVH>			m_pBVH;
 	std::shared_ptr<ImageManager>	m_pImageManager;
 	std::shared_ptr<ModelManager>	m_pModelManager;
@@ -110,6 +122,8 @@ private:
 
 	void RemoveAllLights();
 
+	void FinishModelBuilds(); // swaps in the collision trees built in background
+
 	void DeleteObject(ITransformable *pObject);
 
 	Vec3 GetFrustumPosition(float x, float y, float z) const;
@@ -153,6 +167,21 @@ public:
 
 	void SetBackgroundColor(const ColorF & bgColor) { m_bgColor = bgColor; m_bShouldRedraw = true; }
 
+	bool ContinuousSampling() const;
+	void SetContinuousSampling(bool b);
+
+	// the sample values of the pixels of the software renderer
+	eSampler Sampler() const { return m_sampler; }
+	void SetSampler(eSampler sampler);
+
+	// the software renderer traces the ambient occlusion rays of an area sorted by the direction and origin
+	bool AmbientOcclusionRaysSorting() const { return m_bSortAmbientRays; }
+	void SetAmbientOcclusionRaysSorting(bool b);
+
+	// the tree walk of the single rays and of the OpenCL kernel by the parent links instead of a stack
+	bool StacklessTraversal() const { return m_pBVH->StacklessTraversal(); }
+	void SetStacklessTraversal(bool b);
+
 	int FramesCount() const;
 	double FramesRenderTime() const;
 